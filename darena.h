@@ -0,0 +1,89 @@
+// Copyright (c) 2014 ipkn.
+// Licensed under the MIT license.
+
+#pragma once
+
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include "dptr.h"
+
+namespace dumpable
+{
+    // Bump allocator for building large structures before dumping them.
+    //
+    // While an arena_scope is active on a thread, dvector and dstring storage created on that
+    // thread outside dumpable::write comes from the arena. Containers never free it and do not
+    // destroy the elements in it; release() (or destroying the arena) frees everything at once.
+    // After that, containers using the storage must only be destroyed or reassigned, not read.
+    class arena : public build_allocator
+    {
+        public:
+            explicit arena(dumpable::size_t chunk_size = 1 << 20)
+                : chunkSize_(chunk_size), current_(nullptr), left_(0), used_(0)
+            {
+            }
+
+            void* allocate(dumpable::size_t size, dumpable::size_t alignment) override
+            {
+                dumpable::size_t padding = (alignment - (dumpable::size_t)current_ % alignment) % alignment;
+                if (padding + size > left_)
+                {
+                    // large requests get a chunk of their own
+                    dumpable::size_t chunk = std::max(chunkSize_, size + alignment);
+                    chunks_.push_back(std::unique_ptr<char[]>(new char[chunk]));
+                    current_ = chunks_.back().get();
+                    left_ = chunk;
+                    padding = (alignment - (dumpable::size_t)current_ % alignment) % alignment;
+                }
+                char* ret = current_ + padding;
+                current_ += padding + size;
+                left_ -= padding + size;
+                used_ += size;
+                return ret;
+            }
+
+            void release()
+            {
+                chunks_.clear();
+                current_ = nullptr;
+                left_ = 0;
+                used_ = 0;
+            }
+
+            // bytes handed out since the last release
+            dumpable::size_t used() const { return used_; }
+            dumpable::size_t chunk_count() const { return chunks_.size(); }
+
+        private:
+            arena(const arena&);
+            arena& operator = (const arena&);
+
+            dumpable::size_t chunkSize_;
+            std::vector<std::unique_ptr<char[]>> chunks_;
+            char* current_;
+            dumpable::size_t left_;
+            dumpable::size_t used_;
+    };
+
+    // Routes this thread's build-mode container allocations to allocator until the scope ends.
+    // Scopes nest; the previous allocator (or the heap) is restored on exit.
+    class arena_scope
+    {
+        public:
+            explicit arena_scope(build_allocator& allocator)
+                : previous_(detail::build_arena())
+            {
+                detail::build_arena() = &allocator;
+            }
+            ~arena_scope()
+            {
+                detail::build_arena() = previous_;
+            }
+        private:
+            arena_scope(const arena_scope&);
+            arena_scope& operator = (const arena_scope&);
+
+            build_allocator* previous_;
+    };
+}
@@ -0,0 +1,296 @@
+// Copyright (c) 2014 ipkn.
+// Licensed under the MIT license.
+
+#pragma once
+
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <cstdint>
+#include <unordered_map>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <future>
+#include <memory>
+#include <stdexcept>
+#include <algorithm>
+#include "dumpableconf.h"
+#include "dptr.h"
+
+#ifdef DUMPABLE_POSIX
+#include <unistd.h>
+#endif
+
+namespace dumpable
+{
+    namespace detail
+    {
+        // Background thread writing blocks at given file offsets, at most maxPending queued at once.
+        // Written buffers are handed back for reuse, so a writer with maxPending 2 is double-buffered.
+        class io_thread
+        {
+            public:
+                io_thread(const std::string& path, std::size_t maxPending)
+                    : fp_(std::fopen(path.c_str(), "wb")), maxPending_(maxPending), done_(false), failed_(false)
+                {
+                    if (!fp_)
+                        throw std::runtime_error("dumpable: cannot create " + path);
+                    thread_ = std::thread([this]{ run(); });
+                }
+                ~io_thread()
+                {
+                    finish(false);
+                }
+
+                void submit(std::uint64_t offset, std::vector<char>&& buffer, std::size_t size)
+                {
+                    std::unique_lock<std::mutex> lock(mutex_);
+                    changed_.wait(lock, [this]{ return queue_.size() < maxPending_; });
+                    job j = {offset, std::move(buffer), size};
+                    queue_.push_back(std::move(j));
+                    changed_.notify_all();
+                }
+
+                // a written buffer to reuse, or an empty one
+                std::vector<char> recycle()
+                {
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    if (free_.empty())
+                        return std::vector<char>();
+                    std::vector<char> ret = std::move(free_.back());
+                    free_.pop_back();
+                    return ret;
+                }
+
+                // Waits for every block, syncs the file to disk and closes it.
+                bool finish(bool sync)
+                {
+                    {
+                        std::lock_guard<std::mutex> lock(mutex_);
+                        if (done_)
+                            return !failed_;
+                        done_ = true;
+                        changed_.notify_all();
+                    }
+                    thread_.join();
+                    bool ok = !failed_ && std::fflush(fp_) == 0;
+#ifdef DUMPABLE_POSIX
+                    if (ok && sync)
+                        ok = fsync(fileno(fp_)) == 0;
+#else
+                    (void)sync;
+#endif
+                    ok = std::fclose(fp_) == 0 && ok;
+                    fp_ = nullptr;
+                    return ok;
+                }
+
+            private:
+                struct job
+                {
+                    std::uint64_t offset;
+                    std::vector<char> buffer;
+                    std::size_t size;
+                };
+
+                int seek(std::uint64_t offset)
+                {
+#if defined(_MSC_VER)
+                    return _fseeki64(fp_, (__int64)offset, SEEK_SET);
+#elif defined(DUMPABLE_POSIX)
+                    return fseeko(fp_, (off_t)offset, SEEK_SET);
+#else
+                    return std::fseek(fp_, (long)offset, SEEK_SET);
+#endif
+                }
+
+                void run()
+                {
+                    for(;;)
+                    {
+                        job j;
+                        {
+                            std::unique_lock<std::mutex> lock(mutex_);
+                            changed_.wait(lock, [this]{ return !queue_.empty() || done_; });
+                            if (queue_.empty())
+                                return;
+                            j = std::move(queue_.front());
+                            queue_.pop_front();
+                        }
+                        if (!failed_ && (seek(j.offset) != 0 ||
+                                    std::fwrite(j.buffer.data(), 1, j.size, fp_) != j.size))
+                            failed_ = true;
+                        std::lock_guard<std::mutex> lock(mutex_);
+                        free_.push_back(std::move(j.buffer));
+                        changed_.notify_all();
+                    }
+                }
+
+                std::FILE* fp_;
+                std::size_t maxPending_;
+                bool done_;
+                bool failed_;
+                std::deque<job> queue_;
+                std::vector<std::vector<char>> free_;
+                std::mutex mutex_;
+                std::condition_variable changed_;
+                std::thread thread_;
+        };
+    }
+
+    // Pool for write_async: bump-allocates from fixed-size blocks and sends a block to the I/O
+    // thread as soon as every allocation in it has been committed (filled, see dptr_commit),
+    // even while blocks before it are still being filled; blocks are written at their own offsets.
+    class async_pool
+    {
+        public:
+            async_pool(detail::io_thread& io, const void* root, dumpable::size_t rootSize, dumpable::size_t blockSize)
+                : io_(io), root_((const char*)root), rootSize_(rootSize), blockSize_(blockSize),
+                  size_(aligned(rootSize)), nextBlock_(0)
+            {
+            }
+
+            std::pair<void*, dumpable::ptrdiff_t> alloc(void* self, dumpable::size_t size)
+            {
+                if (!size)
+                    return std::make_pair(nullptr, 0);
+                size = aligned(size);
+                if (blocks_.empty() || current().used + size > current().buffer.size())
+                    new_block(size);
+                block& b = current();
+                char* allocated = &b.buffer[b.used];
+                dumpable::ptrdiff_t offset = size_;
+                b.used += size;
+                b.pending ++;
+                size_ += size;
+                pending_[allocated] = nextBlock_ - 1;
+                return std::make_pair(allocated, offset - offset_of(self));
+            }
+
+            void commit(void* allocated)
+            {
+                auto it = pending_.find(allocated);
+                if (it == pending_.end())
+                    return;
+                std::size_t id = it->second;
+                pending_.erase(it);
+                // the current block may still receive allocations; it is checked when the next one starts
+                if (-- blocks_[id].pending == 0 && id + 1 != nextBlock_)
+                    send(id);
+            }
+
+            // Sends the remaining blocks and then the root; returns the image size.
+            dumpable::size_t finish()
+            {
+                while(!blocks_.empty())
+                    send(blocks_.begin()->first);
+                std::vector<char> root(root_, root_ + rootSize_);
+                root.resize(aligned(rootSize_));
+                std::size_t size = root.size();
+                io_.submit(0, std::move(root), size);
+                return size_;
+            }
+
+            dumpable::size_t size() const { return size_; }
+
+        private:
+            struct block
+            {
+                std::uint64_t offset;
+                std::vector<char> buffer;
+                std::size_t used;
+                std::size_t pending;
+            };
+
+            static dumpable::size_t aligned(dumpable::size_t size)
+            {
+                return (size+(sizeof(size_t)-1))/sizeof(size_t)*sizeof(size_t);
+            }
+
+            block& current() { return blocks_[nextBlock_ - 1]; }
+
+            void new_block(dumpable::size_t size)
+            {
+                if (!blocks_.empty() && !current().pending)
+                    send(nextBlock_ - 1);
+                block& b = blocks_[nextBlock_ ++];
+                b.offset = size_;
+                b.buffer = io_.recycle();
+                b.buffer.assign(std::max(blockSize_, size), 0);
+                b.used = 0;
+                b.pending = 0;
+                starts_[b.buffer.data()] = b.offset;
+            }
+
+            void send(std::size_t id)
+            {
+                block& b = blocks_[id];
+                starts_.erase(b.buffer.data());
+                io_.submit(b.offset, std::move(b.buffer), b.used);
+                blocks_.erase(id);
+            }
+
+            dumpable::ptrdiff_t offset_of(void* self) const
+            {
+                if ((const char*)self >= root_ && (const char*)self < root_ + rootSize_)
+                    return (const char*)self - root_;
+                // self belongs to an allocation being filled, so its block has not been sent
+                auto it = starts_.upper_bound((const char*)self);
+                --it;
+                return (dumpable::ptrdiff_t)it->second + ((const char*)self - it->first);
+            }
+
+            detail::io_thread& io_;
+            const char* root_;
+            dumpable::size_t rootSize_;
+            dumpable::size_t blockSize_;
+            dumpable::size_t size_;
+            std::map<std::size_t, block> blocks_;
+            std::size_t nextBlock_;
+            std::map<const char*, std::uint64_t> starts_;
+            std::unordered_map<void*, std::size_t> pending_;
+    };
+
+    // Dumps data to path, overlapping serialization with disk writes: finished pool blocks are
+    // written by a background thread while the rest of the image is still being built.
+    // Returns once serialization is done; the future yields the image size when the file has been
+    // written and synced to disk, or throws if that failed. At most maxPending blocks wait for I/O.
+    template <typename T>
+    std::future<dumpable::size_t> write_async(const T& data, const std::string& path,
+            dumpable::size_t blockSize = 1 << 20, std::size_t maxPending = 2)
+    {
+        std::shared_ptr<detail::io_thread> io(new detail::io_thread(path, maxPending));
+        dumpable::size_t size;
+        {
+            T x;
+            async_pool pool(*io, &x, sizeof(T), blockSize);
+            detail::dptr_alloc() = [&pool](void* self, dumpable::size_t size)->std::pair<void*, dumpable::ptrdiff_t>{
+                    return pool.alloc(self, size);
+                };
+            detail::dptr_commit() = [&pool](void* allocated){
+                    pool.commit(allocated);
+                };
+            try
+            {
+                x = data;
+            }
+            catch(...)
+            {
+                detail::dptr_alloc() = nullptr;
+                detail::dptr_commit() = nullptr;
+                throw;
+            }
+            detail::dptr_alloc() = nullptr;
+            detail::dptr_commit() = nullptr;
+            size = pool.finish();
+        }
+        return std::async(std::launch::async, [io, size]()->dumpable::size_t{
+                if (!io->finish(true))
+                    throw std::runtime_error("dumpable: writing the image failed");
+                return size;
+            });
+    }
+}
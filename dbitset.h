@@ -0,0 +1,347 @@
+// Copyright (c) 2014 ipkn.
+// Licensed under the MIT license.
+
+#pragma once
+
+#include <vector>
+#include <algorithm>
+#include <cstdint>
+#include "dvector.h"
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define DUMPABLE_BITSET_SSE2
+#endif
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+namespace dumpable
+{
+    namespace detail
+    {
+        inline unsigned popcount64(std::uint64_t x)
+        {
+#if defined(__GNUC__)
+            return (unsigned)__builtin_popcountll(x);
+#elif defined(_MSC_VER) && defined(_M_X64)
+            return (unsigned)__popcnt64(x);
+#else
+            x = x - ((x >> 1) & 0x5555555555555555ULL);
+            x = (x & 0x3333333333333333ULL) + ((x >> 2) & 0x3333333333333333ULL);
+            x = (x + (x >> 4)) & 0x0f0f0f0f0f0f0f0fULL;
+            return (unsigned)((x * 0x0101010101010101ULL) >> 56);
+#endif
+        }
+
+        inline unsigned ctz64(std::uint64_t x)
+        {
+#if defined(__GNUC__)
+            return (unsigned)__builtin_ctzll(x);
+#elif defined(_MSC_VER) && defined(_M_X64)
+            unsigned long index;
+            _BitScanForward64(&index, x);
+            return (unsigned)index;
+#else
+            unsigned n = 0;
+            while(!(x & 1))
+            {
+                x >>= 1;
+                n ++;
+            }
+            return n;
+#endif
+        }
+
+        // position of the k-th (0-based) set bit of x; x must have more than k bits set
+        inline unsigned select64(std::uint64_t x, unsigned k)
+        {
+            unsigned base = 0;
+            for(;;)
+            {
+                unsigned ones = popcount64(x & 0xff);
+                if (k < ones)
+                    break;
+                k -= ones;
+                x >>= 8;
+                base += 8;
+            }
+            for(; k; k --)
+                x &= x - 1;
+            return base + ctz64(x);
+        }
+
+        struct bit_and { std::uint64_t operator()(std::uint64_t a, std::uint64_t b) const { return a & b; } };
+        struct bit_or { std::uint64_t operator()(std::uint64_t a, std::uint64_t b) const { return a | b; } };
+        struct bit_and_not { std::uint64_t operator()(std::uint64_t a, std::uint64_t b) const { return a & ~b; } };
+
+#ifdef DUMPABLE_BITSET_SSE2
+        inline __m128i apply_bits(bit_and, __m128i a, __m128i b) { return _mm_and_si128(a, b); }
+        inline __m128i apply_bits(bit_or, __m128i a, __m128i b) { return _mm_or_si128(a, b); }
+        inline __m128i apply_bits(bit_and_not, __m128i a, __m128i b) { return _mm_andnot_si128(b, a); }
+#endif
+
+        template <typename Op>
+        void apply_bits(std::uint64_t* dst, const std::uint64_t* src, std::size_t n)
+        {
+            std::size_t i = 0;
+#ifdef DUMPABLE_BITSET_SSE2
+            for(; i + 2 <= n; i += 2)
+            {
+                __m128i a = _mm_loadu_si128((const __m128i*)(dst+i));
+                __m128i b = _mm_loadu_si128((const __m128i*)(src+i));
+                _mm_storeu_si128((__m128i*)(dst+i), apply_bits(Op(), a, b));
+            }
+#endif
+            for(; i < n; i ++)
+                dst[i] = Op()(dst[i], src[i]);
+        }
+    }
+
+    // Packed bit array stored as 64-bit words.
+    // A cumulative popcount per block of 512 bits is kept for rank/select;
+    // it is always rebuilt when a dbitset is copied, so every dumped dbitset carries it.
+    class dbitset
+    {
+        public:
+            typedef dumpable::size_t size_type;
+            static const size_type word_bits = 64;
+            static const size_type block_words = 8;
+
+            dbitset() : size_(0) {}
+            explicit dbitset(size_type size) : size_(size)
+            {
+                words_.resize((size + word_bits - 1) / word_bits);
+            }
+            dbitset(const std::vector<bool>& v) : size_(v.size())
+            {
+                words_.resize((size_ + word_bits - 1) / word_bits);
+                for(size_type i = 0; i < size_; i ++)
+                    if (v[i])
+                        words_[i / word_bits] |= (std::uint64_t)1 << (i % word_bits);
+                build_index();
+            }
+            dbitset(const dbitset& rhs)
+                : words_(rhs.words_), size_(rhs.size_)
+            {
+                build_index(rhs.words_);
+            }
+            dbitset(dbitset&& rhs) noexcept
+                : words_(std::move(rhs.words_)), ranks_(std::move(rhs.ranks_)), size_(rhs.size_)
+            {
+                rhs.size_ = 0;
+            }
+
+            dbitset& operator = (const dbitset& rhs)
+            {
+                if (&rhs == this)
+                    return *this;
+                words_ = rhs.words_;
+                size_ = rhs.size_;
+                build_index(rhs.words_);
+                return *this;
+            }
+            dbitset& operator = (dbitset&& rhs) noexcept
+            {
+                if (&rhs == this)
+                    return *this;
+                words_ = std::move(rhs.words_);
+                ranks_ = std::move(rhs.ranks_);
+                size_ = rhs.size_;
+                rhs.size_ = 0;
+                return *this;
+            }
+
+            size_type size() const { return size_; }
+            bool empty() const { return !size_; }
+            const std::uint64_t* words() const { return words_.data(); }
+            size_type word_count() const { return words_.size(); }
+
+            bool test(size_type pos) const
+            {
+                return (words_[pos / word_bits] >> (pos % word_bits)) & 1;
+            }
+            bool operator[](size_type pos) const { return test(pos); }
+
+            // set/reset invalidate the rank index until build_index is called again.
+            void set(size_type pos, bool value = true)
+            {
+                std::uint64_t mask = (std::uint64_t)1 << (pos % word_bits);
+                if (value)
+                    words_[pos / word_bits] |= mask;
+                else
+                    words_[pos / word_bits] &= ~mask;
+                ranks_.clear();
+            }
+            void reset(size_type pos) { set(pos, false); }
+
+            void resize(size_type size)
+            {
+                words_.resize((size + word_bits - 1) / word_bits);
+                size_ = size;
+                if (size % word_bits)
+                    words_.back() &= ((std::uint64_t)1 << (size % word_bits)) - 1;
+                ranks_.clear();
+            }
+
+            void build_index()
+            {
+                build_index(words_);
+            }
+            bool has_index() const { return !ranks_.empty(); }
+
+            size_type count() const
+            {
+                if (has_index())
+                    return ranks_.back();
+                return count_words(0, words_.size());
+            }
+
+            // number of set bits in [0, pos)
+            size_type rank(size_type pos) const
+            {
+                size_type word = pos / word_bits;
+                size_type result;
+                if (has_index())
+                    result = ranks_[word / block_words] + count_words(word / block_words * block_words, word);
+                else
+                    result = count_words(0, word);
+                if (pos % word_bits)
+                    result += detail::popcount64(words_[word] & (((std::uint64_t)1 << (pos % word_bits)) - 1));
+                return result;
+            }
+
+            // position of the k-th (0-based) set bit, or size() if there are not that many
+            size_type select(size_type k) const
+            {
+                size_type word = 0;
+                if (has_index())
+                {
+                    if (k >= ranks_.back())
+                        return size_;
+                    size_type block = std::upper_bound(ranks_.begin(), ranks_.end(), k) - ranks_.begin() - 1;
+                    k -= ranks_[block];
+                    word = block * block_words;
+                }
+                for(; word < words_.size(); word ++)
+                {
+                    unsigned ones = detail::popcount64(words_[word]);
+                    if (k < ones)
+                        return word * word_bits + detail::select64(words_[word], (unsigned)k);
+                    k -= ones;
+                }
+                return size_;
+            }
+
+            // number of clear bits in [0, pos)
+            size_type rank0(size_type pos) const
+            {
+                return pos - rank(pos);
+            }
+
+            // position of the k-th (0-based) clear bit, or size() if there are not that many
+            size_type select0(size_type k) const
+            {
+                size_type word = 0;
+                if (has_index())
+                {
+                    // clear bits before each block never decrease, so blocks are binary searched too
+                    size_type lo = 0, hi = ranks_.size() - 1;
+                    while(lo + 1 < hi)
+                    {
+                        size_type mid = (lo + hi) / 2;
+                        if (mid * block_words * word_bits - ranks_[mid] <= k)
+                            lo = mid;
+                        else
+                            hi = mid;
+                    }
+                    k -= lo * block_words * word_bits - ranks_[lo];
+                    word = lo * block_words;
+                }
+                for(; word < words_.size(); word ++)
+                {
+                    unsigned zeros = detail::popcount64(~words_[word]);
+                    if (k < zeros)
+                    {
+                        size_type pos = word * word_bits + detail::select64(~words_[word], (unsigned)k);
+                        return pos < size_ ? pos : size_;
+                    }
+                    k -= zeros;
+                }
+                return size_;
+            }
+
+            dbitset& operator &= (const dbitset& rhs)
+            {
+                size_type n = std::min(words_.size(), rhs.words_.size());
+                detail::apply_bits<detail::bit_and>(words_.data(), rhs.words(), n);
+                std::fill(words_.begin() + n, words_.end(), 0);
+                build_index();
+                return *this;
+            }
+            dbitset& operator |= (const dbitset& rhs)
+            {
+                detail::apply_bits<detail::bit_or>(words_.data(), rhs.words(), std::min(words_.size(), rhs.words_.size()));
+                if (size_ % word_bits && rhs.size_ > size_)
+                    words_.back() &= ((std::uint64_t)1 << (size_ % word_bits)) - 1;
+                build_index();
+                return *this;
+            }
+            // clears every bit that is set in rhs
+            dbitset& and_not(const dbitset& rhs)
+            {
+                detail::apply_bits<detail::bit_and_not>(words_.data(), rhs.words(), std::min(words_.size(), rhs.words_.size()));
+                build_index();
+                return *this;
+            }
+
+        private:
+            // words may not be our own: while dumping, pooled storage cannot be read back.
+            void build_index(const dvector<std::uint64_t>& words)
+            {
+                if (words.empty())
+                {
+                    ranks_.clear();
+                    return;
+                }
+                size_type blocks = (words.size() + block_words - 1) / block_words;
+                std::vector<dumpable::size_t> ranks(blocks + 1);
+                dumpable::size_t sum = 0;
+                for(size_type i = 0; i < words.size(); i ++)
+                {
+                    if (i % block_words == 0)
+                        ranks[i / block_words] = sum;
+                    sum += detail::popcount64(words[i]);
+                }
+                ranks[blocks] = sum;
+                ranks_ = ranks;
+            }
+
+            size_type count_words(size_type first, size_type last) const
+            {
+                size_type sum = 0;
+                for(size_type i = first; i < last; i ++)
+                    sum += detail::popcount64(words_[i]);
+                return sum;
+            }
+
+            dvector<std::uint64_t> words_;
+            dvector<dumpable::size_t> ranks_;
+            size_type size_;
+    };
+
+    inline dbitset operator & (const dbitset& a, const dbitset& b)
+    {
+        dbitset ret(a);
+        ret &= b;
+        return ret;
+    }
+
+    inline dbitset operator | (const dbitset& a, const dbitset& b)
+    {
+        dbitset ret(a);
+        ret |= b;
+        return ret;
+    }
+}
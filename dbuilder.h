@@ -0,0 +1,112 @@
+// Copyright (c) 2014 ipkn.
+// Licensed under the MIT license.
+
+#pragma once
+
+#include <iostream>
+#include <vector>
+#include <new>
+#include <cstring>
+#include "dptr.h"
+#include "dpool.h"
+#include "dtraits.h"
+
+namespace dumpable
+{
+    // Writes several roots, of any types, into one image sharing one pool.
+    //
+    // add() dumps a root and returns its offset in the image; the first root is at offset 0,
+    // so an image holding a single root reads exactly like one from dumpable::write.
+    // Read a root back with from_dumped_buffer<T>((char*)buffer + offset).
+    // With share_payloads, identical string and POD vector contents are stored once across all roots;
+    // such payloads must then not be modified in place after loading.
+    class image_builder
+    {
+        public:
+            explicit image_builder(bool share_payloads = false)
+                : sharePayloads_(share_payloads)
+            {
+            }
+
+            template <typename T>
+            dumpable::size_t add(const T& data)
+            {
+                void* root;
+                dumpable::ptrdiff_t offset;
+                std::tie(root, offset) = pool_.alloc_root(sizeof(T));
+                if (is_trivially_dumpable<T>::value)
+                {
+                    std::memcpy(root, &data, sizeof(T));
+                    offsets_.push_back((dumpable::size_t)offset);
+                    return (dumpable::size_t)offset;
+                }
+                detail::dptr_alloc() = [this](void* self, dumpable::size_t size)->std::pair<void*, dumpable::ptrdiff_t>{
+                        return pool_.alloc(self, size);
+                    };
+                if (sharePayloads_)
+                    detail::dptr_alloc_shared() = [this](void* self, const void* bytes, dumpable::size_t size)->std::pair<void*, dumpable::ptrdiff_t>{
+                            return pool_.alloc_shared(self, bytes, size);
+                        };
+                try
+                {
+                    // the root lives in the pool and is never destroyed: its bytes are the image
+                    T* x = new (root) T();
+                    *x = data;
+                }
+                catch(...)
+                {
+                    reset_alloc();
+                    throw;
+                }
+                reset_alloc();
+                offsets_.push_back((dumpable::size_t)offset);
+                return (dumpable::size_t)offset;
+            }
+
+            const std::vector<dumpable::size_t>& offsets() const { return offsets_; }
+            dumpable::size_t size() const { return pool_.size(); }
+
+            void write(std::ostream& os)
+            {
+                pool_.write(os);
+            }
+
+        private:
+            image_builder(const image_builder&);
+            image_builder& operator = (const image_builder&);
+
+            static void reset_alloc()
+            {
+                detail::dptr_alloc() = nullptr;
+                detail::dptr_alloc_shared() = nullptr;
+            }
+
+            dpool pool_;
+            bool sharePayloads_;
+            std::vector<dumpable::size_t> offsets_;
+    };
+
+    namespace detail
+    {
+        inline void add_roots(image_builder&)
+        {
+        }
+
+        template <typename T, typename... Ts>
+        void add_roots(image_builder& builder, const T& root, const Ts&... roots)
+        {
+            builder.add(root);
+            add_roots(builder, roots...);
+        }
+    }
+
+    // Writes all roots into one image and returns their offsets in argument order.
+    template <typename... Ts>
+    std::vector<dumpable::size_t> write_many(std::ostream& os, const Ts&... roots)
+    {
+        image_builder builder;
+        detail::add_roots(builder, roots...);
+        builder.write(os);
+        return builder.offsets();
+    }
+}
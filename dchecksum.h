@@ -0,0 +1,422 @@
+// Copyright (c) 2014 ipkn.
+// Licensed under the MIT license.
+
+#pragma once
+
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <thread>
+#include <stdexcept>
+#include <algorithm>
+#include <cstring>
+#include <cstdint>
+#include "dumpableconf.h"
+#include "dvmem.h"
+#include "dfile.h"
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define DUMPABLE_CRC32C_SSE42
+#include <nmmintrin.h>
+#define DUMPABLE_TARGET_SSE42 __attribute__((target("sse4.2")))
+#elif defined(_M_X64) && defined(_MSC_VER)
+#define DUMPABLE_CRC32C_SSE42
+#include <nmmintrin.h>
+#include <intrin.h>
+#define DUMPABLE_TARGET_SSE42
+#endif
+
+#ifdef DUMPABLE_POSIX
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#endif
+
+namespace dumpable
+{
+    template <typename T>
+    void write(const T& data, std::ostream& os);
+
+    namespace detail
+    {
+        // CRC32C (Castagnoli, reflected polynomial 0x82f63b78), slicing-by-8 tables
+        inline const std::uint32_t (*crc32c_table())[256]
+        {
+            static std::uint32_t table[8][256];
+            static bool ready = [&]{
+                for(std::uint32_t i = 0; i < 256; i ++)
+                {
+                    std::uint32_t crc = i;
+                    for(int k = 0; k < 8; k ++)
+                        crc = crc & 1 ? (crc >> 1) ^ 0x82f63b78u : crc >> 1;
+                    table[0][i] = crc;
+                }
+                for(std::uint32_t i = 0; i < 256; i ++)
+                    for(int t = 1; t < 8; t ++)
+                        table[t][i] = (table[t-1][i] >> 8) ^ table[0][table[t-1][i] & 0xff];
+                return true;
+            }();
+            (void)ready;
+            return table;
+        }
+
+        // crc is the raw register value: no pre- or post-inversion
+        inline std::uint32_t crc32c_sw(std::uint32_t crc, const unsigned char* p, std::size_t size)
+        {
+            const std::uint32_t (*t)[256] = crc32c_table();
+            for(; size >= 8; size -= 8, p += 8)
+            {
+                std::uint32_t lo, hi;
+                std::memcpy(&lo, p, 4);
+                std::memcpy(&hi, p + 4, 4);
+                lo ^= crc;
+                crc = t[7][lo & 0xff] ^ t[6][(lo >> 8) & 0xff] ^ t[5][(lo >> 16) & 0xff] ^ t[4][lo >> 24] ^
+                    t[3][hi & 0xff] ^ t[2][(hi >> 8) & 0xff] ^ t[1][(hi >> 16) & 0xff] ^ t[0][hi >> 24];
+            }
+            for(; size; size --, p ++)
+                crc = (crc >> 8) ^ t[0][(crc ^ *p) & 0xff];
+            return crc;
+        }
+
+#ifdef DUMPABLE_CRC32C_SSE42
+        DUMPABLE_TARGET_SSE42
+        inline std::uint32_t crc32c_hw(std::uint32_t crc, const unsigned char* p, std::size_t size)
+        {
+            std::uint64_t c = crc;
+            for(; size >= 8; size -= 8, p += 8)
+            {
+                std::uint64_t v;
+                std::memcpy(&v, p, 8);
+                c = _mm_crc32_u64(c, v);
+            }
+            crc = (std::uint32_t)c;
+            for(; size; size --, p ++)
+                crc = _mm_crc32_u8(crc, *p);
+            return crc;
+        }
+
+        inline bool crc32c_hw_available()
+        {
+#if defined(_MSC_VER)
+            static bool available = []{
+                int info[4];
+                __cpuid(info, 1);
+                return (info[2] & (1 << 20)) != 0;
+            }();
+#else
+            static bool available = __builtin_cpu_supports("sse4.2") != 0;
+#endif
+            return available;
+        }
+#else
+        inline bool crc32c_hw_available() { return false; }
+#endif
+
+        inline std::uint32_t crc32c_update(std::uint32_t crc, const unsigned char* p, std::size_t size)
+        {
+#ifdef DUMPABLE_CRC32C_SSE42
+            if (crc32c_hw_available())
+                return crc32c_hw(crc, p, size);
+#endif
+            return crc32c_sw(crc, p, size);
+        }
+
+        const char checksum_magic[8] = {'D', 'C', 'R', 'C', '3', '2', 'C', '\0'};
+
+        // Trailer appended after an image: one CRC32C per chunk, then this footer at the very end,
+        // so the image itself still starts at offset 0.
+        struct checksum_footer
+        {
+            char magic[8];
+            std::uint64_t imageSize;
+            std::uint64_t chunkSize;
+            std::uint64_t chunkCount;
+        };
+
+        inline bool valid_checksum_footer(const checksum_footer& footer, std::size_t fileSize)
+        {
+            return !std::memcmp(footer.magic, checksum_magic, sizeof(footer.magic)) && footer.chunkSize &&
+                footer.chunkCount == (footer.imageSize + footer.chunkSize - 1) / footer.chunkSize &&
+                footer.imageSize + footer.chunkCount * 4 + sizeof(footer) == fileSize;
+        }
+
+        inline bool read_checksum_footer(const void* file, std::size_t fileSize, checksum_footer& footer)
+        {
+            if (fileSize < sizeof(footer))
+                return false;
+            std::memcpy(&footer, (const char*)file + fileSize - sizeof(footer), sizeof(footer));
+            return valid_checksum_footer(footer, fileSize);
+        }
+
+        inline std::uint32_t stored_checksum(const void* file, const checksum_footer& footer, std::size_t chunk)
+        {
+            std::uint32_t crc;
+            std::memcpy(&crc, (const char*)file + footer.imageSize + chunk * 4, 4);
+            return crc;
+        }
+
+        inline bool check_chunk(const void* file, const checksum_footer& footer, std::size_t chunk)
+        {
+            std::size_t offset = (std::size_t)(chunk * footer.chunkSize);
+            std::size_t size = (std::size_t)std::min<std::uint64_t>(footer.chunkSize, footer.imageSize - offset);
+            const unsigned char* p = (const unsigned char*)file + offset;
+            return ~crc32c_update(~0u, p, size) == stored_checksum(file, footer, chunk);
+        }
+    }
+
+    // CRC32C of data; pass a previous result as crc to continue it over more bytes.
+    // Uses the SSE4.2 crc32 instruction when the CPU has it.
+    inline std::uint32_t crc32c(const void* data, std::size_t size, std::uint32_t crc = 0)
+    {
+        return ~detail::crc32c_update(~crc, (const unsigned char*)data, size);
+    }
+
+    // Writes the checksum trailer of image; write it right after the image bytes.
+    inline void write_checksums(const void* image, std::size_t size, std::ostream& os, std::size_t chunkSize = 64*1024)
+    {
+        if (!chunkSize)
+            throw std::invalid_argument("dumpable::write_checksums: chunkSize must not be 0");
+        detail::checksum_footer footer;
+        std::memcpy(footer.magic, detail::checksum_magic, sizeof(footer.magic));
+        footer.imageSize = size;
+        footer.chunkSize = chunkSize;
+        footer.chunkCount = (size + chunkSize - 1) / chunkSize;
+        std::vector<std::uint32_t> crcs((std::size_t)footer.chunkCount);
+        for(std::size_t i = 0; i < crcs.size(); i ++)
+            crcs[i] = crc32c((const char*)image + i * chunkSize, std::min(chunkSize, size - i * chunkSize));
+        os.write((const char*)crcs.data(), crcs.size() * 4);
+        os.write((const char*)&footer, sizeof(footer));
+    }
+
+    // Dumps data followed by its checksum trailer.
+    template <typename T>
+    void write_with_checksums(const T& data, std::ostream& os, std::size_t chunkSize = 64*1024)
+    {
+        std::ostringstream image;
+        dumpable::write(data, image);
+        std::string bytes = image.str();
+        os.write(bytes.data(), bytes.size());
+        write_checksums(bytes.data(), bytes.size(), os, chunkSize);
+    }
+
+    // Chunks of a checksummed file (image plus trailer) whose checksum does not match, in order.
+    // Chunks are checked by threads workers (0: one per hardware thread).
+    inline std::vector<std::size_t> find_corrupted_chunks(const void* file, std::size_t fileSize, unsigned threads = 0)
+    {
+        detail::checksum_footer footer;
+        if (!detail::read_checksum_footer(file, fileSize, footer))
+            throw std::runtime_error("dumpable: no checksum trailer");
+        std::size_t count = (std::size_t)footer.chunkCount;
+        if (!threads)
+            threads = std::max(1u, std::thread::hardware_concurrency());
+        threads = (unsigned)std::min<std::size_t>(threads, count);
+
+        std::vector<std::vector<std::size_t>> bad(std::max(threads, 1u));
+        auto check = [&](unsigned worker){
+                for(std::size_t c = count * worker / threads; c < count * (worker + 1) / threads; c ++)
+                    if (!detail::check_chunk(file, footer, c))
+                        bad[worker].push_back(c);
+            };
+        std::vector<std::thread> workers;
+        for(unsigned i = 1; i < threads; i ++)
+            workers.emplace_back(check, i);
+        if (threads)
+            check(0);
+        for(auto& w : workers)
+            w.join();
+
+        std::vector<std::size_t> ret;
+        for(std::size_t i = 0; i < bad.size(); i ++)
+            ret.insert(ret.end(), bad[i].begin(), bad[i].end());
+        return ret;
+    }
+
+    inline bool verify_image(const void* file, std::size_t fileSize, unsigned threads = 0)
+    {
+        return find_corrupted_chunks(file, fileSize, threads).empty();
+    }
+
+    // A checksummed image file opened for reading.
+    //
+    // verify_eager checks every chunk in parallel before returning and throws on corruption.
+    // verify_lazy hands out a PROT_NONE view and checks each chunk when it is first touched
+    // (through a fault handler), so opening costs nothing; touching a corrupted chunk crashes
+    // the process instead of letting it run on bad data. Lazy mode needs POSIX and a chunk size
+    // that is a multiple of the page size; otherwise the file is verified eagerly.
+    // System calls do not touch the view the way code does: write(fd, f.data(), f.size()) fails
+    // with EFAULT on unchecked chunks, so prefetch the range first.
+    class verified_file
+#ifdef DUMPABLE_POSIX
+        : private detail::lazy_region
+#endif
+    {
+        public:
+            enum verify_mode { verify_lazy, verify_eager };
+
+            verified_file(const std::string& path, verify_mode mode = verify_lazy)
+                : base_(nullptr), lazy_(false), verified_(0)
+            {
+#ifdef DUMPABLE_POSIX
+                if (mode == verify_lazy)
+                    lazy_ = map_lazy(path);
+#endif
+                if (!lazy_)
+                {
+                    file_.reset(new mapped_file(path));
+                    if (!detail::read_checksum_footer(file_->data(), file_->size(), footer_))
+                        throw std::runtime_error("dumpable: no checksum trailer in " + path);
+                    if (!verify_image(file_->data(), file_->size()))
+                        throw std::runtime_error("dumpable: corrupted image " + path);
+                    base_ = (const char*)file_->data();
+                    verified_.store((std::size_t)footer_.chunkCount);
+                }
+            }
+            ~verified_file()
+            {
+#ifdef DUMPABLE_POSIX
+                if (lazy_)
+                {
+                    detail::unregister_lazy_region(this);
+                    munmap((void*)base_, mappedSize_);
+                    munmap((void*)check_, mappedSize_);
+                }
+#endif
+            }
+
+            const void* data() const { return base_; }
+            std::size_t size() const { return (std::size_t)footer_.imageSize; }
+            template <typename T>
+            const T* root() const { return (const T*)base_; }
+
+            bool is_lazy() const { return lazy_; }
+            std::size_t chunk_count() const { return (std::size_t)footer_.chunkCount; }
+            std::size_t verified_chunks() const { return verified_.load(); }
+
+            // Checks the chunks covering [offset, offset+length) now and throws if one is corrupted.
+            // Call it before handing the range to a system call such as write(2): the kernel does not
+            // go through the fault handler and fails with EFAULT on chunks nobody has touched yet.
+            void prefetch(std::size_t offset, std::size_t length)
+            {
+#ifdef DUMPABLE_POSIX
+                if (!lazy_ || !length || offset >= size())
+                    return;
+                std::size_t last = std::min(offset + length, size()) - 1;
+                for(std::size_t c = offset / footer_.chunkSize; c <= last / footer_.chunkSize; c ++)
+                    if (!open_chunk(c))
+                        throw std::runtime_error("dumpable: corrupted chunk");
+#else
+                (void)offset;
+                (void)length;
+#endif
+            }
+            void prefetch_all()
+            {
+                prefetch(0, size());
+            }
+
+        private:
+            verified_file(const verified_file&);
+            verified_file& operator = (const verified_file&);
+
+#ifdef DUMPABLE_POSIX
+            enum { chunk_unchecked, chunk_ok, chunk_corrupted };
+
+            // The file is mapped twice: a PROT_NONE view for readers and a readable one to check chunks in.
+            bool map_lazy(const std::string& path)
+            {
+                int fd = open(path.c_str(), O_RDONLY);
+                if (fd < 0)
+                    throw std::runtime_error("dumpable: cannot open " + path);
+                struct stat st;
+                bool ok = fstat(fd, &st) == 0;
+                if (ok)
+                {
+                    std::size_t fileSize = (std::size_t)st.st_size;
+                    ok = fileSize >= sizeof(footer_) &&
+                        pread(fd, &footer_, sizeof(footer_), (off_t)(fileSize - sizeof(footer_))) == (ssize_t)sizeof(footer_) &&
+                        detail::valid_checksum_footer(footer_, fileSize);
+                    if (!ok)
+                    {
+                        close(fd);
+                        throw std::runtime_error("dumpable: no checksum trailer in " + path);
+                    }
+                    ok = footer_.imageSize && footer_.chunkSize % detail::page_size() == 0;
+                    if (ok)
+                    {
+                        mappedSize_ = fileSize;
+                        void* view = mmap(nullptr, mappedSize_, PROT_NONE, MAP_SHARED, fd, 0);
+                        void* check = mmap(nullptr, mappedSize_, PROT_READ, MAP_SHARED, fd, 0);
+                        if (view == MAP_FAILED || check == MAP_FAILED)
+                        {
+                            if (view != MAP_FAILED)
+                                munmap(view, mappedSize_);
+                            if (check != MAP_FAILED)
+                                munmap(check, mappedSize_);
+                            ok = false;
+                        }
+                        else
+                        {
+                            base_ = (const char*)view;
+                            check_ = (const char*)check;
+                        }
+                    }
+                }
+                close(fd);
+                if (!ok)
+                    return false;
+                state_.reset(new std::atomic<unsigned char>[(std::size_t)footer_.chunkCount]);
+                for(std::size_t i = 0; i < footer_.chunkCount; i ++)
+                    state_[i].store(chunk_unchecked);
+                // initialize the cpu detection outside the signal handler
+                detail::crc32c_hw_available();
+                detail::crc32c_table();
+                detail::register_lazy_region(this);
+                return true;
+            }
+
+            bool on_fault(void* addr) override
+            {
+                const char* p = (const char*)addr;
+                if (p < base_ || p >= base_ + mappedSize_)
+                    return false;
+                std::size_t c = (std::size_t)(p - base_) / footer_.chunkSize;
+                if (c >= footer_.chunkCount)
+                    return false;
+                return open_chunk(c);
+            }
+
+            // Checks chunk c once and makes it readable if it is intact.
+            bool open_chunk(std::size_t c)
+            {
+                unsigned char state = state_[c].load();
+                if (state == chunk_unchecked)
+                {
+                    // racing threads may both check the chunk; the result is the same
+                    state = detail::check_chunk(check_, footer_, c) ? chunk_ok : chunk_corrupted;
+                    unsigned char expected = chunk_unchecked;
+                    if (state_[c].compare_exchange_strong(expected, state) && state == chunk_ok)
+                        verified_ ++;
+                }
+                if (state != chunk_ok)
+                    return false;
+                std::size_t offset = c * (std::size_t)footer_.chunkSize;
+                std::size_t length = std::min<std::size_t>((std::size_t)footer_.chunkSize, mappedSize_ - offset);
+                mprotect((void*)(base_ + offset), length, PROT_READ);
+                return true;
+            }
+
+            const char* check_;
+            std::size_t mappedSize_;
+            std::unique_ptr<std::atomic<unsigned char>[]> state_;
+#endif
+
+            detail::checksum_footer footer_;
+            std::unique_ptr<mapped_file> file_;
+            const char* base_;
+            bool lazy_;
+            std::atomic<std::size_t> verified_;
+    };
+}
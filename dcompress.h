@@ -0,0 +1,357 @@
+// Copyright (c) 2014 ipkn.
+// Licensed under the MIT license.
+
+#pragma once
+
+#include <iostream>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <stdexcept>
+#include <algorithm>
+#include <cstring>
+#include <cstdint>
+#include "dumpableconf.h"
+#include "dvmem.h"
+
+namespace dumpable
+{
+    namespace detail
+    {
+        // Byte oriented LZ77 codec in the spirit of LZ4: a token holds literal and match lengths,
+        // followed by the literals, a 16-bit match offset and length extensions.
+        // The decoder allocates nothing and is safe to run inside a fault handler.
+        inline void lz_write_length(std::vector<unsigned char>& out, std::size_t length)
+        {
+            for(; length >= 255; length -= 255)
+                out.push_back(255);
+            out.push_back((unsigned char)length);
+        }
+
+        inline void lz_sequence(std::vector<unsigned char>& out, const unsigned char* literals, std::size_t literalLength, std::size_t offset, std::size_t matchLength)
+        {
+            std::size_t ml = matchLength ? matchLength - 4 : 0;
+            out.push_back((unsigned char)((std::min<std::size_t>(literalLength, 15) << 4) | std::min<std::size_t>(ml, 15)));
+            if (literalLength >= 15)
+                lz_write_length(out, literalLength - 15);
+            out.insert(out.end(), literals, literals + literalLength);
+            if (!matchLength)
+                return;
+            out.push_back((unsigned char)(offset & 0xff));
+            out.push_back((unsigned char)(offset >> 8));
+            if (ml >= 15)
+                lz_write_length(out, ml - 15);
+        }
+
+        inline std::uint32_t lz_read32(const unsigned char* p)
+        {
+            std::uint32_t v;
+            std::memcpy(&v, p, sizeof(v));
+            return v;
+        }
+
+        inline void lz_compress(const unsigned char* src, std::size_t size, std::vector<unsigned char>& out)
+        {
+            const int hashBits = 14;
+            std::vector<std::uint32_t> table(1 << hashBits, 0xffffffffu);
+            std::size_t anchor = 0, i = 0;
+            while(i + 4 <= size)
+            {
+                std::uint32_t seq = lz_read32(src + i);
+                std::uint32_t h = (seq * 2654435761u) >> (32 - hashBits);
+                std::uint32_t candidate = table[h];
+                table[h] = (std::uint32_t)i;
+                if (candidate == 0xffffffffu || i - candidate > 0xffff || lz_read32(src + candidate) != seq)
+                {
+                    i ++;
+                    continue;
+                }
+                std::size_t length = 4;
+                while(i + length < size && src[candidate + length] == src[i + length])
+                    length ++;
+                lz_sequence(out, src + anchor, i - anchor, i - candidate, length);
+                i += length;
+                anchor = i;
+            }
+            lz_sequence(out, src + anchor, size - anchor, 0, 0);
+        }
+
+        inline bool lz_decompress(const unsigned char* src, std::size_t srcSize, unsigned char* dst, std::size_t dstSize)
+        {
+            std::size_t ip = 0, op = 0;
+            while(ip < srcSize)
+            {
+                unsigned token = src[ip++];
+                std::size_t literals = token >> 4;
+                if (literals == 15)
+                {
+                    unsigned char b;
+                    do
+                    {
+                        if (ip >= srcSize)
+                            return false;
+                        b = src[ip++];
+                        literals += b;
+                    } while(b == 255);
+                }
+                if (literals > srcSize - ip || literals > dstSize - op)
+                    return false;
+                std::memcpy(dst + op, src + ip, literals);
+                ip += literals;
+                op += literals;
+                if (ip == srcSize)
+                    break;
+
+                if (srcSize - ip < 2)
+                    return false;
+                std::size_t offset = src[ip] | (src[ip+1] << 8);
+                ip += 2;
+                std::size_t length = token & 15;
+                if (length == 15)
+                {
+                    unsigned char b;
+                    do
+                    {
+                        if (ip >= srcSize)
+                            return false;
+                        b = src[ip++];
+                        length += b;
+                    } while(b == 255);
+                }
+                length += 4;
+                if (!offset || offset > op || length > dstSize - op)
+                    return false;
+                // byte by byte: the match may overlap its own output
+                for(std::size_t i = 0; i < length; i ++, op ++)
+                    dst[op] = dst[op - offset];
+            }
+            return op == dstSize;
+        }
+
+        const char chunked_magic[8] = {'D', 'C', 'H', 'U', 'N', 'K', '1', '\0'};
+
+        struct chunk_entry
+        {
+            std::uint64_t offset;
+            // equal to the raw chunk size when the chunk is stored uncompressed
+            std::uint64_t size;
+        };
+
+        struct chunked_header
+        {
+            char magic[8];
+            std::uint64_t imageSize;
+            std::uint64_t chunkSize;
+            std::uint64_t chunkCount;
+        };
+    }
+
+    // Writes image as independently compressed chunks of chunkSize bytes preceded by an offset index.
+    // chunkSize should be a multiple of the page size so chunks can be loaded lazily.
+    inline void compress_image(const void* image, std::size_t size, std::ostream& os, std::size_t chunkSize = 64*1024)
+    {
+        if (!chunkSize)
+            throw std::invalid_argument("dumpable::compress_image: chunkSize must not be 0");
+        detail::chunked_header header;
+        std::memcpy(header.magic, detail::chunked_magic, sizeof(header.magic));
+        header.imageSize = size;
+        header.chunkSize = chunkSize;
+        header.chunkCount = (size + chunkSize - 1) / chunkSize;
+
+        std::vector<detail::chunk_entry> index((std::size_t)header.chunkCount);
+        std::vector<unsigned char> data, compressed;
+        std::uint64_t base = sizeof(header) + index.size() * sizeof(detail::chunk_entry);
+        for(std::size_t i = 0; i < index.size(); i ++)
+        {
+            const unsigned char* raw = (const unsigned char*)image + i * chunkSize;
+            std::size_t rawSize = std::min(chunkSize, size - i * chunkSize);
+            compressed.clear();
+            detail::lz_compress(raw, rawSize, compressed);
+            index[i].offset = base + data.size();
+            if (compressed.size() < rawSize)
+            {
+                index[i].size = compressed.size();
+                data.insert(data.end(), compressed.begin(), compressed.end());
+            }
+            else
+            {
+                index[i].size = rawSize;
+                data.insert(data.end(), raw, raw + rawSize);
+            }
+        }
+        os.write((const char*)&header, sizeof(header));
+        os.write((const char*)index.data(), index.size() * sizeof(detail::chunk_entry));
+        os.write((const char*)data.data(), data.size());
+    }
+
+    // A chunk-compressed image (see compress_image) decompressed on demand.
+    //
+    // In lazy mode the image occupies one reserved address range, so dptr offsets stay valid;
+    // chunks are decompressed when first touched (through a fault handler) or by prefetch.
+    // Where that is not possible (no POSIX, chunks not page aligned) everything is decompressed up front.
+    // System calls do not fault chunks in: write(fd, img.data(), img.size()) fails with EFAULT
+    // on chunks still missing, so prefetch the range before passing it to the kernel.
+    // The compressed data must outlive this object.
+    class compressed_image
+#ifdef DUMPABLE_POSIX
+        : private detail::lazy_region
+#endif
+    {
+        public:
+            enum load_mode { load_lazy, load_eager };
+
+            compressed_image(const void* compressed, std::size_t size, load_mode mode = load_lazy)
+                : compressed_((const unsigned char*)compressed), compressedSize_(size), base_(nullptr), lazy_(false), loaded_(0)
+            {
+                if (size < sizeof(header_))
+                    throw std::runtime_error("dumpable: not a chunked image");
+                std::memcpy(&header_, compressed, sizeof(header_));
+                if (std::memcmp(header_.magic, detail::chunked_magic, sizeof(header_.magic)) || !header_.chunkSize ||
+                        header_.chunkCount != (header_.imageSize + header_.chunkSize - 1) / header_.chunkSize ||
+                        sizeof(header_) + header_.chunkCount * sizeof(detail::chunk_entry) > size)
+                    throw std::runtime_error("dumpable: not a chunked image");
+                index_ = (const detail::chunk_entry*)(compressed_ + sizeof(header_));
+                state_.reset(new std::atomic<unsigned char>[(std::size_t)header_.chunkCount]);
+                for(std::size_t i = 0; i < header_.chunkCount; i ++)
+                    state_[i].store(chunk_missing);
+
+#ifdef DUMPABLE_POSIX
+                if (mode == load_lazy && header_.chunkSize % detail::page_size() == 0 && header_.imageSize)
+                    lazy_ = map_lazy();
+#endif
+                if (!lazy_)
+                {
+                    owned_.reset(new char[(std::size_t)header_.imageSize + 1]);
+                    base_ = writable_ = owned_.get();
+                    prefetch_all();
+                }
+            }
+
+            ~compressed_image()
+            {
+#ifdef DUMPABLE_POSIX
+                if (lazy_)
+                {
+                    detail::unregister_lazy_region(this);
+                    munmap(base_, mappedSize_);
+                    munmap(writable_, mappedSize_);
+                }
+#endif
+            }
+
+            const void* data() const { return base_; }
+            std::size_t size() const { return (std::size_t)header_.imageSize; }
+            template <typename T>
+            const T* root() const { return (const T*)base_; }
+
+            bool is_lazy() const { return lazy_; }
+            std::size_t chunk_count() const { return (std::size_t)header_.chunkCount; }
+            std::size_t loaded_chunks() const { return loaded_.load(); }
+
+            // Decompresses the chunks covering [offset, offset+length) now.
+            void prefetch(std::size_t offset, std::size_t length)
+            {
+                if (!length || offset >= size())
+                    return;
+                std::size_t last = std::min(offset + length, size()) - 1;
+                for(std::size_t c = offset / header_.chunkSize; c <= last / header_.chunkSize; c ++)
+                    if (!load_chunk(c))
+                        throw std::runtime_error("dumpable: corrupted chunk");
+            }
+            void prefetch_all()
+            {
+                prefetch(0, size());
+            }
+
+        private:
+            compressed_image(const compressed_image&);
+            compressed_image& operator = (const compressed_image&);
+
+            enum { chunk_missing, chunk_loading, chunk_ready, chunk_corrupted };
+
+            bool load_chunk(std::size_t c)
+            {
+                unsigned char expected = chunk_missing;
+                if (!state_[c].compare_exchange_strong(expected, chunk_loading))
+                {
+                    // somebody else is decompressing it
+                    while(expected == chunk_loading)
+                        expected = state_[c].load();
+                    return expected == chunk_ready;
+                }
+                std::size_t rawSize = std::min<std::size_t>(header_.chunkSize, header_.imageSize - c * header_.chunkSize);
+                const detail::chunk_entry& e = index_[c];
+                bool ok = e.offset <= compressedSize_ && e.size <= compressedSize_ - e.offset;
+                if (ok)
+                {
+                    unsigned char* dst = (unsigned char*)writable_ + c * header_.chunkSize;
+                    if (e.size == rawSize)
+                        std::memcpy(dst, compressed_ + e.offset, rawSize);
+                    else
+                        ok = detail::lz_decompress(compressed_ + e.offset, (std::size_t)e.size, dst, rawSize);
+                }
+#ifdef DUMPABLE_POSIX
+                if (ok && lazy_)
+                {
+                    // readers see the chunk only once it is complete
+                    std::size_t length = std::min<std::size_t>(header_.chunkSize, mappedSize_ - c * header_.chunkSize);
+                    mprotect(base_ + c * header_.chunkSize, length, PROT_READ);
+                }
+#endif
+                state_[c].store(ok ? chunk_ready : chunk_corrupted);
+                if (ok)
+                    loaded_ ++;
+                return ok;
+            }
+
+#ifdef DUMPABLE_POSIX
+            // The image is backed by shared memory mapped twice: a PROT_NONE view handed out to
+            // readers and a writable view the chunks are decompressed into.
+            bool map_lazy()
+            {
+                mappedSize_ = detail::round_up_to_page((std::size_t)header_.imageSize);
+                int fd = detail::shared_memory_fd(mappedSize_);
+                if (fd < 0)
+                    return false;
+                void* view = mmap(nullptr, mappedSize_, PROT_NONE, MAP_SHARED, fd, 0);
+                void* writable = mmap(nullptr, mappedSize_, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+                close(fd);
+                if (view == MAP_FAILED || writable == MAP_FAILED)
+                {
+                    if (view != MAP_FAILED)
+                        munmap(view, mappedSize_);
+                    if (writable != MAP_FAILED)
+                        munmap(writable, mappedSize_);
+                    return false;
+                }
+                base_ = (char*)view;
+                writable_ = (char*)writable;
+                detail::register_lazy_region(this);
+                return true;
+            }
+
+            bool on_fault(void* addr) override
+            {
+                char* p = (char*)addr;
+                if (p < base_ || p >= base_ + mappedSize_)
+                    return false;
+                std::size_t c = (std::size_t)(p - base_) / header_.chunkSize;
+                // a corrupted chunk stays PROT_NONE: report the fault as not ours so the process crashes
+                return c < header_.chunkCount && load_chunk(c);
+            }
+
+            std::size_t mappedSize_;
+#endif
+
+            detail::chunked_header header_;
+            const unsigned char* compressed_;
+            std::size_t compressedSize_;
+            const detail::chunk_entry* index_;
+            std::unique_ptr<std::atomic<unsigned char>[]> state_;
+            std::unique_ptr<char[]> owned_;
+            char* base_;
+            char* writable_;
+            bool lazy_;
+            std::atomic<std::size_t> loaded_;
+    };
+}
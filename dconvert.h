@@ -0,0 +1,699 @@
+// Copyright (c) 2014 ipkn.
+// Licensed under the MIT license.
+
+#pragma once
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <cstdlib>
+#include <cctype>
+#include <stdexcept>
+#include <algorithm>
+#include "dumpableconf.h"
+
+namespace dumpable
+{
+    // Word size and alignment of 64-bit members (int64, double, and 8-byte words) of an image layout.
+    // Both ends of a conversion must have the same byte order.
+    struct abi_layout
+    {
+        unsigned word_size;
+        unsigned int64_align;
+
+        static abi_layout native64() { abi_layout l = {8, 8}; return l; }
+        // 32-bit x86 System V; MSVC aligns 64-bit members to 8 bytes ({4, 8})
+        static abi_layout native32() { abi_layout l = {4, 4}; return l; }
+        // DUMPABLE_COMPATIBLE_LAYOUT on 64-bit targets and MSVC; 32-bit x86 System V gives {8, 4}
+        static abi_layout compatible() { abi_layout l = {8, 8}; return l; }
+
+        // the layout this build reads
+        static abi_layout host()
+        {
+            struct probe { char c; long long v; };
+            abi_layout l = {(unsigned)sizeof(dumpable::size_t), (unsigned)offsetof(probe, v)};
+            return l;
+        }
+    };
+
+    // A node of a layout_schema: how a dumped type is laid out, independent of word size.
+    struct layout_type
+    {
+        enum kind_type { primitive, word, array, structure, string, vector, pointer, optional, variant };
+
+        kind_type kind;
+        // primitive: bytes; array: element count
+        std::size_t size;
+        // word: ptrdiff rather than size
+        bool is_signed;
+        bool defined;
+        std::string name;
+        // structure fields, or the element / alternative types
+        std::vector<const layout_type*> members;
+        std::vector<std::string> member_names;
+    };
+
+    // Type descriptions for convert_layout, parsed from text such as
+    //
+    //   struct item { i32 id; string name; vector<u16> tags; f64 weight; }
+    //   struct root { vector<item> items; map<string, i32> index; ptr<item> main; i32 pos[3]; }
+    //
+    // Primitives: i8 u8 i16 u16 i32 u32 i64 u64 f32 f64 bool char, plus size and ptrdiff (word sized).
+    // Containers: string (dstring), vector<T>, map<K, V> (dmap and dmultimap), ptr<T>, optional<T>,
+    // variant<T...>. Fields and element types must be listed exactly as the C++ types declare them.
+    class layout_schema
+    {
+        public:
+            explicit layout_schema(const std::string& text)
+            {
+                parser p(*this, text);
+                p.parse();
+                for(auto it = structs_.begin(); it != structs_.end(); ++it)
+                    if (!it->second->defined)
+                        throw std::invalid_argument("dumpable::layout_schema: undefined struct " + it->first);
+            }
+
+            // nullptr when there is no such struct
+            const layout_type* find(const std::string& name) const
+            {
+                auto it = structs_.find(name);
+                return it == structs_.end() ? nullptr : it->second;
+            }
+
+        private:
+            // types point at each other
+            layout_schema(const layout_schema&);
+            layout_schema& operator = (const layout_schema&);
+
+            layout_type* add(layout_type::kind_type kind, std::size_t size = 0)
+            {
+                layout_type t;
+                t.kind = kind;
+                t.size = size;
+                t.is_signed = false;
+                t.defined = true;
+                types_.push_back(t);
+                return &types_.back();
+            }
+
+            layout_type* named(const std::string& name)
+            {
+                auto it = structs_.find(name);
+                if (it != structs_.end())
+                    return it->second;
+                layout_type* t = add(layout_type::structure);
+                t->name = name;
+                t->defined = false;
+                structs_[name] = t;
+                return t;
+            }
+
+            class parser
+            {
+                public:
+                    parser(layout_schema& schema, const std::string& text)
+                        : schema_(schema), text_(text), pos_(0), line_(1)
+                    {
+                    }
+
+                    void parse()
+                    {
+                        for(std::string token = next(); !token.empty(); token = next())
+                        {
+                            if (token != "struct")
+                                fail("expected struct, got " + token);
+                            std::string name = identifier();
+                            layout_type* t = schema_.named(name);
+                            if (t->defined)
+                                fail("struct " + name + " defined twice");
+                            expect("{");
+                            for(std::string field = next(); field != "}"; field = next())
+                            {
+                                if (field.empty())
+                                    fail("unterminated struct " + name);
+                                const layout_type* type = parse_type(field);
+                                std::string fieldName = identifier();
+                                std::vector<std::size_t> extents;
+                                std::string token = next();
+                                for(; token == "["; token = next())
+                                {
+                                    extents.push_back(number());
+                                    expect("]");
+                                }
+                                if (token != ";")
+                                    fail("expected ; after " + fieldName);
+                                // int a[2][3] is two arrays of three
+                                for(auto e = extents.rbegin(); e != extents.rend(); ++e)
+                                {
+                                    layout_type* a = schema_.add(layout_type::array, *e);
+                                    a->members.push_back(type);
+                                    type = a;
+                                }
+                                t->members.push_back(type);
+                                t->member_names.push_back(fieldName);
+                            }
+                            t->defined = true;
+                            if (peek() == ";")
+                                next();
+                        }
+                    }
+
+                private:
+                    const layout_type* parse_type(const std::string& name)
+                    {
+                        static const struct { const char* name; std::size_t size; } primitives[] = {
+                            {"i8", 1}, {"u8", 1}, {"char", 1}, {"bool", 1}, {"i16", 2}, {"u16", 2},
+                            {"i32", 4}, {"u32", 4}, {"f32", 4}, {"i64", 8}, {"u64", 8}, {"f64", 8},
+                        };
+                        for(std::size_t i = 0; i < sizeof(primitives) / sizeof(primitives[0]); i ++)
+                            if (name == primitives[i].name)
+                                return schema_.add(layout_type::primitive, primitives[i].size);
+                        if (name == "size" || name == "ptrdiff")
+                        {
+                            layout_type* t = schema_.add(layout_type::word);
+                            t->is_signed = name == "ptrdiff";
+                            return t;
+                        }
+                        if (name == "string")
+                            return schema_.add(layout_type::string);
+
+                        layout_type::kind_type kind;
+                        std::size_t arguments = 1;
+                        if (name == "vector")
+                            kind = layout_type::vector;
+                        else if (name == "ptr")
+                            kind = layout_type::pointer;
+                        else if (name == "optional")
+                            kind = layout_type::optional;
+                        else if (name == "map")
+                        {
+                            kind = layout_type::vector;
+                            arguments = 2;
+                        }
+                        else if (name == "variant")
+                        {
+                            kind = layout_type::variant;
+                            arguments = 0;
+                        }
+                        else
+                        {
+                            if (!is_identifier(name))
+                                fail("expected a type, got " + name);
+                            return schema_.named(name);
+                        }
+
+                        expect("<");
+                        std::vector<const layout_type*> args;
+                        for(;;)
+                        {
+                            args.push_back(parse_type(next()));
+                            std::string token = next();
+                            if (token == ">")
+                                break;
+                            if (token != ",")
+                                fail("expected , or > in " + name);
+                        }
+                        if (arguments && args.size() != arguments)
+                            fail("wrong number of arguments to " + name);
+                        layout_type* t = schema_.add(kind);
+                        if (name == "map")
+                        {
+                            // dmap stores std::pair<K, V>
+                            layout_type* pair = schema_.add(layout_type::structure);
+                            pair->members = args;
+                            pair->member_names.push_back("first");
+                            pair->member_names.push_back("second");
+                            t->members.push_back(pair);
+                        }
+                        else
+                            t->members = args;
+                        return t;
+                    }
+
+                    static bool is_identifier(const std::string& s)
+                    {
+                        return !s.empty() && (std::isalpha((unsigned char)s[0]) || s[0] == '_');
+                    }
+
+                    std::string identifier()
+                    {
+                        std::string s = next();
+                        if (!is_identifier(s))
+                            fail("expected a name, got " + s);
+                        return s;
+                    }
+
+                    std::size_t number()
+                    {
+                        std::string s = next();
+                        if (s.empty() || !std::isdigit((unsigned char)s[0]))
+                            fail("expected a number, got " + s);
+                        return (std::size_t)std::strtoull(s.c_str(), nullptr, 10);
+                    }
+
+                    void expect(const char* token)
+                    {
+                        std::string s = next();
+                        if (s != token)
+                            fail(std::string("expected ") + token + ", got " + s);
+                    }
+
+                    std::string peek()
+                    {
+                        std::size_t pos = pos_;
+                        int line = line_;
+                        std::string s = next();
+                        pos_ = pos;
+                        line_ = line;
+                        return s;
+                    }
+
+                    // the next token, or an empty string at the end
+                    std::string next()
+                    {
+                        for(;;)
+                        {
+                            while(pos_ < text_.size() && std::isspace((unsigned char)text_[pos_]))
+                                if (text_[pos_++] == '\n')
+                                    line_ ++;
+                            bool comment = pos_ < text_.size() && (text_[pos_] == '#' || text_.compare(pos_, 2, "//") == 0);
+                            if (!comment)
+                                break;
+                            while(pos_ < text_.size() && text_[pos_] != '\n')
+                                pos_ ++;
+                        }
+                        if (pos_ == text_.size())
+                            return std::string();
+                        std::size_t start = pos_;
+                        if (std::isalnum((unsigned char)text_[pos_]) || text_[pos_] == '_')
+                        {
+                            while(pos_ < text_.size() && (std::isalnum((unsigned char)text_[pos_]) || text_[pos_] == '_'))
+                                pos_ ++;
+                        }
+                        else
+                            pos_ ++;
+                        return text_.substr(start, pos_ - start);
+                    }
+
+                    void fail(const std::string& message)
+                    {
+                        throw std::invalid_argument("dumpable::layout_schema: line " + std::to_string(line_) + ": " + message);
+                    }
+
+                    layout_schema& schema_;
+                    const std::string& text_;
+                    std::size_t pos_;
+                    int line_;
+            };
+
+            std::deque<layout_type> types_;
+            std::map<std::string, layout_type*> structs_;
+    };
+
+    namespace detail
+    {
+        // Size, alignment and member offsets of layout_types under one abi_layout, computed once per type.
+        class layout_shapes
+        {
+            public:
+                struct shape
+                {
+                    std::size_t size;
+                    std::size_t align;
+                    std::vector<std::size_t> offsets;
+                };
+
+                explicit layout_shapes(const abi_layout& abi)
+                    : abi_(abi)
+                {
+                    if ((abi.word_size != 4 && abi.word_size != 8) || (abi.int64_align != 4 && abi.int64_align != 8))
+                        throw std::invalid_argument("dumpable::abi_layout: unsupported word size or alignment");
+                }
+
+                const abi_layout& abi() const { return abi_; }
+
+                const shape& of(const layout_type* t)
+                {
+                    auto it = shapes_.find(t);
+                    if (it != shapes_.end())
+                    {
+                        if (!it->second.align)
+                            throw std::invalid_argument("dumpable::convert_layout: " + t->name + " contains itself by value");
+                        return it->second;
+                    }
+                    shapes_[t] = shape();
+                    shape s = compute(t);
+                    return shapes_[t] = s;
+                }
+
+            private:
+                static std::size_t round_up(std::size_t size, std::size_t align)
+                {
+                    return (size + align - 1) / align * align;
+                }
+
+                // a C struct of the given members
+                shape record(const std::vector<shape>& members)
+                {
+                    shape s;
+                    s.size = 0;
+                    s.align = 1;
+                    for(std::size_t i = 0; i < members.size(); i ++)
+                    {
+                        s.size = round_up(s.size, members[i].align);
+                        s.offsets.push_back(s.size);
+                        s.size += members[i].size;
+                        s.align = std::max(s.align, members[i].align);
+                    }
+                    // an empty struct still takes a byte
+                    s.size = std::max<std::size_t>(round_up(s.size, s.align), 1);
+                    return s;
+                }
+
+                shape scalar(std::size_t size)
+                {
+                    shape s;
+                    s.size = size;
+                    s.align = size == 8 ? abi_.int64_align : size;
+                    return s;
+                }
+
+                shape compute(const layout_type* t)
+                {
+                    switch(t->kind)
+                    {
+                        case layout_type::primitive:
+                            return scalar(t->size);
+                        case layout_type::word:
+                        case layout_type::pointer:
+                            return scalar(abi_.word_size);
+                        case layout_type::array:
+                        {
+                            shape e = of(t->members[0]);
+                            shape s;
+                            s.size = e.size * t->size;
+                            s.align = e.align;
+                            return s;
+                        }
+                        case layout_type::string:
+                        case layout_type::vector:
+                        {
+                            // dptr diff_, size_, isPooled_
+                            std::vector<shape> members(2, scalar(abi_.word_size));
+                            members.push_back(scalar(1));
+                            return record(members);
+                        }
+                        case layout_type::optional:
+                        {
+                            // aligned storage, then the engaged flag
+                            std::vector<shape> members(1, of(t->members[0]));
+                            members.push_back(scalar(1));
+                            return record(members);
+                        }
+                        case layout_type::variant:
+                        {
+                            shape storage;
+                            storage.size = 0;
+                            storage.align = 1;
+                            for(std::size_t i = 0; i < t->members.size(); i ++)
+                            {
+                                const shape& a = of(t->members[i]);
+                                storage.size = std::max(storage.size, a.size);
+                                storage.align = std::max(storage.align, a.align);
+                            }
+                            storage.size = round_up(storage.size, storage.align);
+                            std::vector<shape> members(1, storage);
+                            members.push_back(scalar(4));
+                            return record(members);
+                        }
+                        case layout_type::structure:
+                        default:
+                        {
+                            std::vector<shape> members;
+                            for(std::size_t i = 0; i < t->members.size(); i ++)
+                                members.push_back(of(t->members[i]));
+                            return record(members);
+                        }
+                    }
+                }
+
+                abi_layout abi_;
+                std::map<const layout_type*, shape> shapes_;
+        };
+
+        // Rebuilds an image object by object, allocating in the order dpool would, depth first.
+        class layout_converter
+        {
+            public:
+                layout_converter(const char* image, std::size_t size, const abi_layout& from, const abi_layout& to)
+                    : src_(image), srcSize_(size), from_(from), to_(to), depth_(0), limit_(0)
+                {
+                }
+
+                std::vector<char>& convert(const layout_type* root)
+                {
+                    std::size_t srcSize = from_.of(root).size;
+                    need(0, srcSize);
+                    // dumpable::write starts the pool right after the root
+                    out_.assign(to_.of(root).size, 0);
+                    // Only word sizes, padding and rounding change, so a valid image at most doubles;
+                    // more means pointers of a corrupted image lead to the same objects over and over.
+                    limit_ = (std::uint64_t)srcSize_ * 4 + out_.size();
+                    convert(root, 0, 0);
+                    return out_;
+                }
+
+            private:
+                void need(std::uint64_t offset, std::uint64_t size) const
+                {
+                    if (offset > srcSize_ || size > srcSize_ - offset)
+                        throw std::runtime_error("dumpable::convert_layout: image is truncated or corrupted");
+                }
+
+                // A corrupted pointer can lead back to an object being converted; each payload
+                // followed is one level, and nothing dumpable nests anywhere near this deep.
+                void descend()
+                {
+                    if (++depth_ > 4096)
+                        throw std::runtime_error("dumpable::convert_layout: objects nested too deep; the image is corrupted");
+                }
+
+                std::int64_t read_word(std::uint64_t offset, bool isSigned) const
+                {
+                    need(offset, from_.abi().word_size);
+                    if (from_.abi().word_size == 8)
+                    {
+                        std::int64_t v;
+                        std::memcpy(&v, src_ + offset, 8);
+                        return v;
+                    }
+                    if (isSigned)
+                    {
+                        std::int32_t v;
+                        std::memcpy(&v, src_ + offset, 4);
+                        return v;
+                    }
+                    std::uint32_t v;
+                    std::memcpy(&v, src_ + offset, 4);
+                    return v;
+                }
+
+                void write_word(std::uint64_t offset, std::int64_t value, bool isSigned)
+                {
+                    if (to_.abi().word_size == 8)
+                    {
+                        std::memcpy(&out_[(std::size_t)offset], &value, 8);
+                        return;
+                    }
+                    if (isSigned ? (value < INT32_MIN || value > INT32_MAX) : (value < 0 || value > (std::int64_t)UINT32_MAX))
+                        throw std::length_error("dumpable::convert_layout: value does not fit the target word size");
+                    std::uint32_t v = (std::uint32_t)value;
+                    std::memcpy(&out_[(std::size_t)offset], &v, 4);
+                }
+
+                // pool allocation, sized up to a word like DUMPABLE_ALIGNED_POOL does
+                std::uint64_t alloc(std::uint64_t size)
+                {
+                    std::uint64_t word = to_.abi().word_size;
+                    std::uint64_t offset = out_.size();
+                    if (size > limit_ - offset)
+                        throw std::runtime_error("dumpable::convert_layout: output grows past the input; the image is corrupted");
+                    out_.resize((std::size_t)(offset + (size + word - 1) / word * word), 0);
+                    return offset;
+                }
+
+                void convert(const layout_type* t, std::uint64_t src, std::uint64_t dst)
+                {
+                    switch(t->kind)
+                    {
+                        case layout_type::primitive:
+                            need(src, t->size);
+                            std::memcpy(&out_[(std::size_t)dst], src_ + src, t->size);
+                            break;
+                        case layout_type::word:
+                            write_word(dst, read_word(src, t->is_signed), t->is_signed);
+                            break;
+                        case layout_type::array:
+                        {
+                            std::size_t srcStep = from_.of(t->members[0]).size, dstStep = to_.of(t->members[0]).size;
+                            for(std::size_t i = 0; i < t->size; i ++)
+                                convert(t->members[0], src + i * srcStep, dst + i * dstStep);
+                            break;
+                        }
+                        case layout_type::structure:
+                        {
+                            const std::vector<std::size_t>& srcOffsets = from_.of(t).offsets;
+                            const std::vector<std::size_t>& dstOffsets = to_.of(t).offsets;
+                            for(std::size_t i = 0; i < t->members.size(); i ++)
+                                convert(t->members[i], src + srcOffsets[i], dst + dstOffsets[i]);
+                            break;
+                        }
+                        case layout_type::pointer:
+                        {
+                            std::int64_t diff = read_word(src, true);
+                            if (diff)
+                            {
+                                const layout_type* e = t->members[0];
+                                std::uint64_t target = alloc(to_.of(e).size);
+                                descend();
+                                convert(e, src + diff, target);
+                                depth_ --;
+                                write_word(dst, (std::int64_t)(target - dst), true);
+                            }
+                            break;
+                        }
+                        case layout_type::string:
+                        case layout_type::vector:
+                            convert_array(t, src, dst);
+                            break;
+                        case layout_type::optional:
+                        {
+                            std::size_t srcFlag = from_.of(t).offsets[1], dstFlag = to_.of(t).offsets[1];
+                            need(src + srcFlag, 1);
+                            out_[(std::size_t)(dst + dstFlag)] = src_[src + srcFlag];
+                            if (src_[src + srcFlag])
+                                convert(t->members[0], src, dst);
+                            break;
+                        }
+                        case layout_type::variant:
+                        {
+                            std::size_t srcIndex = from_.of(t).offsets[1], dstIndex = to_.of(t).offsets[1];
+                            need(src + srcIndex, 4);
+                            std::uint32_t index;
+                            std::memcpy(&index, src_ + src + srcIndex, 4);
+                            if (index >= t->members.size())
+                                throw std::runtime_error("dumpable::convert_layout: bad variant index");
+                            std::memcpy(&out_[(std::size_t)(dst + dstIndex)], &index, 4);
+                            convert(t->members[index], src, dst);
+                            break;
+                        }
+                    }
+                }
+
+                // dstring and dvector: diff, size, isPooled; a string also stores its terminator
+                void convert_array(const layout_type* t, std::uint64_t src, std::uint64_t dst)
+                {
+                    unsigned srcWord = from_.abi().word_size, dstWord = to_.abi().word_size;
+                    std::int64_t diff = read_word(src, true);
+                    std::int64_t size = read_word(src + srcWord, false);
+                    need(src + srcWord * 2, 1);
+                    out_[(std::size_t)(dst + dstWord * 2)] = src_[src + srcWord * 2];
+                    write_word(dst + dstWord, size, false);
+                    if (!diff || (!size && t->kind == layout_type::vector))
+                        return;
+                    std::uint64_t begin = src + diff;
+                    std::uint64_t target;
+                    if (t->kind == layout_type::string)
+                    {
+                        // bounded first: size + 1 wraps for a size of 2^64-1
+                        if ((std::uint64_t)size >= srcSize_)
+                            throw std::runtime_error("dumpable::convert_layout: image is truncated or corrupted");
+                        need(begin, (std::uint64_t)size + 1);
+                        if (!find_shared(begin, (std::uint64_t)size + 1, target))
+                        {
+                            target = alloc((std::uint64_t)size + 1);
+                            std::memcpy(&out_[(std::size_t)target], src_ + begin, (std::size_t)size + 1);
+                            shared_[std::make_pair(begin, (std::uint64_t)size + 1)] = target;
+                        }
+                        write_word(dst, (std::int64_t)(target - dst), true);
+                        return;
+                    }
+                    const layout_type* e = t->members[0];
+                    std::size_t srcStep = from_.of(e).size, dstStep = to_.of(e).size;
+                    if ((std::uint64_t)size > srcSize_ / srcStep)
+                        throw std::runtime_error("dumpable::convert_layout: image is truncated or corrupted");
+                    need(begin, (std::uint64_t)size * srcStep);
+                    bool share = plain(e);
+                    if (share && find_shared(begin, (std::uint64_t)size * srcStep, target))
+                    {
+                        write_word(dst, (std::int64_t)(target - dst), true);
+                        return;
+                    }
+                    target = alloc((std::uint64_t)size * dstStep);
+                    write_word(dst, (std::int64_t)(target - dst), true);
+                    descend();
+                    for(std::int64_t i = 0; i < size; i ++)
+                        convert(e, begin + i * srcStep, target + i * dstStep);
+                    depth_ --;
+                    if (share)
+                        shared_[std::make_pair(begin, (std::uint64_t)size * srcStep)] = target;
+                }
+
+                // image_builder stores identical trivially copyable payloads once; convert them once too
+                bool find_shared(std::uint64_t begin, std::uint64_t size, std::uint64_t& target) const
+                {
+                    auto it = shared_.find(std::make_pair(begin, size));
+                    if (it == shared_.end())
+                        return false;
+                    target = it->second;
+                    return true;
+                }
+
+                // trivially copyable: no containers or pointers inside
+                bool plain(const layout_type* t)
+                {
+                    auto it = plain_.find(t);
+                    if (it != plain_.end())
+                        return it->second;
+                    bool ret = t->kind == layout_type::primitive || t->kind == layout_type::word;
+                    if (t->kind == layout_type::array || t->kind == layout_type::structure)
+                    {
+                        ret = true;
+                        for(std::size_t i = 0; i < t->members.size(); i ++)
+                            ret = ret && plain(t->members[i]);
+                    }
+                    return plain_[t] = ret;
+                }
+
+                const char* src_;
+                std::size_t srcSize_;
+                layout_shapes from_;
+                layout_shapes to_;
+                std::vector<char> out_;
+                unsigned depth_;
+                std::uint64_t limit_;
+                // (source offset, source bytes) of shared payloads to their offset in out_
+                std::map<std::pair<std::uint64_t, std::uint64_t>, std::uint64_t> shared_;
+                std::map<const layout_type*, bool> plain_;
+        };
+    }
+
+    // Rewrites an image whose root is the schema's struct root from one layout into another,
+    // e.g. a 64-bit image into the native 32-bit one, in one depth-first pass over the objects.
+    // The result is laid out exactly as dumpable::write would produce it on the target, with zeroed padding.
+    inline void convert_layout(const void* image, std::size_t size, const layout_schema& schema, const std::string& root,
+            const abi_layout& from, const abi_layout& to, std::ostream& os)
+    {
+        const layout_type* t = schema.find(root);
+        if (!t)
+            throw std::invalid_argument("dumpable::convert_layout: no struct " + root + " in the schema");
+        detail::layout_converter converter((const char*)image, size, from, to);
+        std::vector<char>& out = converter.convert(t);
+        os.write(out.data(), out.size());
+    }
+}
@@ -0,0 +1,248 @@
+// Copyright (c) 2014 ipkn.
+// Licensed under the MIT license.
+
+#pragma once
+
+#include <iostream>
+#include <vector>
+#include <unordered_map>
+#include <stdexcept>
+#include <cstring>
+#include <cstdint>
+#include "dumpableconf.h"
+#include "dutility.h"
+
+namespace dumpable
+{
+    // Patch layout:
+    //   header: "DPATCH1\0", old image size, new image size, new image hash (all 64-bit)
+    //   ops building the new image front to back:
+    //     op_copy,   source offset in old image, length
+    //     op_insert, length, bytes (padded to 8)
+    // Dumped images are position independent and pool allocations are aligned to 8 bytes,
+    // so unchanged payloads reappear in the new image at 8-byte granularity even if they moved.
+    namespace detail
+    {
+        const char patch_magic[8] = {'D', 'P', 'A', 'T', 'C', 'H', '1', '\0'};
+        const std::uint64_t patch_op_copy = 0;
+        const std::uint64_t patch_op_insert = 1;
+        const std::size_t patch_granule = 8;
+        const std::size_t patch_block = 32;
+
+        inline void write_u64(std::ostream& os, std::uint64_t v)
+        {
+            os.write((const char*)&v, sizeof(v));
+        }
+
+        class patch_reader
+        {
+            public:
+                patch_reader(const void* patch, std::size_t size)
+                    : p_((const char*)patch), end_((const char*)patch + size)
+                {
+                }
+                std::uint64_t u64()
+                {
+                    std::uint64_t v;
+                    std::memcpy(&v, bytes(sizeof(v)), sizeof(v));
+                    return v;
+                }
+                const char* bytes(std::uint64_t size)
+                {
+                    if ((std::uint64_t)(end_ - p_) < size)
+                        throw std::runtime_error("dumpable: truncated patch");
+                    const char* ret = p_;
+                    p_ += size;
+                    return ret;
+                }
+                bool done() const { return p_ == end_; }
+            private:
+                const char* p_;
+                const char* end_;
+        };
+
+        struct patch_header
+        {
+            std::uint64_t oldSize;
+            std::uint64_t newSize;
+            std::uint64_t newHash;
+        };
+
+        inline patch_header read_patch_header(patch_reader& r, std::size_t oldSize)
+        {
+            if (std::memcmp(r.bytes(sizeof(patch_magic)), patch_magic, sizeof(patch_magic)))
+                throw std::runtime_error("dumpable: not a dumpable patch");
+            patch_header h;
+            h.oldSize = r.u64();
+            h.newSize = r.u64();
+            h.newHash = r.u64();
+            if (h.oldSize != oldSize)
+                throw std::runtime_error("dumpable: patch made for a different image");
+            return h;
+        }
+    }
+
+    // Writes a patch turning oldImage into newImage.
+    inline void diff(const void* oldImage, std::size_t oldSize, const void* newImage, std::size_t newSize, std::ostream& os)
+    {
+        using namespace detail;
+        const char* o = (const char*)oldImage;
+        const char* n = (const char*)newImage;
+
+        std::unordered_map<std::uint64_t, std::uint64_t> blocks;
+        for(std::size_t off = 0; off + patch_block <= oldSize; off += patch_block)
+            blocks.insert(std::make_pair(hash_bytes(o + off, patch_block), off));
+
+        os.write(patch_magic, sizeof(patch_magic));
+        write_u64(os, oldSize);
+        write_u64(os, newSize);
+        write_u64(os, hash_bytes(n, newSize));
+
+        std::size_t pos = 0, pending = 0;
+        auto flush_insert = [&](std::size_t end)
+        {
+            if (end == pending)
+                return;
+            static const char zeros[patch_granule] = {0};
+            write_u64(os, patch_op_insert);
+            write_u64(os, end - pending);
+            os.write(n + pending, end - pending);
+            os.write(zeros, (patch_granule - (end - pending) % patch_granule) % patch_granule);
+        };
+
+        while(pos + patch_block <= newSize)
+        {
+            std::size_t src = oldSize;
+            // prefer the same offset: that keeps the patch applicable in place
+            if (pos + patch_block <= oldSize && !std::memcmp(n + pos, o + pos, patch_block))
+                src = pos;
+            else
+            {
+                auto it = blocks.find(hash_bytes(n + pos, patch_block));
+                if (it != blocks.end() && !std::memcmp(n + pos, o + it->second, patch_block))
+                    src = (std::size_t)it->second;
+            }
+            if (src == oldSize)
+            {
+                pos += patch_granule;
+                continue;
+            }
+
+            std::size_t start = pos;
+            while(start > pending && src > 0 && n[start-1] == o[src-1])
+            {
+                start --;
+                src --;
+            }
+            std::size_t length = pos - start;
+            while(start + length < newSize && src + length < oldSize && n[start+length] == o[src+length])
+                length ++;
+
+            flush_insert(start);
+            write_u64(os, patch_op_copy);
+            write_u64(os, src);
+            write_u64(os, length);
+            pending = start + length;
+            pos = (pending + patch_granule - 1) / patch_granule * patch_granule;
+        }
+        flush_insert(newSize);
+    }
+
+    // Rebuilds the new image from oldImage and patch; verify hashes the result against the patch.
+    inline void apply_patch(const void* oldImage, std::size_t oldSize, const void* patch, std::size_t patchSize, std::vector<char>& out, bool verify = true)
+    {
+        using namespace detail;
+        patch_reader r(patch, patchSize);
+        patch_header h = read_patch_header(r, oldSize);
+        out.resize((std::size_t)h.newSize);
+        std::uint64_t pos = 0;
+        while(!r.done())
+        {
+            std::uint64_t op = r.u64();
+            if (op == patch_op_copy)
+            {
+                std::uint64_t src = r.u64(), length = r.u64();
+                // pos <= newSize throughout; subtracting cannot wrap where adding could
+                if (src > oldSize || length > oldSize - src || length > h.newSize - pos)
+                    throw std::runtime_error("dumpable: corrupted patch");
+                std::memcpy(out.data() + pos, (const char*)oldImage + src, (std::size_t)length);
+                pos += length;
+            }
+            else if (op == patch_op_insert)
+            {
+                std::uint64_t length = r.u64();
+                if (length > h.newSize - pos)
+                    throw std::runtime_error("dumpable: corrupted patch");
+                const char* bytes = r.bytes((length + patch_granule - 1) / patch_granule * patch_granule);
+                std::memcpy(out.data() + pos, bytes, (std::size_t)length);
+                pos += length;
+            }
+            else
+                throw std::runtime_error("dumpable: corrupted patch");
+        }
+        if (pos != h.newSize || (verify && hash_bytes(out.data(), out.size()) != h.newHash))
+            throw std::runtime_error("dumpable: patch result does not match");
+    }
+
+    // Applies a patch directly over the old image, e.g. a MAP_PRIVATE mapping with capacity bytes.
+    // Only the inserted ranges are written. Returns false, leaving the image untouched, when the
+    // patch moves data around (or the new image does not fit); use apply_patch then.
+    // On success the new image is [image, image + *newSize). Patching an image other than the one
+    // the patch was made from throws after the writes, with the image left half patched.
+    inline bool apply_patch_in_place(void* image, std::size_t oldSize, std::size_t capacity, const void* patch, std::size_t patchSize,
+            std::size_t* newSize = nullptr, bool verify = true)
+    {
+        using namespace detail;
+        patch_reader check(patch, patchSize);
+        patch_header h = read_patch_header(check, oldSize);
+        if (h.newSize > capacity)
+            return false;
+        std::uint64_t pos = 0;
+        while(!check.done())
+        {
+            std::uint64_t op = check.u64();
+            std::uint64_t a = check.u64();
+            if (op == patch_op_copy)
+            {
+                std::uint64_t length = check.u64();
+                if (length > h.newSize - pos)
+                    throw std::runtime_error("dumpable: corrupted patch");
+                if (a != pos || a > oldSize || length > oldSize - a)
+                    return false;
+                pos += length;
+            }
+            else if (op == patch_op_insert)
+            {
+                if (a > h.newSize - pos)
+                    throw std::runtime_error("dumpable: corrupted patch");
+                check.bytes((a + patch_granule - 1) / patch_granule * patch_granule);
+                pos += a;
+            }
+            else
+                throw std::runtime_error("dumpable: corrupted patch");
+        }
+        if (pos != h.newSize)
+            throw std::runtime_error("dumpable: corrupted patch");
+
+        patch_reader r(patch, patchSize);
+        read_patch_header(r, oldSize);
+        pos = 0;
+        while(!r.done())
+        {
+            std::uint64_t op = r.u64();
+            std::uint64_t a = r.u64();
+            if (op == patch_op_copy)
+                pos += r.u64();
+            else
+            {
+                std::memcpy((char*)image + pos, r.bytes((a + patch_granule - 1) / patch_granule * patch_granule), (std::size_t)a);
+                pos += a;
+            }
+        }
+        if (verify && hash_bytes(image, (std::size_t)h.newSize) != h.newHash)
+            throw std::runtime_error("dumpable: patch result does not match");
+        if (newSize)
+            *newSize = (std::size_t)h.newSize;
+        return true;
+    }
+}
@@ -0,0 +1,86 @@
+// Copyright (c) 2014 ipkn.
+// Licensed under the MIT license.
+
+#pragma once
+
+#include <iostream>
+#include <stdexcept>
+#include <cstring>
+#include "dptr.h"
+
+namespace dumpable
+{
+    // Edits a loaded image in place and re-emits it without rebuilding it.
+    //
+    // The buffer holds a dumped image of size bytes and has room for capacity bytes.
+    // Same-size edits of POD members are simply written through root().
+    // While the editor is alive, every dstring/dvector/dptr assignment and every growing dvector
+    // allocates from the unused tail of the buffer instead of the heap; replaced storage stays
+    // in the image unused. write() emits the original bytes verbatim followed by the new tail.
+    //
+    // As with dumpable::write, only one editor (or write) may be active at a time, and dumpable
+    // containers living outside the buffer should not be modified meanwhile.
+    template <typename T>
+    class image_editor
+    {
+        public:
+            image_editor(void* buffer, dumpable::size_t size, dumpable::size_t capacity)
+                : buffer_((char*)buffer), size_(size), capacity_(capacity)
+            {
+                size_ = aligned(size_);
+                if (size_ > capacity_)
+                    throw std::length_error("dumpable::image_editor: buffer too small");
+                std::memset(buffer_ + size, 0, size_ - size);
+                detail::dptr_alloc() = [this](void* self, dumpable::size_t size)->std::pair<void*, dumpable::ptrdiff_t>{
+                        return alloc(self, size);
+                    };
+                detail::dptr_editing() = true;
+            }
+            ~image_editor()
+            {
+                detail::dptr_editing() = false;
+                detail::dptr_alloc() = nullptr;
+            }
+
+            T* root() const { return (T*)buffer_; }
+            // bytes of the image including everything allocated so far
+            dumpable::size_t size() const { return size_; }
+            dumpable::size_t capacity() const { return capacity_; }
+
+            void write(std::ostream& os) const
+            {
+                os.write(buffer_, size_);
+            }
+
+        private:
+            image_editor(const image_editor&);
+            image_editor& operator = (const image_editor&);
+
+            static dumpable::size_t aligned(dumpable::size_t size)
+            {
+#ifdef DUMPABLE_ALIGNED_POOL
+                return (size+(sizeof(size_t)-1))/sizeof(size_t)*sizeof(size_t);
+#else
+                return size;
+#endif
+            }
+
+            std::pair<void*, dumpable::ptrdiff_t> alloc(void* self, dumpable::size_t size)
+            {
+                if (!size)
+                    return std::make_pair(nullptr, 0);
+                size = aligned(size);
+                if (size > capacity_ - size_)
+                    throw std::length_error("dumpable::image_editor: out of headroom");
+                // the tail is contiguous with the image, so real addresses already are image offsets
+                char* allocated = buffer_ + size_;
+                std::memset(allocated, 0, size);
+                size_ += size;
+                return std::make_pair(allocated, allocated - (char*)self);
+            }
+
+            char* buffer_;
+            dumpable::size_t size_;
+            dumpable::size_t capacity_;
+    };
+}
@@ -0,0 +1,238 @@
+// Copyright (c) 2014 ipkn.
+// Licensed under the MIT license.
+
+#pragma once
+
+#include <string>
+#include <fstream>
+#include <memory>
+#include <stdexcept>
+#include <cstring>
+#include <algorithm>
+#include "dumpableconf.h"
+#include "dptr.h"
+#include "dtraits.h"
+#include "dvmem.h"
+
+#ifdef DUMPABLE_POSIX
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+namespace dumpable
+{
+    template <typename T>
+    void write(const T& data, std::ostream& os);
+
+#ifdef DUMPABLE_POSIX
+    // Pool whose storage is the output file itself, mapped while it grows.
+    //
+    // A range of address space is reserved up front and file extents are mapped over it in place,
+    // so allocations never move and real addresses are image offsets. The root is built elsewhere
+    // (its first rootSize bytes of file are kept free) and copied in by finish().
+    class file_pool
+    {
+        public:
+            file_pool(const std::string& path, const void* root, dumpable::size_t rootSize, dumpable::size_t max_size)
+                : root_((const char*)root), rootSize_(rootSize), base_(nullptr), reserved_(0), mapped_(0), size_(aligned(rootSize))
+            {
+                fd_ = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+                if (fd_ < 0)
+                    throw std::runtime_error("dumpable: cannot create " + path);
+                reserved_ = detail::round_up_to_page(max_size);
+                void* p = mmap(nullptr, reserved_, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+                if (p == MAP_FAILED)
+                {
+                    close(fd_);
+                    throw std::runtime_error("dumpable: cannot reserve address space for " + path);
+                }
+                base_ = (char*)p;
+                grow(size_);
+            }
+            ~file_pool()
+            {
+                if (base_)
+                    munmap(base_, reserved_);
+                if (fd_ >= 0)
+                    close(fd_);
+            }
+
+            std::pair<void*, dumpable::ptrdiff_t> alloc(void* self, dumpable::size_t size)
+            {
+                if (!size)
+                    return std::make_pair(nullptr, 0);
+                size = aligned(size);
+                grow(size_ + size);
+                char* allocated = base_ + size_;
+                dumpable::ptrdiff_t offset = size_;
+                size_ += size;
+                return std::make_pair(allocated, offset - offset_of(self));
+            }
+
+            dumpable::size_t size() const { return size_; }
+
+            // Copies the root in, trims the file to the image and closes it; returns the image size.
+            dumpable::size_t finish()
+            {
+                std::memcpy(base_, root_, rootSize_);
+                munmap(base_, reserved_);
+                base_ = nullptr;
+                bool ok = ftruncate(fd_, (off_t)size_) == 0;
+                ok = close(fd_) == 0 && ok;
+                fd_ = -1;
+                if (!ok)
+                    throw std::runtime_error("dumpable: cannot finish the image file");
+                return size_;
+            }
+
+        private:
+            file_pool(const file_pool&);
+            file_pool& operator = (const file_pool&);
+
+            static dumpable::size_t aligned(dumpable::size_t size)
+            {
+                return (size+(sizeof(size_t)-1))/sizeof(size_t)*sizeof(size_t);
+            }
+
+            dumpable::ptrdiff_t offset_of(void* self) const
+            {
+                if ((const char*)self >= root_ && (const char*)self < root_ + rootSize_)
+                    return (const char*)self - root_;
+                return (char*)self - base_;
+            }
+
+            void grow(dumpable::size_t needed)
+            {
+                if (needed <= mapped_)
+                    return;
+                if (needed > reserved_)
+                    throw std::length_error("dumpable::file_pool: image larger than the reserved size");
+                // double up to 1GB steps, so big images take few ftruncate/mmap calls
+                dumpable::size_t step = std::min<dumpable::size_t>(std::max<dumpable::size_t>(mapped_, 1 << 20), 1 << 30);
+                dumpable::size_t target = std::min(reserved_, detail::round_up_to_page(std::max(needed, mapped_ + step)));
+                if (ftruncate(fd_, (off_t)target) != 0)
+                    throw std::runtime_error("dumpable: cannot grow the image file");
+                void* p = mmap(base_ + mapped_, target - mapped_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd_, (off_t)mapped_);
+                if (p == MAP_FAILED)
+                    throw std::runtime_error("dumpable: cannot map the image file");
+                mapped_ = target;
+            }
+
+            int fd_;
+            const char* root_;
+            dumpable::size_t rootSize_;
+            char* base_;
+            dumpable::size_t reserved_;
+            dumpable::size_t mapped_;
+            dumpable::size_t size_;
+    };
+#endif
+
+    namespace detail
+    {
+        // address space reserved for one write_file; only touched pages cost anything
+        const dumpable::size_t default_file_reserve = sizeof(void*) == 8 ? (dumpable::size_t)1 << 40 : (dumpable::size_t)1 << 30;
+    }
+
+    // Dumps data into the file at path. Payloads are written into the mapped file as they are
+    // allocated instead of being collected in memory first; returns the image size.
+    // max_size bounds the image (address space is reserved for it, not memory or disk).
+    template <typename T>
+    dumpable::size_t write_file(const T& data, const std::string& path, dumpable::size_t max_size = detail::default_file_reserve)
+    {
+#ifdef DUMPABLE_POSIX
+        if (!is_trivially_dumpable<T>::value)
+        {
+            T x;
+            file_pool pool(path, &x, sizeof(T), max_size);
+            detail::dptr_alloc() = [&pool](void* self, dumpable::size_t size)->std::pair<void*, dumpable::ptrdiff_t>{
+                    return pool.alloc(self, size);
+                };
+            try
+            {
+                x = data;
+            }
+            catch(...)
+            {
+                detail::dptr_alloc() = nullptr;
+                throw;
+            }
+            detail::dptr_alloc() = nullptr;
+            return pool.finish();
+        }
+#else
+        (void)max_size;
+#endif
+        std::ofstream os(path.c_str(), std::ios::binary);
+        dumpable::write(data, os);
+        dumpable::size_t size = (dumpable::size_t)os.tellp();
+        if (!os)
+            throw std::runtime_error("dumpable: cannot write " + path);
+        return size;
+    }
+
+    // A dumped image file opened for reading: mapped read-only where mmap is available, read otherwise.
+    class mapped_file
+    {
+        public:
+            explicit mapped_file(const std::string& path)
+                : data_(nullptr), size_(0)
+            {
+#ifdef DUMPABLE_POSIX
+                int fd = open(path.c_str(), O_RDONLY);
+                struct stat st;
+                if (fd < 0 || fstat(fd, &st) != 0)
+                {
+                    if (fd >= 0)
+                        close(fd);
+                    throw std::runtime_error("dumpable: cannot open " + path);
+                }
+                size_ = (std::size_t)st.st_size;
+                if (size_)
+                {
+                    void* p = mmap(nullptr, size_, PROT_READ, MAP_SHARED, fd, 0);
+                    close(fd);
+                    if (p == MAP_FAILED)
+                        throw std::runtime_error("dumpable: cannot map " + path);
+                    data_ = (const char*)p;
+                }
+                else
+                    close(fd);
+#else
+                std::ifstream in(path.c_str(), std::ios::binary);
+                if (!in)
+                    throw std::runtime_error("dumpable: cannot open " + path);
+                in.seekg(0, std::ios::end);
+                size_ = (std::size_t)in.tellg();
+                in.seekg(0);
+                buffer_.reset(new char[size_ + 1]);
+                in.read(buffer_.get(), size_);
+                data_ = buffer_.get();
+#endif
+            }
+            ~mapped_file()
+            {
+#ifdef DUMPABLE_POSIX
+                if (data_)
+                    munmap((void*)data_, size_);
+#endif
+            }
+
+            const void* data() const { return data_; }
+            std::size_t size() const { return size_; }
+            template <typename T>
+            const T* root() const { return (const T*)data_; }
+
+        private:
+            mapped_file(const mapped_file&);
+            mapped_file& operator = (const mapped_file&);
+
+            const char* data_;
+            std::size_t size_;
+#ifndef DUMPABLE_POSIX
+            std::unique_ptr<char[]> buffer_;
+#endif
+    };
+}
@@ -0,0 +1,292 @@
+// Copyright (c) 2014 ipkn.
+// Licensed under the MIT license.
+
+#pragma once
+
+#include "dumpableconf.h"
+
+#ifdef DUMPABLE_POSIX
+
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <stdexcept>
+#include <cstdint>
+#include <cstring>
+#include <cerrno>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include "dvmem.h"
+
+namespace dumpable
+{
+    template <typename T>
+    void write(const T& data, std::ostream& os);
+
+    // Stream frames: a 64-bit payload size, the payload, then zero padding to a multiple of 8 bytes,
+    // so every frame of a stream starts 8-byte aligned (the layout drecord.h uses on disk).
+    inline void send_frame(int fd, const void* data, std::size_t size)
+    {
+        static const char zeros[8] = {0};
+        std::uint64_t header = size;
+        struct iovec parts[3] = {
+            {&header, sizeof(header)},
+            {(void*)data, size},
+            {(void*)zeros, (8 - size % 8) % 8},
+        };
+        struct iovec* part = parts;
+        int count = 3;
+        while(count)
+        {
+            ssize_t n = writev(fd, part, count);
+            if (n < 0)
+            {
+                if (errno == EINTR)
+                    continue;
+                throw std::runtime_error("dumpable: cannot send a frame");
+            }
+            for(; count && (std::size_t)n >= part->iov_len; part ++, count --)
+                n -= part->iov_len;
+            if (count)
+            {
+                part->iov_base = (char*)part->iov_base + n;
+                part->iov_len -= n;
+            }
+        }
+    }
+
+    // Dumps data and sends it as one frame.
+    template <typename T>
+    void send_dumped(int fd, const T& data)
+    {
+        std::ostringstream os;
+        dumpable::write(data, os);
+        std::string image = os.str();
+        send_frame(fd, image.data(), image.size());
+    }
+
+    // Receives frames from a socket or pipe into a ring buffer and hands them out in place.
+    //
+    // The ring is mapped twice back to back, so a frame wrapping around the end is still contiguous,
+    // and frames stay 8-byte aligned: a payload is usable with from_dumped_buffer without copying.
+    // A frame's space is reused once its message and every older one have been released.
+    // Frames must fit the capacity. When the ring is full, next() waits for other threads to release
+    // messages, so a single thread must not hold on to a whole ring's worth of them.
+    class frame_reader
+    {
+        public:
+            class message
+            {
+                public:
+                    message() : reader_(nullptr), data_(nullptr), size_(0), seq_(0) {}
+                    message(message&& m) noexcept
+                        : reader_(m.reader_), data_(m.data_), size_(m.size_), seq_(m.seq_)
+                    {
+                        m.reader_ = nullptr;
+                    }
+                    message& operator = (message&& m) noexcept
+                    {
+                        if (&m != this)
+                        {
+                            release();
+                            reader_ = m.reader_;
+                            data_ = m.data_;
+                            size_ = m.size_;
+                            seq_ = m.seq_;
+                            m.reader_ = nullptr;
+                        }
+                        return *this;
+                    }
+                    ~message()
+                    {
+                        release();
+                    }
+
+                    // false at the end of the stream
+                    explicit operator bool() const { return reader_ != nullptr; }
+                    const void* data() const { return data_; }
+                    std::size_t size() const { return size_; }
+                    template <typename T>
+                    const T* root() const { return (const T*)data_; }
+
+                    // gives the frame back to the ring; data() is invalid afterwards
+                    void release()
+                    {
+                        if (reader_)
+                            reader_->release(seq_);
+                        reader_ = nullptr;
+                    }
+
+                private:
+                    friend class frame_reader;
+                    message(const message&);
+                    message& operator = (const message&);
+
+                    message(frame_reader* reader, const char* data, std::size_t size, std::uint64_t seq)
+                        : reader_(reader), data_(data), size_(size), seq_(seq)
+                    {
+                    }
+
+                    frame_reader* reader_;
+                    const char* data_;
+                    std::size_t size_;
+                    std::uint64_t seq_;
+            };
+
+            // Reads from fd, which stays owned by the caller. capacity is rounded up to whole pages.
+            explicit frame_reader(int fd, std::size_t capacity = 1 << 20)
+                : fd_(fd), capacity_(detail::round_up_to_page(capacity)), head_(0), parsed_(0), tail_(0), firstSeq_(0)
+            {
+                int shm = detail::shared_memory_fd(capacity_);
+                if (shm < 0)
+                    throw std::runtime_error("dumpable: cannot create the frame ring");
+                void* area = mmap(nullptr, capacity_ * 2, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+                bool ok = area != MAP_FAILED;
+                if (ok)
+                {
+                    base_ = (char*)area;
+                    ok = mmap(base_, capacity_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, shm, 0) != MAP_FAILED &&
+                        mmap(base_ + capacity_, capacity_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, shm, 0) != MAP_FAILED;
+                    if (!ok)
+                        munmap(area, capacity_ * 2);
+                }
+                close(shm);
+                if (!ok)
+                    throw std::runtime_error("dumpable: cannot map the frame ring");
+            }
+            ~frame_reader()
+            {
+                // no message may be alive at this point
+                munmap(base_, capacity_ * 2);
+            }
+
+            std::size_t capacity() const { return capacity_; }
+            // bytes held by unreleased messages and frames not yet handed out
+            std::size_t used() const
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                return (std::size_t)(tail_ - head_);
+            }
+
+            // The next frame, reading from the fd as needed; an empty message at the end of the stream.
+            message next()
+            {
+                for(;;)
+                {
+                    message m = try_next();
+                    if (m)
+                        return m;
+                    if (!fill())
+                    {
+                        if (tail_ != parsed_)
+                            throw std::runtime_error("dumpable: stream ended inside a frame");
+                        return message();
+                    }
+                }
+            }
+
+            // The next frame if it has already been received; never reads from the fd.
+            message try_next()
+            {
+                if (tail_ - parsed_ < sizeof(std::uint64_t))
+                    return message();
+                std::uint64_t size;
+                std::memcpy(&size, at(parsed_), sizeof(size));
+                // the size comes from the peer: bound it before rounding can wrap it around
+                if (size > capacity_ - sizeof(std::uint64_t))
+                    throw std::length_error("dumpable::frame_reader: frame larger than the ring");
+                std::uint64_t frame = frame_size(size);
+                if (frame > capacity_)
+                    throw std::length_error("dumpable::frame_reader: frame larger than the ring");
+                if (tail_ - parsed_ < frame)
+                    return message();
+                const char* data = at(parsed_ + sizeof(std::uint64_t));
+                parsed_ += frame;
+                std::lock_guard<std::mutex> lock(mutex_);
+                frames_.push_back(frame_state(frame));
+                return message(this, data, (std::size_t)size, firstSeq_ + frames_.size() - 1);
+            }
+
+        private:
+            frame_reader(const frame_reader&);
+            frame_reader& operator = (const frame_reader&);
+
+            struct frame_state
+            {
+                explicit frame_state(std::uint64_t size) : size(size), released(false) {}
+                std::uint64_t size;
+                bool released;
+            };
+
+            static std::uint64_t frame_size(std::uint64_t payload)
+            {
+                return sizeof(std::uint64_t) + (payload + 7) / 8 * 8;
+            }
+
+            char* at(std::uint64_t position) const
+            {
+                return base_ + position % capacity_;
+            }
+
+            // Reads whatever is available into the free part of the ring; false at the end of the stream.
+            bool fill()
+            {
+                std::size_t space;
+                {
+                    std::unique_lock<std::mutex> lock(mutex_);
+                    released_.wait(lock, [this]{ return tail_ - head_ < capacity_; });
+                    space = (std::size_t)(capacity_ - (tail_ - head_));
+                }
+                for(;;)
+                {
+                    // the mirror mapping makes the free space contiguous
+                    ssize_t n = read(fd_, at(tail_), space);
+                    if (n > 0)
+                    {
+                        std::lock_guard<std::mutex> lock(mutex_);
+                        tail_ += (std::uint64_t)n;
+                        return true;
+                    }
+                    if (n == 0)
+                        return false;
+                    if (errno != EINTR)
+                        throw std::runtime_error("dumpable: cannot read frames");
+                }
+            }
+
+            void release(std::uint64_t seq)
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                frames_[(std::size_t)(seq - firstSeq_)].released = true;
+                bool freed = false;
+                while(!frames_.empty() && frames_.front().released)
+                {
+                    head_ += frames_.front().size;
+                    frames_.pop_front();
+                    firstSeq_ ++;
+                    freed = true;
+                }
+                if (freed)
+                    released_.notify_all();
+            }
+
+            int fd_;
+            std::size_t capacity_;
+            char* base_;
+            // absolute stream positions: head_ <= parsed_ <= tail_ <= head_ + capacity_
+            std::uint64_t head_;
+            std::uint64_t parsed_;
+            std::uint64_t tail_;
+            // frames handed out and not yet recycled, oldest first
+            std::deque<frame_state> frames_;
+            std::uint64_t firstSeq_;
+            mutable std::mutex mutex_;
+            std::condition_variable released_;
+    };
+}
+
+#endif
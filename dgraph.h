@@ -0,0 +1,189 @@
+// Copyright (c) 2014 ipkn.
+// Licensed under the MIT license.
+
+#pragma once
+
+#include <vector>
+#include <queue>
+#include <limits>
+#include <cstdint>
+#include <stdexcept>
+#include <functional>
+#include "dvector.h"
+
+namespace dumpable
+{
+    struct no_node_data {};
+
+    // Directed graph in compressed sparse row form: the edges of node n are
+    // targets_[offsets_[n] .. offsets_[n+1]), with their weights at the same indices.
+    // Graphs built without weights keep weights_ empty and every edge weighs 1.
+    template <typename Node = no_node_data, typename Weight = float>
+    class dgraph
+    {
+        public:
+            typedef std::uint32_t node_id;
+            typedef dumpable::size_t size_type;
+            typedef Weight weight_type;
+            static const node_id npos = (node_id)-1;
+
+            struct edge
+            {
+                node_id from;
+                node_id to;
+                Weight weight;
+            };
+
+            class neighbours
+            {
+                public:
+                    neighbours(const node_id* first, const node_id* last) : first_(first), last_(last) {}
+                    const node_id* begin() const { return first_; }
+                    const node_id* end() const { return last_; }
+                    size_type size() const { return last_ - first_; }
+                    bool empty() const { return first_ == last_; }
+                private:
+                    const node_id* first_;
+                    const node_id* last_;
+            };
+
+            dgraph() {}
+            dgraph(size_type nodeCount, const std::vector<edge>& edges, bool weighted = true)
+            {
+                build(nodeCount, edges, weighted);
+            }
+            dgraph(const std::vector<Node>& nodes, const std::vector<edge>& edges, bool weighted = true)
+                : nodes_(nodes)
+            {
+                build(nodes.size(), edges, weighted);
+            }
+
+            size_type node_count() const { return offsets_.empty() ? 0 : offsets_.size() - 1; }
+            size_type edge_count() const { return targets_.size(); }
+            bool weighted() const { return !weights_.empty(); }
+
+            // per-node data; empty when the graph was built from a node count
+            const dvector<Node>& nodes() const { return nodes_; }
+            const Node& node(node_id n) const { return nodes_[n]; }
+
+            size_type degree(node_id n) const { return offsets_[n+1] - offsets_[n]; }
+            neighbours out_edges(node_id n) const
+            {
+                return neighbours(targets_.data() + offsets_[n], targets_.data() + offsets_[n+1]);
+            }
+            // edge indices of n are [edge_begin(n), edge_end(n))
+            size_type edge_begin(node_id n) const { return offsets_[n]; }
+            size_type edge_end(node_id n) const { return offsets_[n+1]; }
+            node_id target(size_type e) const { return targets_[e]; }
+            Weight weight(size_type e) const { return weights_.empty() ? Weight(1) : weights_[e]; }
+
+        private:
+            void build(size_type nodeCount, const std::vector<edge>& edges, bool weighted)
+            {
+                // counting sort by source keeps edges of a node in input order
+                std::vector<dumpable::size_t> offsets(nodeCount + 1);
+                for(auto it = edges.begin(); it != edges.end(); ++it)
+                {
+                    if (it->from >= nodeCount || it->to >= nodeCount)
+                        throw std::out_of_range("dumpable::dgraph: edge to a missing node");
+                    offsets[it->from + 1] ++;
+                }
+                for(size_type n = 0; n < nodeCount; n ++)
+                    offsets[n+1] += offsets[n];
+                std::vector<node_id> targets(edges.size());
+                std::vector<Weight> weights(weighted ? edges.size() : 0);
+                std::vector<dumpable::size_t> next(offsets.begin(), offsets.end() - 1);
+                for(auto it = edges.begin(); it != edges.end(); ++it)
+                {
+                    dumpable::size_t e = next[it->from] ++;
+                    targets[e] = it->to;
+                    if (weighted)
+                        weights[e] = it->weight;
+                }
+                offsets_ = offsets;
+                targets_ = targets;
+                weights_ = weights;
+            }
+
+            dvector<Node> nodes_;
+            dvector<dumpable::size_t> offsets_;
+            dvector<node_id> targets_;
+            dvector<Weight> weights_;
+    };
+
+    template <typename Node, typename Weight>
+    const typename dgraph<Node, Weight>::node_id dgraph<Node, Weight>::npos;
+
+    // Hop counts from source (npos when unreachable), visiting nodes in breadth-first order.
+    template <typename Node, typename Weight>
+    std::vector<typename dgraph<Node, Weight>::node_id> bfs(const dgraph<Node, Weight>& g, typename dgraph<Node, Weight>::node_id source)
+    {
+        typedef typename dgraph<Node, Weight>::node_id node_id;
+        std::vector<node_id> hops(g.node_count(), dgraph<Node, Weight>::npos);
+        std::vector<node_id> frontier(1, source);
+        hops[source] = 0;
+        // the frontier itself is the queue: nodes are appended and scanned front to back
+        for(std::size_t i = 0; i < frontier.size(); i ++)
+        {
+            node_id n = frontier[i];
+            for(node_id m : g.out_edges(n))
+            {
+                if (hops[m] == dgraph<Node, Weight>::npos)
+                {
+                    hops[m] = hops[n] + 1;
+                    frontier.push_back(m);
+                }
+            }
+        }
+        return hops;
+    }
+
+    // Shortest distances from source for non-negative weights (max() when unreachable).
+    // parents, if given, receives the previous node on each shortest path (npos for source and unreachable).
+    template <typename Node, typename Weight>
+    std::vector<Weight> dijkstra(const dgraph<Node, Weight>& g, typename dgraph<Node, Weight>::node_id source,
+            std::vector<typename dgraph<Node, Weight>::node_id>* parents = nullptr)
+    {
+        typedef typename dgraph<Node, Weight>::node_id node_id;
+        typedef std::pair<Weight, node_id> item;
+        std::vector<Weight> dist(g.node_count(), std::numeric_limits<Weight>::max());
+        if (parents)
+            parents->assign(g.node_count(), dgraph<Node, Weight>::npos);
+        std::priority_queue<item, std::vector<item>, std::greater<item>> queue;
+        dist[source] = Weight(0);
+        queue.push(item(Weight(0), source));
+        while(!queue.empty())
+        {
+            item top = queue.top();
+            queue.pop();
+            node_id n = top.second;
+            if (top.first > dist[n])
+                continue;
+            for(std::size_t e = g.edge_begin(n); e < g.edge_end(n); e ++)
+            {
+                node_id m = g.target(e);
+                Weight d = top.first + g.weight(e);
+                if (d < dist[m])
+                {
+                    dist[m] = d;
+                    if (parents)
+                        (*parents)[m] = n;
+                    queue.push(item(d, m));
+                }
+            }
+        }
+        return dist;
+    }
+
+    // Nodes on a shortest path from the source given to dijkstra to target, or empty if unreachable.
+    template <typename NodeId>
+    std::vector<NodeId> path_to(const std::vector<NodeId>& parents, NodeId source, NodeId target)
+    {
+        std::vector<NodeId> path;
+        for(NodeId n = target; n != (NodeId)-1; n = parents[n])
+            path.push_back(n);
+        if (path.back() != source)
+            return std::vector<NodeId>();
+        return std::vector<NodeId>(path.rbegin(), path.rend());
+    }
+}
@@ -0,0 +1,211 @@
+// Copyright (c) 2014 ipkn.
+// Licensed under the MIT license.
+
+#pragma once
+
+#include <atomic>
+#include <mutex>
+#include <vector>
+#include <functional>
+#include <stdexcept>
+#include <cstdint>
+
+namespace dumpable
+{
+    // Holds the currently published dumped image of type T.
+    // Readers never block: they announce the epoch they entered in and load the current image.
+    // A replaced image is retired and released once every reader that could still see it has left.
+    template <typename T, std::size_t MaxReaders = 64>
+    class image_handle
+    {
+        public:
+            typedef std::function<void(void*)> deleter_type;
+
+        private:
+            struct image
+            {
+                void* buffer;
+                deleter_type deleter;
+                std::uint64_t retiredEpoch;
+            };
+
+            struct slot
+            {
+                std::atomic<std::uint64_t> epoch;
+                std::atomic<bool> owned;
+                char padding[64 - sizeof(std::atomic<std::uint64_t>) - sizeof(std::atomic<bool>)];
+            };
+
+        public:
+            class reader;
+
+            class read_guard
+            {
+                public:
+                    read_guard(read_guard&& rhs) noexcept
+                        : reader_(rhs.reader_), image_(rhs.image_)
+                    {
+                        rhs.reader_ = nullptr;
+                    }
+                    ~read_guard()
+                    {
+                        if (reader_)
+                            reader_->leave();
+                    }
+
+                    const T* get() const noexcept { return image_ ? (const T*)image_->buffer : nullptr; }
+                    const T* operator-> () const noexcept { return get(); }
+                    const T& operator* () const noexcept { return *get(); }
+                    explicit operator bool () const noexcept { return !!image_; }
+
+                private:
+                    friend class reader;
+                    read_guard(reader* r, image* img) : reader_(r), image_(img) {}
+                    read_guard(const read_guard&);
+                    read_guard& operator = (const read_guard&);
+
+                    reader* reader_;
+                    image* image_;
+            };
+
+            // One reader per thread; owns a slot of the handle until destroyed.
+            class reader
+            {
+                public:
+                    explicit reader(image_handle& handle)
+                        : handle_(handle), slot_(handle.claim_slot()), depth_(0)
+                    {
+                    }
+                    ~reader()
+                    {
+                        slot_->epoch.store(0);
+                        slot_->owned.store(false);
+                    }
+
+                    read_guard lock()
+                    {
+                        if (!depth_++)
+                            slot_->epoch.store(handle_.epoch_.load());
+                        return read_guard(this, handle_.current_.load());
+                    }
+
+                private:
+                    friend class read_guard;
+                    reader(const reader&);
+                    reader& operator = (const reader&);
+
+                    void leave()
+                    {
+                        if (!--depth_)
+                            slot_->epoch.store(0, std::memory_order_release);
+                    }
+
+                    image_handle& handle_;
+                    slot* slot_;
+                    int depth_;
+            };
+
+            image_handle() : current_(nullptr), epoch_(1)
+            {
+                for(std::size_t i = 0; i < MaxReaders; i ++)
+                {
+                    slots_[i].epoch.store(0);
+                    slots_[i].owned.store(false);
+                }
+            }
+
+            ~image_handle()
+            {
+                // no reader may be alive at this point
+                release(current_.load());
+                for(auto it = retired_.begin(); it != retired_.end(); ++it)
+                    release(*it);
+            }
+
+            // Makes buffer the current image. The previous image is released with its own deleter
+            // as soon as no reader can reach it anymore.
+            void publish(void* buffer, deleter_type deleter = default_deleter)
+            {
+                image* img = buffer ? new image{buffer, std::move(deleter), 0} : nullptr;
+                image* old = current_.exchange(img);
+                std::uint64_t epoch = epoch_.fetch_add(1) + 1;
+                std::lock_guard<std::mutex> lock(retireMutex_);
+                if (old)
+                {
+                    old->retiredEpoch = epoch;
+                    retired_.push_back(old);
+                }
+                reclaim_locked();
+            }
+
+            // Releases retired images whose readers have all left.
+            // publish calls this too; call it periodically if publishing is rare.
+            void reclaim()
+            {
+                std::lock_guard<std::mutex> lock(retireMutex_);
+                reclaim_locked();
+            }
+
+            std::size_t retired_count()
+            {
+                std::lock_guard<std::mutex> lock(retireMutex_);
+                return retired_.size();
+            }
+
+            static void default_deleter(void* buffer)
+            {
+                delete[] (char*)buffer;
+            }
+
+        private:
+            image_handle(const image_handle&);
+            image_handle& operator = (const image_handle&);
+
+            slot* claim_slot()
+            {
+                for(std::size_t i = 0; i < MaxReaders; i ++)
+                {
+                    bool expected = false;
+                    if (!slots_[i].owned.load() && slots_[i].owned.compare_exchange_strong(expected, true))
+                        return &slots_[i];
+                }
+                throw std::length_error("dumpable::image_handle: too many readers");
+            }
+
+            void reclaim_locked()
+            {
+                // A reader that announced epoch e may hold any image retired after e.
+                std::uint64_t oldestReader = UINT64_MAX;
+                for(std::size_t i = 0; i < MaxReaders; i ++)
+                {
+                    std::uint64_t e = slots_[i].epoch.load();
+                    if (e && e < oldestReader)
+                        oldestReader = e;
+                }
+                auto last = retired_.begin();
+                for(auto it = retired_.begin(); it != retired_.end(); ++it)
+                {
+                    if ((*it)->retiredEpoch <= oldestReader)
+                        release(*it);
+                    else
+                        *last++ = *it;
+                }
+                retired_.erase(last, retired_.end());
+            }
+
+            static void release(image* img)
+            {
+                if (!img)
+                    return;
+                if (img->deleter)
+                    img->deleter(img->buffer);
+                delete img;
+            }
+
+            std::atomic<image*> current_;
+            std::atomic<std::uint64_t> epoch_;
+            slot slots_[MaxReaders];
+            std::mutex retireMutex_;
+            std::vector<image*> retired_;
+    };
+}
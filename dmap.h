@@ -5,12 +5,70 @@
 
 #include <map>
 #include <algorithm>
+#include <thread>
+#include <vector>
+#include <stdexcept>
+#include <string>
 #include "dvector.h"
+#include "dstring.h"
 
 namespace dumpable
 {
-    // implemented as sorted array
-    template <typename K, typename V, typename Compare = std::less<K>>
+    // What a dmap built from a range does with repeated keys.
+    enum duplicate_policy
+    {
+        keep_first,
+        keep_last,
+        reject_duplicates,
+    };
+
+    // Tags for ranges already sorted by key, without duplicates (dmap) or with them (dmultimap).
+    struct sorted_unique_t {};
+    const sorted_unique_t sorted_unique = {};
+    struct sorted_equivalent_t {};
+    const sorted_equivalent_t sorted_equivalent = {};
+
+    namespace detail
+    {
+        // Stable sort of [first, last) on up to threads threads: sorted slices are merged pairwise.
+        template <typename T, typename Compare>
+        void parallel_stable_sort(T* first, T* last, Compare comp, unsigned threads)
+        {
+            std::size_t size = last - first;
+            const std::size_t min_slice = 1 << 14;
+            if (threads > size / min_slice)
+                threads = (unsigned)(size / min_slice);
+            if (threads <= 1)
+            {
+                std::stable_sort(first, last, comp);
+                return;
+            }
+            std::vector<T*> bounds;
+            for(unsigned i = 0; i <= threads; i ++)
+                bounds.push_back(first + size * i / threads);
+            std::vector<std::thread> workers;
+            for(unsigned i = 0; i < threads; i ++)
+                workers.emplace_back([&bounds, &comp, i]{ std::stable_sort(bounds[i], bounds[i+1], comp); });
+            for(auto& w : workers)
+                w.join();
+            for(std::size_t step = 1; step < threads; step *= 2)
+            {
+                workers.clear();
+                for(std::size_t i = 0; i + step < threads; i += step * 2)
+                {
+                    T* lo = bounds[i];
+                    T* mid = bounds[i+step];
+                    T* hi = bounds[std::min<std::size_t>(i + step * 2, threads)];
+                    workers.emplace_back([lo, mid, hi, &comp]{ std::inplace_merge(lo, mid, hi, comp); });
+                }
+                for(auto& w : workers)
+                    w.join();
+            }
+        }
+    }
+
+    // implemented as sorted array; with Multi, equal keys are kept in insertion order (see dmultimap)
+    template <typename K, typename V, typename Compare = std::less<K>, bool Multi = false>
     class dmap
     {
         public:
@@ -20,12 +78,34 @@ namespace dumpable
             {
             }
 
-            dmap(const dmap<K, V, Compare>& rhs)
+            // From any range of key/value pairs, sorted in place inside the map's own storage.
+            template <typename Iter>
+            dmap(Iter first, Iter last, duplicate_policy duplicates = keep_first, unsigned threads = 1)
+                : items_(first, last)
+            {
+                sort(duplicates, threads);
+            }
+
+            // From a range already sorted by key: verified in O(n), sorted anyway if it is not.
+            template <typename Iter>
+            dmap(sorted_unique_t, Iter first, Iter last)
+                : items_(first, last)
+            {
+                check_sorted();
+            }
+            template <typename Iter>
+            dmap(sorted_equivalent_t, Iter first, Iter last)
+                : items_(first, last)
+            {
+                check_sorted();
+            }
+
+            dmap(const dmap<K, V, Compare, Multi>& rhs)
             {
                 items_ = rhs.items_;
             }
 
-            dmap(dmap<K, V, Compare>&& rhs)
+            dmap(dmap<K, V, Compare, Multi>&& rhs)
             {
                 items_ = std::move(rhs.items_);
             }
@@ -59,13 +139,13 @@ namespace dumpable
             iterator end() const { return items_.end(); }
             value_compare value_comp() const { return value_compare(); }
 
-            dmap<K, V, Compare>& operator = (const dmap<K, V, Compare>& rhs)
+            dmap<K, V, Compare, Multi>& operator = (const dmap<K, V, Compare, Multi>& rhs)
             {
                 items_ = rhs.items_;
                 return *this;
             }
 
-            dmap<K, V, Compare>& operator = (dmap<K, V, Compare>&& rhs) noexcept
+            dmap<K, V, Compare, Multi>& operator = (dmap<K, V, Compare, Multi>&& rhs) noexcept
             {
                 items_ = std::move(rhs.items_);
                 return *this;
@@ -94,16 +174,106 @@ namespace dumpable
         public:
             iterator find(const K& key) const noexcept
             {
-                iterator it = std::lower_bound(begin(), end(), key, find_comp());
+                iterator it = lower_bound(key);
                 if (it != end() && !key_compare()(key, it->first))
                     return it;
                 return end();
             }
             dumpable::size_t count(const K& key) const noexcept
             {
+                if (Multi)
+                {
+                    std::pair<iterator, iterator> range = equal_range(key);
+                    return range.second - range.first;
+                }
                 return find(key) == end() ? 0 : 1;
             }
+
+            iterator lower_bound(const K& key) const noexcept
+            {
+                return std::lower_bound(begin(), end(), key, find_comp());
+            }
+            iterator upper_bound(const K& key) const noexcept
+            {
+                return std::upper_bound(begin(), end(), key, find_comp());
+            }
+            std::pair<iterator, iterator> equal_range(const K& key) const noexcept
+            {
+                return std::equal_range(begin(), end(), key, find_comp());
+            }
+
+            // Entries whose string key starts with prefix, for maps ordered by std::less on
+            // dstring (or any key with c_str() and size()).
+            template <typename C>
+            std::pair<iterator, iterator> prefix_range(const C* prefix) const noexcept
+            {
+                return prefix_range(prefix, std::char_traits<C>::length(prefix));
+            }
+            template <typename C, typename Traits, typename Alloc>
+            std::pair<iterator, iterator> prefix_range(const std::basic_string<C, Traits, Alloc>& prefix) const noexcept
+            {
+                return prefix_range(prefix.c_str(), prefix.size());
+            }
+            template <typename C, typename Traits>
+            std::pair<iterator, iterator> prefix_range(const dbasic_string<C, Traits>& prefix) const noexcept
+            {
+                return prefix_range(prefix.c_str(), prefix.size());
+            }
+            template <typename C>
+            std::pair<iterator, iterator> prefix_range(const C* prefix, dumpable::size_t length) const noexcept
+            {
+                typedef std::char_traits<C> traits;
+                iterator first = std::partition_point(begin(), end(), [&](const value_type& v) {
+                        dumpable::size_t n = std::min<dumpable::size_t>(v.first.size(), length);
+                        int c = traits::compare(v.first.c_str(), prefix, n);
+                        return c < 0 || (c == 0 && n < length);
+                    });
+                iterator last = std::partition_point(first, end(), [&](const value_type& v) {
+                        return v.first.size() >= length && !traits::compare(v.first.c_str(), prefix, length);
+                    });
+                return std::make_pair(first, last);
+            }
         private:
+            void check_sorted()
+            {
+                for(auto it = items_.begin(); it + 1 < items_.end(); ++it)
+                {
+                    if (Multi ? key_compare()((it+1)->first, it->first) : !key_compare()(it->first, (it+1)->first))
+                    {
+                        sort(keep_first, 1);
+                        break;
+                    }
+                }
+            }
+
+            void sort(duplicate_policy duplicates, unsigned threads)
+            {
+                detail::parallel_stable_sort(items_.begin(), items_.end(), value_compare(), threads);
+                if (Multi)
+                    return;
+                iterator out = items_.begin();
+                for(iterator it = items_.begin(); it != items_.end(); )
+                {
+                    iterator run = it + 1;
+                    while(run != items_.end() && !key_compare()(it->first, run->first))
+                        ++run;
+                    if (run - it > 1 && duplicates == reject_duplicates)
+                        throw std::invalid_argument("dumpable::dmap: duplicate key");
+                    iterator kept = duplicates == keep_last ? run - 1 : it;
+                    if (out != kept)
+                        *out = std::move(*kept);
+                    ++out;
+                    it = run;
+                }
+                if (out != items_.end())
+                    items_.resize(out - items_.begin());
+            }
+
             dvector<value_type> items_;
     };
+
+    // dmap keeping every entry of a repeated key, e.g. for secondary indexes.
+    // Built from a range (or sorted_equivalent range); equal_range gives all entries of a key.
+    template <typename K, typename V, typename Compare = std::less<K>>
+    using dmultimap = dmap<K, V, Compare, true>;
 }
@@ -0,0 +1,242 @@
+// Copyright (c) 2014 ipkn.
+// Licensed under the MIT license.
+
+#pragma once
+
+#include <vector>
+#include <string>
+#include <memory>
+#include <cstring>
+#include <algorithm>
+#include <cstdlib>
+#include <fstream>
+#include "dumpableconf.h"
+#include "dvmem.h"
+
+#ifdef DUMPABLE_NUMA
+#include <sched.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#endif
+
+namespace dumpable
+{
+    namespace detail
+    {
+        // Numbers in a sysfs list such as "0-1,4", ranges expanded: {0, 1, 4}. Online nodes need not be dense.
+        inline std::vector<int> parse_node_list(const std::string& list)
+        {
+            std::vector<int> ret;
+            const char* p = list.c_str();
+            while(*p)
+            {
+                char* end;
+                long first = std::strtol(p, &end, 10);
+                if (end == p)
+                    break;
+                long last = first;
+                p = end;
+                if (*p == '-')
+                {
+                    last = std::strtol(p + 1, &end, 10);
+                    p = end;
+                }
+                if (*p == ',')
+                    p ++;
+                for(long n = first; n <= last; n ++)
+                    ret.push_back((int)n);
+            }
+            return ret;
+        }
+
+#ifdef DUMPABLE_NUMA
+        inline std::string read_sysfs(const std::string& path)
+        {
+            std::ifstream in(path.c_str());
+            std::string line;
+            std::getline(in, line);
+            return line;
+        }
+
+        // ids of the online nodes, ascending
+        inline const std::vector<int>& numa_nodes()
+        {
+            static std::vector<int> nodes = []{
+                std::vector<int> ret = parse_node_list(read_sysfs("/sys/devices/system/node/online"));
+                if (ret.empty())
+                    ret.push_back(0);
+                return ret;
+            }();
+            return nodes;
+        }
+
+        inline int numa_node_count()
+        {
+            return (int)numa_nodes().size();
+        }
+
+        // node of every cpu, from each node's cpulist
+        inline const std::vector<int>& numa_cpu_nodes()
+        {
+            static std::vector<int> nodes = []{
+                std::vector<int> ret;
+                const std::vector<int>& online = numa_nodes();
+                for(std::size_t i = 0; i < online.size(); i ++)
+                {
+                    std::vector<int> cpus = parse_node_list(read_sysfs("/sys/devices/system/node/node" + std::to_string(online[i]) + "/cpulist"));
+                    for(std::size_t c = 0; c < cpus.size(); c ++)
+                    {
+                        if (cpus[c] >= (int)ret.size())
+                            ret.resize(cpus[c] + 1, online[0]);
+                        ret[cpus[c]] = online[i];
+                    }
+                }
+                return ret;
+            }();
+            return nodes;
+        }
+
+        inline int numa_current_node()
+        {
+            int cpu = sched_getcpu();
+            const std::vector<int>& nodes = numa_cpu_nodes();
+            return cpu >= 0 && cpu < (int)nodes.size() ? nodes[cpu] : numa_nodes()[0];
+        }
+
+        // mbind(2) without libnuma; policies from <linux/mempolicy.h>
+        const int numa_policy_bind = 2;
+        const int numa_policy_interleave = 3;
+
+        inline bool numa_bind(void* addr, std::size_t size, int policy, const std::vector<int>& nodes)
+        {
+            unsigned long mask[4] = {0};
+            const int max_nodes = (int)(sizeof(mask) * 8);
+            for(std::size_t i = 0; i < nodes.size(); i ++)
+            {
+                if (nodes[i] >= max_nodes)
+                    return false;
+                mask[nodes[i] / (sizeof(long) * 8)] |= 1UL << (nodes[i] % (sizeof(long) * 8));
+            }
+            return syscall(SYS_mbind, addr, size, policy, mask, (unsigned long)max_nodes + 1, 0) == 0;
+        }
+#else
+        inline const std::vector<int>& numa_nodes()
+        {
+            static std::vector<int> nodes(1, 0);
+            return nodes;
+        }
+        inline int numa_node_count() { return 1; }
+        inline int numa_current_node() { return 0; }
+#endif
+    }
+
+    // Copies of a dumped image placed for NUMA machines. Images are position independent,
+    // so every copy is a plain memcpy and is used like the original.
+    //   numa_replicate:  one copy per node; root() returns the copy on the calling thread's node.
+    //   numa_interleave: one copy with its pages spread round-robin over all nodes.
+    // With one node, without Linux mbind, or when binding is refused, a single copy is kept.
+    class numa_image
+    {
+        public:
+            enum placement { numa_replicate, numa_interleave };
+
+            numa_image(const void* image, std::size_t size, placement p = numa_replicate)
+                : size_(size)
+            {
+                const std::vector<int>& nodes = detail::numa_nodes();
+#ifdef DUMPABLE_NUMA
+                if (nodes.size() > 1)
+                {
+                    if (p == numa_replicate)
+                    {
+                        for(std::size_t i = 0; i < nodes.size(); i ++)
+                        {
+                            std::vector<int> mask(1, nodes[i]);
+                            if (!add_copy(image, detail::numa_policy_bind, mask))
+                                break;
+                            if (nodes[i] >= (int)replicaOfNode_.size())
+                                replicaOfNode_.resize(nodes[i] + 1, 0);
+                            replicaOfNode_[nodes[i]] = i;
+                        }
+                    }
+                    else
+                        add_copy(image, detail::numa_policy_interleave, nodes);
+                }
+                if (copies_.size() != (p == numa_replicate ? nodes.size() : 1))
+                    release();
+#else
+                (void)nodes;
+                (void)p;
+#endif
+                if (copies_.empty())
+                {
+                    fallback_.reset(new char[size + 1]);
+                    std::memcpy(fallback_.get(), image, size);
+                    copies_.push_back(fallback_.get());
+                }
+            }
+            ~numa_image()
+            {
+                release();
+            }
+
+            std::size_t size() const { return size_; }
+            // 1 when falling back to a single copy
+            std::size_t replica_count() const { return copies_.size(); }
+
+            // the copy nearest to the calling thread; threads that migrate may want to fetch it again
+            const void* data() const
+            {
+                if (copies_.size() == 1)
+                    return copies_[0];
+                std::size_t node = (std::size_t)detail::numa_current_node();
+                return copies_[node < replicaOfNode_.size() ? replicaOfNode_[node] : 0];
+            }
+            const void* data(std::size_t replica) const { return copies_[replica]; }
+
+            template <typename T>
+            const T* root() const { return (const T*)data(); }
+
+        private:
+            numa_image(const numa_image&);
+            numa_image& operator = (const numa_image&);
+
+#ifdef DUMPABLE_NUMA
+            bool add_copy(const void* image, int policy, const std::vector<int>& nodes)
+            {
+                std::size_t mapped = detail::round_up_to_page(size_ ? size_ : 1);
+                void* p = mmap(nullptr, mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+                if (p == MAP_FAILED)
+                    return false;
+                // bind before the first touch so the copy faults its pages in on the chosen nodes
+                if (!detail::numa_bind(p, mapped, policy, nodes))
+                {
+                    munmap(p, mapped);
+                    return false;
+                }
+                std::memcpy(p, image, size_);
+                mprotect(p, mapped, PROT_READ);
+                copies_.push_back((char*)p);
+                return true;
+            }
+#endif
+
+            void release()
+            {
+#ifdef DUMPABLE_NUMA
+                if (!fallback_)
+                    for(std::size_t i = 0; i < copies_.size(); i ++)
+                        munmap(copies_[i], detail::round_up_to_page(size_ ? size_ : 1));
+#endif
+                copies_.clear();
+                replicaOfNode_.clear();
+            }
+
+            std::size_t size_;
+            std::vector<char*> copies_;
+            // node id to index in copies_; online node ids may have gaps
+            std::vector<std::size_t> replicaOfNode_;
+            std::unique_ptr<char[]> fallback_;
+    };
+}
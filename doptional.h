@@ -0,0 +1,123 @@
+// Copyright (c) 2014 ipkn.
+// Licensed under the MIT license.
+
+#pragma once
+
+#include <new>
+#include <utility>
+#include <stdexcept>
+#include <type_traits>
+#include "dumpableconf.h"
+
+namespace dumpable
+{
+    // An optional value stored inline, without a pool allocation or pointer.
+    //
+    // A value is always default-constructed in place and then assigned, so dstring/dvector members
+    // of T go to the pool while dumping just like members of the enclosing struct.
+    template <typename T>
+    class doptional
+    {
+        public:
+            typedef T value_type;
+
+            doptional() : engaged_(false) {}
+            doptional(const T& value)
+                : engaged_(false)
+            {
+                *this = value;
+            }
+            doptional(T&& value)
+                : engaged_(false)
+            {
+                *this = std::move(value);
+            }
+            doptional(const doptional<T>& v)
+                : engaged_(false)
+            {
+                *this = v;
+            }
+            doptional(doptional<T>&& v)
+                : engaged_(false)
+            {
+                *this = std::move(v);
+            }
+            ~doptional()
+            {
+                reset();
+            }
+
+            doptional<T>& operator = (const T& value)
+            {
+                emplace() = value;
+                return *this;
+            }
+            doptional<T>& operator = (T&& value)
+            {
+                emplace() = std::move(value);
+                return *this;
+            }
+            doptional<T>& operator = (const doptional<T>& v)
+            {
+                if (&v == this)
+                    return *this;
+                if (v.engaged_)
+                    *this = *v;
+                else
+                    reset();
+                return *this;
+            }
+            doptional<T>& operator = (doptional<T>&& v)
+            {
+                if (&v == this)
+                    return *this;
+                if (v.engaged_)
+                    *this = std::move(*v);
+                else
+                    reset();
+                return *this;
+            }
+
+            // the held value, default-constructed first when empty
+            T& emplace()
+            {
+                if (!engaged_)
+                {
+                    new (&storage_) T();
+                    engaged_ = true;
+                }
+                return **this;
+            }
+            void reset()
+            {
+                if (engaged_)
+                    (**this).~T();
+                engaged_ = false;
+            }
+
+            bool has_value() const { return engaged_; }
+            explicit operator bool() const { return engaged_; }
+
+            // unchecked
+            T& operator* () { return *(T*)&storage_; }
+            const T& operator* () const { return *(const T*)&storage_; }
+            T* operator-> () { return (T*)&storage_; }
+            const T* operator-> () const { return (const T*)&storage_; }
+
+            const T& value() const
+            {
+                if (!engaged_)
+                    throw std::out_of_range("dumpable::doptional: no value");
+                return **this;
+            }
+            // by value, so a temporary fallback cannot dangle
+            T value_or(const T& fallback) const
+            {
+                return engaged_ ? **this : fallback;
+            }
+
+        private:
+            typename std::aligned_storage<sizeof(T), alignof(T)>::type storage_;
+            bool engaged_;
+    };
+}
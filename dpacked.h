@@ -0,0 +1,269 @@
+// Copyright (c) 2014 ipkn.
+// Licensed under the MIT license.
+
+#pragma once
+
+#include <vector>
+#include <algorithm>
+#include <limits>
+#include <type_traits>
+#include <cstdint>
+#include <cassert>
+#include "dvector.h"
+
+namespace dumpable
+{
+    namespace detail
+    {
+        inline unsigned bit_width64(std::uint64_t x)
+        {
+            unsigned n = 0;
+            while(x)
+            {
+                x >>= 1;
+                n ++;
+            }
+            return n;
+        }
+
+        // reads bits [pos, pos+width) of a word array; the array must have one spare word at the end
+        inline std::uint64_t extract_bits(const std::uint64_t* words, std::uint64_t pos, unsigned width)
+        {
+            const std::uint64_t* w = words + pos / 64;
+            unsigned shift = (unsigned)(pos % 64);
+            std::uint64_t v = w[0] >> shift;
+            if (shift + width > 64)
+                v |= w[1] << (64 - shift);
+            return width == 64 ? v : v & (((std::uint64_t)1 << width) - 1);
+        }
+    }
+
+    // Integer vector stored as bit-packed blocks of block_size values.
+    // Sorted input is delta coded, anything else is frame-of-reference coded against the block minimum.
+    // The first value of every block is kept in an uncompressed skip index.
+    template <typename T>
+    class dpacked_vector
+    {
+        static_assert(std::is_integral<T>::value && std::is_unsigned<T>::value, "dpacked_vector stores unsigned integers");
+
+        public:
+            typedef T value_type;
+            typedef dumpable::size_t size_type;
+            static const size_type block_size = 128;
+
+            struct block_header
+            {
+                T first;
+                dumpable::size_t offset;
+                std::uint32_t bits;
+            };
+
+            dpacked_vector() : size_(0), sorted_(false) {}
+            dpacked_vector(const std::vector<T>& v)
+            {
+                encode(v.data(), v.size());
+            }
+            template <typename Iter>
+            dpacked_vector(Iter first, Iter last)
+            {
+                std::vector<T> v(first, last);
+                encode(v.data(), v.size());
+            }
+
+            size_type size() const { return size_; }
+            bool empty() const { return !size_; }
+            bool is_sorted() const { return !!sorted_; }
+            size_type block_count() const { return blocks_.size(); }
+            // smallest value of a block (its first value when sorted)
+            T block_first(size_type block) const { return blocks_[block].first; }
+            size_type packed_bytes() const { return words_.size() * sizeof(std::uint64_t) + blocks_.size() * sizeof(block_header); }
+
+            // O(1) for unsorted input. Sorted input is delta coded, so this sums up to block_size deltas;
+            // use decode_block/decode or lower_bound rather than indexing value by value.
+            T operator[](size_type index) const
+            {
+                const block_header& h = blocks_[index / block_size];
+                size_type j = index % block_size;
+                if (!h.bits)
+                    return h.first;
+                const std::uint64_t* words = words_.data() + h.offset;
+                if (!sorted_)
+                    return h.first + (T)detail::extract_bits(words, j * h.bits, h.bits);
+                T v = h.first;
+                for(size_type i = 1; i <= j; i ++)
+                    v += (T)detail::extract_bits(words, i * h.bits, h.bits);
+                return v;
+            }
+            T at(size_type index) const { return (*this)[index]; }
+
+            // Decodes one block into out (block_size entries at most); returns the number of values.
+            size_type decode_block(size_type block, T* out) const
+            {
+                const block_header& h = blocks_[block];
+                size_type n = std::min(block_size, size_ - block * block_size);
+                if (!h.bits)
+                {
+                    std::fill(out, out + n, h.first);
+                    return n;
+                }
+                const std::uint64_t* words = words_.data() + h.offset;
+                unsigned bits = h.bits;
+                std::uint64_t mask = bits == 64 ? ~(std::uint64_t)0 : (((std::uint64_t)1 << bits) - 1);
+                std::uint64_t pos = 0;
+                for(size_type i = 0; i < n; i ++, pos += bits)
+                {
+                    const std::uint64_t* w = words + pos / 64;
+                    unsigned shift = (unsigned)(pos % 64);
+                    // the spare word makes the second read always valid; the shift by 64 is avoided by the split
+                    std::uint64_t hi = shift ? (w[1] << 1) << (63 - shift) : 0;
+                    out[i] = (T)(((w[0] >> shift) | hi) & mask);
+                }
+                if (sorted_)
+                {
+                    out[0] = h.first;
+                    for(size_type i = 1; i < n; i ++)
+                        out[i] += out[i-1];
+                }
+                else
+                {
+                    for(size_type i = 0; i < n; i ++)
+                        out[i] += h.first;
+                }
+                return n;
+            }
+
+            void decode(std::vector<T>& out) const
+            {
+                out.resize(size_);
+                for(size_type b = 0; b < blocks_.size(); b ++)
+                    decode_block(b, out.data() + b * block_size);
+            }
+
+            // index of the first value not less than value; requires sorted input
+            size_type lower_bound(T value) const
+            {
+                assert(sorted_);
+                if (!size_)
+                    return 0;
+                size_type b = std::upper_bound(blocks_.begin(), blocks_.end(), value,
+                        [](T v, const block_header& h){ return v <= h.first; }) - blocks_.begin();
+                if (b)
+                    b --;
+                T buffer[block_size];
+                size_type n = decode_block(b, buffer);
+                size_type i = std::lower_bound(buffer, buffer + n, value) - buffer;
+                return b * block_size + i;
+            }
+
+            bool contains(T value) const
+            {
+                size_type i = lower_bound(value);
+                return i < size_ && (*this)[i] == value;
+            }
+
+        private:
+            void encode(const T* data, size_type size)
+            {
+                size_ = size;
+                sorted_ = std::is_sorted(data, data + size);
+                std::vector<block_header> blocks;
+                std::vector<std::uint64_t> words;
+                for(size_type start = 0; start < size; start += block_size)
+                {
+                    size_type n = std::min(block_size, size - start);
+                    const T* v = data + start;
+                    // value-initialized so the padding written to the image is zero
+                    blocks.resize(blocks.size() + 1);
+                    block_header& h = blocks.back();
+                    h.first = sorted_ ? v[0] : *std::min_element(v, v + n);
+                    h.offset = words.size();
+                    std::uint64_t maxEntry = 0;
+                    for(size_type i = 0; i < n; i ++)
+                        maxEntry = std::max<std::uint64_t>(maxEntry, entry(v, i, h.first));
+                    h.bits = detail::bit_width64(maxEntry);
+                    if (h.bits)
+                    {
+                        words.resize(words.size() + (n * h.bits + 63) / 64);
+                        std::uint64_t* w = words.data() + h.offset;
+                        for(size_type i = 0; i < n; i ++)
+                        {
+                            std::uint64_t e = entry(v, i, h.first);
+                            std::uint64_t pos = i * h.bits;
+                            w[pos / 64] |= e << (pos % 64);
+                            if (pos % 64 + h.bits > 64)
+                                w[pos / 64 + 1] |= e >> (64 - pos % 64);
+                        }
+                    }
+                }
+                if (!words.empty())
+                    words.push_back(0);
+                blocks_ = blocks;
+                words_ = words;
+            }
+
+            std::uint64_t entry(const T* v, size_type i, T base) const
+            {
+                if (sorted_)
+                    return i ? v[i] - v[i-1] : 0;
+                return v[i] - base;
+            }
+
+            dvector<block_header> blocks_;
+            dvector<std::uint64_t> words_;
+            size_type size_;
+            char sorted_;
+    };
+
+    template <typename T>
+    const typename dpacked_vector<T>::size_type dpacked_vector<T>::block_size;
+
+    // Intersection of two sorted packed vectors. Blocks that cannot overlap are skipped
+    // through the skip index without being decoded.
+    template <typename T>
+    void intersect(const dpacked_vector<T>& a, const dpacked_vector<T>& b, std::vector<T>& out)
+    {
+        typedef typename dpacked_vector<T>::size_type size_type;
+        const size_type block_size = dpacked_vector<T>::block_size;
+        assert(a.is_sorted() && b.is_sorted());
+        if (a.empty() || b.empty())
+            return;
+
+        T bufA[block_size], bufB[block_size];
+        size_type ba = 0, bb = 0;
+        size_type na = a.decode_block(0, bufA), nb = b.decode_block(0, bufB);
+        size_type ia = 0, ib = 0;
+        for(;;)
+        {
+            if (ia == na)
+            {
+                if (++ba == a.block_count())
+                    break;
+                while(ib < nb && ba + 1 < a.block_count() && a.block_first(ba + 1) <= bufB[ib])
+                    ba ++;
+                na = a.decode_block(ba, bufA);
+                ia = 0;
+                continue;
+            }
+            if (ib == nb)
+            {
+                if (++bb == b.block_count())
+                    break;
+                while(ia < na && bb + 1 < b.block_count() && b.block_first(bb + 1) <= bufA[ia])
+                    bb ++;
+                nb = b.decode_block(bb, bufB);
+                ib = 0;
+                continue;
+            }
+            if (bufA[ia] < bufB[ib])
+                ia = std::lower_bound(bufA + ia, bufA + na, bufB[ib]) - bufA;
+            else if (bufB[ib] < bufA[ia])
+                ib = std::lower_bound(bufB + ib, bufB + nb, bufA[ia]) - bufB;
+            else
+            {
+                out.push_back(bufA[ia]);
+                ia ++;
+                ib ++;
+            }
+        }
+    }
+}
@@ -7,18 +7,24 @@
 #include <vector>
 #include <cstddef>
 #include <map>
+#include <unordered_map>
+#include <cstring>
+#include "dutility.h"
 
 namespace dumpable
 {
     class dpool
     {
         public:
+            dpool() : poolSize_(0) {}
             dpool(void* startAddress, dumpable::size_t size)
                 : poolSize_(size)
             {
                 poolOffsets_.insert(std::make_pair(startAddress, 0));
             }
 
+            dumpable::size_t size() const { return poolSize_; }
+
             void write(std::ostream& os)
             {
                 for(auto it = pool_.begin(); it != pool_.end(); ++it)
@@ -34,18 +40,67 @@ namespace dumpable
 #ifdef DUMPABLE_ALIGNED_POOL
                 size = (size+(sizeof(size_t)-1))/sizeof(size_t)*sizeof(size_t);
 #endif
+                void* allocatedAddress = alloc_block(size);
+                return std::make_pair(allocatedAddress, poolSize_-size-offset_of(self));
+            }
+
+            // Allocates an independent object (e.g. another root) and returns its offset in the image.
+            std::pair<void*, dumpable::ptrdiff_t> alloc_root(dumpable::size_t size)
+            {
+#ifdef DUMPABLE_ALIGNED_POOL
+                size = (size+(sizeof(size_t)-1))/sizeof(size_t)*sizeof(size_t);
+#endif
+                void* allocatedAddress = alloc_block(size);
+                return std::make_pair(allocatedAddress, poolSize_-size);
+            }
+
+            // Like alloc followed by a copy of bytes, but reuses an identical payload allocated this way before.
+            std::pair<void*, dumpable::ptrdiff_t> alloc_shared(void* self, const void* bytes, dumpable::size_t size)
+            {
+                if (!size)
+                    return std::make_pair(nullptr, 0);
+                std::uint64_t hash = detail::hash_bytes(bytes, size);
+                auto range = shared_.equal_range(hash);
+                for(auto it = range.first; it != range.second; ++it)
+                {
+                    const shared_payload& p = it->second;
+                    if (p.size == size && !std::memcmp(p.address, bytes, size))
+                        return std::make_pair(p.address, p.offset-offset_of(self));
+                }
+                std::pair<void*, dumpable::ptrdiff_t> ret = alloc(self, size);
+                std::memcpy(ret.first, bytes, size);
+                shared_payload p = {ret.first, poolSize_-(dumpable::ptrdiff_t)pool_.back().size(), size};
+                shared_.insert(std::make_pair(hash, p));
+                return ret;
+            }
+        private:
+            struct shared_payload
+            {
+                void* address;
+                dumpable::ptrdiff_t offset;
+                dumpable::size_t size;
+            };
+
+            void* alloc_block(dumpable::size_t size)
+            {
                 pool_.push_back(std::vector<char>(size));
                 void* allocatedAddress = &pool_.back()[0];
                 poolOffsets_.insert(std::make_pair(allocatedAddress, poolSize_));
                 poolSize_ += size;
-                auto it = poolOffsets_.upper_bound(self);
+                return allocatedAddress;
+            }
+
+            // image offset of an address inside the root or a pool block
+            dumpable::ptrdiff_t offset_of(void* address) const
+            {
+                auto it = poolOffsets_.upper_bound(address);
                 --it;
-                dumpable::ptrdiff_t diff = (char*)self - (char*)it->first;
-                return std::make_pair(allocatedAddress, poolSize_-size-it->second-diff);
+                return it->second + ((char*)address - (char*)it->first);
             }
-        private:
+
             std::vector<std::vector<char>> pool_;
             dumpable::ptrdiff_t poolSize_;
             std::map<void*, dumpable::ptrdiff_t> poolOffsets_;
+            std::unordered_multimap<std::uint64_t, shared_payload> shared_;
     };
 }
@@ -6,22 +6,90 @@
 #include "dumpableconf.h"
 
 #include <cstddef>
+#include <cstring>
 #include <functional>
 #include <tuple>
+#include <new>
 
 namespace dumpable
 {
+    // Source of build-mode (non-pooled) container storage for the current thread, see darena.h.
+    // Storage from it is never freed by containers and elements in it are not destroyed.
+    class build_allocator
+    {
+        public:
+            virtual void* allocate(dumpable::size_t size, dumpable::size_t alignment) = 0;
+        protected:
+            ~build_allocator() {}
+    };
+
     namespace detail
     {
+        inline build_allocator*& build_arena()
+        {
+            static thread_local build_allocator* arena = nullptr;
+            return arena;
+        }
+
         inline std::function<std::pair<void*, dumpable::ptrdiff_t>(void* self, dumpable::size_t size)>& dptr_alloc()
         { 
             static std::function<std::pair<void*, dumpable::ptrdiff_t>(void* self, dumpable::size_t size)> allocFunc;
             return allocFunc;
         }
+        // Optional companion of dptr_alloc for payloads without pointers (string and POD vector contents):
+        // returns storage already holding the bytes, possibly shared with an identical earlier payload.
+        inline std::function<std::pair<void*, dumpable::ptrdiff_t>(void* self, const void* bytes, dumpable::size_t size)>& dptr_alloc_shared()
+        {
+            static std::function<std::pair<void*, dumpable::ptrdiff_t>(void* self, const void* bytes, dumpable::size_t size)> allocFunc;
+            return allocFunc;
+        }
+        // Optional; called with storage returned by dptr_alloc once it holds its final contents,
+        // so a writer can stream finished parts of the image out while the rest is still being built.
+        inline std::function<void(void* allocated)>& dptr_commit()
+        {
+            static std::function<void(void* allocated)> commitFunc;
+            return commitFunc;
+        }
+        // Set only by image_editor: dptr_alloc then hands out storage at its real image address,
+        // so containers may grow into the pool. During a write the pool holds image offsets instead.
+        inline bool& dptr_editing()
+        {
+            static bool editing = false;
+            return editing;
+        }
         inline bool dumpable_is_custom_alloc()
         {
             return !!dptr_alloc();
         }
+
+        // Who owns the buffer of a dvector/dbasic_string (their isPooled_ member).
+        enum storage_kind
+        {
+            storage_heap = 0,
+            // allocated by dptr_alloc with exactly size() elements
+            storage_pool = 1,
+            // allocated by dptr_alloc with power-of-2 capacity, while editing a loaded image
+            storage_pool_growable = 2,
+            // allocated by the thread's build_allocator with power-of-2 capacity, released with it
+            storage_arena = 3,
+        };
+
+        // new T[size], or default-constructed elements in the thread's build arena
+        template <typename T>
+        T* new_array(dumpable::size_t size, char& kind)
+        {
+            build_allocator* arena = build_arena();
+            if (!arena)
+            {
+                kind = storage_heap;
+                return new T[size];
+            }
+            T* ret = (T*)arena->allocate(size * sizeof(T), alignof(T));
+            for(dumpable::size_t i = 0; i < size; i ++)
+                new (ret+i) T();
+            kind = storage_arena;
+            return ret;
+        }
     }
 
     template <typename T>
@@ -38,6 +106,25 @@ namespace dumpable
                 diff_ = offset;
                 return ret;
             }
+            static void commit_internal(void* allocated)
+            {
+                if (detail::dptr_commit())
+                    detail::dptr_commit()(allocated);
+            }
+            void* alloc_shared_internal(const void* bytes, dumpable::size_t size)
+            {
+                if (!detail::dptr_alloc_shared())
+                {
+                    void* ret = alloc_internal(size);
+                    std::memcpy(ret, bytes, size);
+                    return ret;
+                }
+                void* ret;
+                dumpable::ptrdiff_t offset;
+                std::tie(ret, offset) = detail::dptr_alloc_shared()(this, bytes, size);
+                diff_ = offset;
+                return ret;
+            }
         public:
             dptr() : diff_(0) {}
             dptr(const dptr<T>& rhs) 
@@ -75,6 +162,7 @@ namespace dumpable
                 {
                     void* ret = alloc_internal(sizeof(T));
                     *(T*)ret = *x;
+                    commit_internal(ret);
                 }
                 else
                     diff_ = (char*)x - (char*)this;
@@ -93,7 +181,9 @@ namespace dumpable
                     return *this;
                 T* x = &*dptr_x;
                 dptr_x = nullptr;
-                return (*this = x);
+                // moving never copies the pointee, even under dptr_alloc
+                diff_ = x ? (char*)x - (char*)this : 0;
+                return *this;
             }
     };
 }
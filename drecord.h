@@ -0,0 +1,329 @@
+// Copyright (c) 2014 ipkn.
+// Licensed under the MIT license.
+
+#pragma once
+
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <sstream>
+#include <iterator>
+#include <stdexcept>
+#include "dumpableconf.h"
+
+#ifdef DUMPABLE_POSIX
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+namespace dumpable
+{
+    template <typename T>
+    void write(const T& data, std::ostream& os);
+
+    // Append-only log of dumped records.
+    //
+    // <path> holds frames: a 64-bit payload size, the dumped record, padding to 8 bytes.
+    // <path>.idx holds the 64-bit offset of every payload, so record i is found in O(1).
+    // Index entries are written only after their frames reached the file, so a reader
+    // never sees a record that is not complete.
+    template <typename T>
+    class record_writer
+    {
+        public:
+            explicit record_writer(const std::string& path)
+                : data_(std::fopen(path.c_str(), "ab")), index_(std::fopen((path + ".idx").c_str(), "ab"))
+            {
+                if (!data_ || !index_)
+                {
+                    close();
+                    throw std::runtime_error("dumpable: cannot open record log " + path);
+                }
+                std::fseek(data_, 0, SEEK_END);
+                std::fseek(index_, 0, SEEK_END);
+                offset_ = (std::uint64_t)std::ftell(data_);
+                count_ = (std::size_t)(std::ftell(index_) / sizeof(std::uint64_t));
+            }
+            // Flushes what is left; errors are lost here, so call flush() first to see them.
+            ~record_writer()
+            {
+                try
+                {
+                    flush();
+                }
+                catch(std::runtime_error&)
+                {
+                }
+                close();
+            }
+
+            // Returns the record number. Readers see it after the next flush.
+            std::size_t append(const T& record)
+            {
+                buffer_.str(std::string());
+                dumpable::write(record, buffer_);
+                const std::string& payload = buffer_.str();
+                std::uint64_t size = payload.size();
+                static const char zeros[8] = {0};
+                std::size_t padding = (8 - payload.size() % 8) % 8;
+
+                std::fwrite(&size, sizeof(size), 1, data_);
+                std::fwrite(payload.data(), 1, payload.size(), data_);
+                std::fwrite(zeros, 1, padding, data_);
+                pending_.push_back(offset_ + sizeof(size));
+                offset_ += sizeof(size) + payload.size() + padding;
+                return count_ + pending_.size() - 1;
+            }
+
+            std::size_t size() const { return count_ + pending_.size(); }
+
+            void flush()
+            {
+                if (!data_)
+                    return;
+                if (std::fflush(data_) != 0)
+                    throw std::runtime_error("dumpable: cannot write record log");
+                if (!pending_.empty())
+                {
+                    std::fwrite(pending_.data(), sizeof(std::uint64_t), pending_.size(), index_);
+                    count_ += pending_.size();
+                    pending_.clear();
+                }
+                if (std::fflush(index_) != 0)
+                    throw std::runtime_error("dumpable: cannot write record log index");
+            }
+
+        private:
+            record_writer(const record_writer&);
+            record_writer& operator = (const record_writer&);
+
+            void close()
+            {
+                if (data_)
+                    std::fclose(data_);
+                if (index_)
+                    std::fclose(index_);
+                data_ = index_ = nullptr;
+            }
+
+            std::FILE* data_;
+            std::FILE* index_;
+            std::uint64_t offset_;
+            std::size_t count_;
+            std::vector<std::uint64_t> pending_;
+            std::ostringstream buffer_;
+    };
+
+    // Reads a log written by record_writer, zero-copy where mmap is available.
+    // refresh() picks up records flushed since; pointers obtained before a refresh are invalidated by it.
+    template <typename T>
+    class record_reader
+    {
+        public:
+            class iterator
+            {
+                public:
+                    typedef std::random_access_iterator_tag iterator_category;
+                    typedef T value_type;
+                    typedef std::ptrdiff_t difference_type;
+                    typedef const T* pointer;
+                    typedef const T& reference;
+
+                    iterator() : r_(nullptr), i_(0) {}
+                    iterator(const record_reader* r, std::size_t i) : r_(r), i_(i) {}
+                    const T& operator* () const { return *(*r_)[i_]; }
+                    const T* operator-> () const { return (*r_)[i_]; }
+                    const T& operator[](difference_type n) const { return *(*r_)[i_ + n]; }
+
+                    iterator& operator ++ () { ++i_; return *this; }
+                    iterator operator ++ (int) { iterator ret = *this; ++i_; return ret; }
+                    iterator& operator -- () { --i_; return *this; }
+                    iterator operator -- (int) { iterator ret = *this; --i_; return ret; }
+                    iterator& operator += (difference_type n) { i_ += n; return *this; }
+                    iterator& operator -= (difference_type n) { i_ -= n; return *this; }
+                    iterator operator + (difference_type n) const { return iterator(r_, i_ + n); }
+                    iterator operator - (difference_type n) const { return iterator(r_, i_ - n); }
+                    friend iterator operator + (difference_type n, const iterator& it) { return it + n; }
+                    difference_type operator - (const iterator& rhs) const { return (difference_type)i_ - (difference_type)rhs.i_; }
+
+                    bool operator == (const iterator& rhs) const { return i_ == rhs.i_; }
+                    bool operator != (const iterator& rhs) const { return i_ != rhs.i_; }
+                    bool operator < (const iterator& rhs) const { return i_ < rhs.i_; }
+                    bool operator > (const iterator& rhs) const { return i_ > rhs.i_; }
+                    bool operator <= (const iterator& rhs) const { return i_ <= rhs.i_; }
+                    bool operator >= (const iterator& rhs) const { return i_ >= rhs.i_; }
+                private:
+                    const record_reader* r_;
+                    std::size_t i_;
+            };
+
+            explicit record_reader(const std::string& path)
+                : path_(path), data_(nullptr), dataSize_(0)
+            {
+#ifdef DUMPABLE_POSIX
+                mapped_ = 0;
+                dataFd_ = open(path.c_str(), O_RDONLY);
+                indexFd_ = open((path + ".idx").c_str(), O_RDONLY);
+                if (dataFd_ < 0 || indexFd_ < 0)
+                {
+                    close_files();
+                    throw std::runtime_error("dumpable: cannot open record log " + path);
+                }
+#endif
+                refresh();
+            }
+            ~record_reader()
+            {
+#ifdef DUMPABLE_POSIX
+                close_files();
+#endif
+            }
+
+            std::size_t refresh()
+            {
+                std::vector<std::uint64_t> added;
+                read_index(offsets_.size() * sizeof(std::uint64_t), added);
+                if (added.empty())
+                    return offsets_.size();
+                remap();
+                for(auto it = added.begin(); it != added.end(); ++it)
+                {
+                    std::uint64_t size;
+                    if (*it < sizeof(size) || *it > dataSize_)
+                        throw std::runtime_error("dumpable: corrupted record log index");
+                    std::memcpy(&size, data_ + *it - sizeof(size), sizeof(size));
+                    if (size > dataSize_ - *it)
+                        throw std::runtime_error("dumpable: corrupted record log");
+                    offsets_.push_back(*it);
+                }
+                return offsets_.size();
+            }
+
+            std::size_t size() const { return offsets_.size(); }
+            bool empty() const { return offsets_.empty(); }
+
+            const T* operator[](std::size_t index) const
+            {
+                return (const T*)(data_ + offsets_[index]);
+            }
+            std::size_t record_size(std::size_t index) const
+            {
+                std::uint64_t size;
+                std::memcpy(&size, data_ + offsets_[index] - sizeof(size), sizeof(size));
+                return (std::size_t)size;
+            }
+
+            iterator begin() const { return iterator(this, 0); }
+            iterator end() const { return iterator(this, offsets_.size()); }
+
+        private:
+            record_reader(const record_reader&);
+            record_reader& operator = (const record_reader&);
+
+#ifdef DUMPABLE_POSIX
+            std::uint64_t read_index(std::uint64_t from, std::vector<std::uint64_t>& added)
+            {
+                struct stat st;
+                if (fstat(indexFd_, &st) != 0)
+                    throw std::runtime_error("dumpable: cannot read record log index");
+                std::uint64_t end = (std::uint64_t)st.st_size / sizeof(std::uint64_t) * sizeof(std::uint64_t);
+                if (end <= from)
+                    return end;
+                added.resize((std::size_t)((end - from) / sizeof(std::uint64_t)));
+                std::size_t want = added.size() * sizeof(std::uint64_t);
+                std::size_t got = 0;
+                while(got < want)
+                {
+                    ssize_t n = pread(indexFd_, (char*)added.data() + got, want - got, (off_t)(from + got));
+                    if (n <= 0)
+                        throw std::runtime_error("dumpable: cannot read record log index");
+                    got += (std::size_t)n;
+                }
+                return end;
+            }
+
+            void remap()
+            {
+                struct stat st;
+                if (fstat(dataFd_, &st) != 0)
+                    throw std::runtime_error("dumpable: cannot read record log");
+                std::size_t size = (std::size_t)st.st_size;
+                if (size == dataSize_)
+                    return;
+                if (mapped_)
+                    munmap((void*)data_, mapped_);
+                void* p = mmap(nullptr, size, PROT_READ, MAP_SHARED, dataFd_, 0);
+                if (p == MAP_FAILED)
+                {
+                    data_ = nullptr;
+                    dataSize_ = mapped_ = 0;
+                    throw std::runtime_error("dumpable: cannot map record log");
+                }
+                data_ = (const char*)p;
+                dataSize_ = mapped_ = size;
+            }
+
+            void close_files()
+            {
+                if (mapped_)
+                    munmap((void*)data_, mapped_);
+                if (dataFd_ >= 0)
+                    close(dataFd_);
+                if (indexFd_ >= 0)
+                    close(indexFd_);
+                mapped_ = 0;
+                dataFd_ = indexFd_ = -1;
+            }
+
+            int dataFd_;
+            int indexFd_;
+            std::size_t mapped_;
+#else
+            static std::uint64_t read_tail(const std::string& path, std::uint64_t from, std::vector<char>& out)
+            {
+                std::FILE* fp = std::fopen(path.c_str(), "rb");
+                if (!fp)
+                    throw std::runtime_error("dumpable: cannot open record log " + path);
+                std::fseek(fp, 0, SEEK_END);
+                std::uint64_t end = (std::uint64_t)std::ftell(fp);
+                if (end > from)
+                {
+                    std::size_t old = out.size();
+                    out.resize(old + (std::size_t)(end - from));
+                    std::fseek(fp, (long)from, SEEK_SET);
+                    end = from + std::fread(&out[old], 1, (std::size_t)(end - from), fp);
+                    out.resize(old + (std::size_t)(end - from));
+                }
+                std::fclose(fp);
+                return end;
+            }
+
+            std::uint64_t read_index(std::uint64_t from, std::vector<std::uint64_t>& added)
+            {
+                std::vector<char> bytes;
+                std::uint64_t end = read_tail(path_ + ".idx", from, bytes);
+                added.resize(bytes.size() / sizeof(std::uint64_t));
+                if (!added.empty())
+                    std::memcpy(added.data(), bytes.data(), added.size() * sizeof(std::uint64_t));
+                return end;
+            }
+
+            void remap()
+            {
+                dataSize_ = (std::size_t)read_tail(path_, buffer_.size(), buffer_);
+                data_ = buffer_.data();
+            }
+
+            std::vector<char> buffer_;
+#endif
+
+            std::string path_;
+            const char* data_;
+            std::size_t dataSize_;
+            std::vector<std::uint64_t> offsets_;
+    };
+}
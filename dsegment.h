@@ -0,0 +1,361 @@
+// Copyright (c) 2014 ipkn.
+// Licensed under the MIT license.
+
+#pragma once
+
+#include <iostream>
+#include <sstream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include "dumpableconf.h"
+#include "dbuilder.h"
+
+#ifdef DUMPABLE_POSIX
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+namespace dumpable
+{
+    // File layout:
+    //   header: "DSEGS1\0\0", segment count, bytes of table and names (64-bit each)
+    //   table:  per segment its file offset, size, name offset and name length
+    //   names, then every segment starting at a multiple of segment_alignment
+    // Each segment is an image_builder image, so it can be mapped on its own.
+    namespace detail
+    {
+        const char segment_magic[8] = {'D', 'S', 'E', 'G', 'S', '1', '\0', '\0'};
+        // a multiple of every common page size and of the Windows allocation granularity
+        const std::uint64_t segment_alignment = 1 << 16;
+
+        struct segment_header
+        {
+            char magic[8];
+            std::uint64_t count;
+            std::uint64_t tableSize;
+        };
+
+        struct segment_entry
+        {
+            std::uint64_t offset;
+            std::uint64_t size;
+            std::uint32_t nameOffset;
+            std::uint32_t nameLength;
+        };
+    }
+
+    // Pointer from one segment to an object in any segment, resolved through segmented_image.
+    // segment is the index given by segmented_writer::segment_index, offset the one from image_builder::add.
+    template <typename T>
+    struct dxptr
+    {
+        std::uint32_t segment;
+        std::uint32_t reserved;
+        std::uint64_t offset;
+
+        static dxptr make(std::uint32_t segment, std::uint64_t offset)
+        {
+            dxptr ret = {segment, 0, offset};
+            return ret;
+        }
+    };
+
+    class segmented_writer
+    {
+        public:
+            typedef dumpable::size_t size_type;
+
+            // The builder of the named segment, created on first use.
+            image_builder& segment(const std::string& name)
+            {
+                auto it = index_.find(name);
+                if (it != index_.end())
+                    return *builders_[it->second];
+                index_[name] = builders_.size();
+                names_.push_back(name);
+                builders_.push_back(std::unique_ptr<image_builder>(new image_builder()));
+                return *builders_.back();
+            }
+            std::uint32_t segment_index(const std::string& name)
+            {
+                segment(name);
+                return (std::uint32_t)index_[name];
+            }
+
+            // Adds root to the named segment and returns a pointer usable from any segment.
+            template <typename T>
+            dxptr<T> add(const std::string& name, const T& root)
+            {
+                std::uint32_t index = segment_index(name);
+                return dxptr<T>::make(index, builders_[index]->add(root));
+            }
+
+            void write(std::ostream& os)
+            {
+                using namespace detail;
+                std::vector<std::string> images;
+                for(auto it = builders_.begin(); it != builders_.end(); ++it)
+                {
+                    std::ostringstream image;
+                    (*it)->write(image);
+                    images.push_back(image.str());
+                }
+
+                segment_header header;
+                std::memcpy(header.magic, segment_magic, sizeof(header.magic));
+                header.count = images.size();
+                std::string names;
+                std::vector<segment_entry> table(images.size());
+                for(std::size_t i = 0; i < names_.size(); i ++)
+                {
+                    table[i].nameOffset = (std::uint32_t)names.size();
+                    table[i].nameLength = (std::uint32_t)names_[i].size();
+                    names += names_[i];
+                }
+                header.tableSize = table.size() * sizeof(segment_entry) + names.size();
+                std::uint64_t offset = align(sizeof(header) + header.tableSize);
+                for(std::size_t i = 0; i < images.size(); i ++)
+                {
+                    table[i].offset = offset;
+                    table[i].size = images[i].size();
+                    offset = align(offset + images[i].size());
+                }
+
+                os.write((const char*)&header, sizeof(header));
+                if (!table.empty())
+                    os.write((const char*)table.data(), table.size() * sizeof(segment_entry));
+                os.write(names.data(), names.size());
+                std::uint64_t written = sizeof(header) + header.tableSize;
+                for(std::size_t i = 0; i < images.size(); i ++)
+                {
+                    pad(os, table[i].offset - written);
+                    os.write(images[i].data(), images[i].size());
+                    written = table[i].offset + images[i].size();
+                }
+            }
+
+        private:
+            static std::uint64_t align(std::uint64_t offset)
+            {
+                return (offset + detail::segment_alignment - 1) / detail::segment_alignment * detail::segment_alignment;
+            }
+            static void pad(std::ostream& os, std::uint64_t size)
+            {
+                static const char zeros[256] = {0};
+                for(; size; size -= std::min<std::uint64_t>(size, sizeof(zeros)))
+                    os.write(zeros, (std::streamsize)std::min<std::uint64_t>(size, sizeof(zeros)));
+            }
+
+            std::vector<std::string> names_;
+            std::map<std::string, std::size_t> index_;
+            std::vector<std::unique_ptr<image_builder>> builders_;
+    };
+
+    // A segmented image file. Only the table is read when opening; each segment is mapped
+    // (or read, without mmap) the first time it is used, from any thread.
+    class segmented_image
+    {
+        public:
+            typedef dumpable::size_t size_type;
+            static const size_type npos = (size_type)-1;
+
+            explicit segmented_image(const std::string& path)
+                : path_(path)
+            {
+                using namespace detail;
+#ifdef DUMPABLE_POSIX
+                fd_ = open(path.c_str(), O_RDONLY);
+                if (fd_ < 0)
+                    throw std::runtime_error("dumpable: cannot open " + path);
+#endif
+                try
+                {
+                    read_table();
+                }
+                catch(...)
+                {
+                    close_file();
+                    throw;
+                }
+                loaded_.reset(new std::atomic<const char*>[entries_.size()]);
+                for(std::size_t i = 0; i < entries_.size(); i ++)
+                    loaded_[i].store(nullptr);
+            }
+            ~segmented_image()
+            {
+#ifdef DUMPABLE_POSIX
+                for(std::size_t i = 0; i < entries_.size(); i ++)
+                    if (loaded_[i].load() && entries_[i].size)
+                        munmap((void*)loaded_[i].load(), (std::size_t)entries_[i].size);
+#endif
+                close_file();
+            }
+
+            size_type segment_count() const { return entries_.size(); }
+            const std::string& segment_name(size_type index) const { return names_[index]; }
+            size_type segment_size(size_type index) const { return (size_type)entries_[index].size; }
+            size_type find_segment(const std::string& name) const
+            {
+                for(size_type i = 0; i < names_.size(); i ++)
+                    if (names_[i] == name)
+                        return i;
+                return npos;
+            }
+            bool is_loaded(size_type index) const { return loaded_[index].load() != nullptr; }
+
+            // The segment's image, mapped on first use.
+            // The index usually comes from a dxptr read out of the file, so it is checked.
+            const void* segment(size_type index) const
+            {
+                if (index >= entries_.size())
+                    throw std::out_of_range("dumpable: no such segment");
+                const char* data = loaded_[index].load(std::memory_order_acquire);
+                if (data)
+                    return data;
+                std::lock_guard<std::mutex> lock(mutex_);
+                data = loaded_[index].load();
+                if (!data)
+                {
+                    data = load(index);
+                    loaded_[index].store(data, std::memory_order_release);
+                }
+                return data;
+            }
+            const void* segment(const std::string& name) const
+            {
+                size_type index = find_segment(name);
+                if (index == npos)
+                    throw std::out_of_range("dumpable: no segment " + name);
+                return segment(index);
+            }
+
+            template <typename T>
+            const T* root(const std::string& name, size_type offset = 0) const
+            {
+                return (const T*)((const char*)segment(name) + offset);
+            }
+
+            template <typename T>
+            const T* resolve(const dxptr<T>& p) const
+            {
+                return (const T*)((const char*)segment(p.segment) + p.offset);
+            }
+
+        private:
+            segmented_image(const segmented_image&);
+            segmented_image& operator = (const segmented_image&);
+
+            void read_table()
+            {
+                using namespace detail;
+                std::uint64_t fileSize = file_size();
+                segment_header header;
+                if (!read_at(0, &header, sizeof(header)) || std::memcmp(header.magic, segment_magic, sizeof(header.magic)) ||
+                        header.count > header.tableSize / sizeof(segment_entry))
+                    throw std::runtime_error("dumpable: not a segmented image");
+                if (header.tableSize > fileSize - sizeof(header))
+                    throw std::runtime_error("dumpable: truncated segmented image");
+                std::vector<char> table((std::size_t)header.tableSize);
+                if (!table.empty() && !read_at(sizeof(header), table.data(), table.size()))
+                    throw std::runtime_error("dumpable: truncated segmented image");
+                const char* names = table.data() + header.count * sizeof(segment_entry);
+                std::size_t namesSize = table.size() - header.count * sizeof(segment_entry);
+                entries_.resize((std::size_t)header.count);
+                for(std::size_t i = 0; i < entries_.size(); i ++)
+                {
+                    segment_entry& e = entries_[i];
+                    std::memcpy(&e, table.data() + i * sizeof(segment_entry), sizeof(segment_entry));
+                    // a segment past the end of the file would fault when first touched
+                    if (e.nameOffset > namesSize || e.nameLength > namesSize - e.nameOffset || e.offset % segment_alignment ||
+                            e.offset > fileSize || e.size > fileSize - e.offset)
+                        throw std::runtime_error("dumpable: corrupted segmented image");
+                    names_.push_back(std::string(names + e.nameOffset, (std::size_t)e.nameLength));
+                }
+            }
+
+            std::uint64_t file_size() const
+            {
+#ifdef DUMPABLE_POSIX
+                struct stat st;
+                if (fstat(fd_, &st) != 0)
+                    throw std::runtime_error("dumpable: cannot read " + path_);
+                return (std::uint64_t)st.st_size;
+#else
+                std::ifstream in(path_.c_str(), std::ios::binary | std::ios::ate);
+                if (!in)
+                    throw std::runtime_error("dumpable: cannot open " + path_);
+                return (std::uint64_t)in.tellg();
+#endif
+            }
+
+            const char* load(size_type index) const
+            {
+                const detail::segment_entry& e = entries_[index];
+                static const char empty[8] = {0};
+                if (!e.size)
+                    return empty;
+#ifdef DUMPABLE_POSIX
+                void* p = mmap(nullptr, (std::size_t)e.size, PROT_READ, MAP_SHARED, fd_, (off_t)e.offset);
+                if (p == MAP_FAILED)
+                    throw std::runtime_error("dumpable: cannot map segment " + names_[index]);
+                return (const char*)p;
+#else
+                std::unique_ptr<char[]> buffer(new char[(std::size_t)e.size]);
+                if (!read_at(e.offset, buffer.get(), (std::size_t)e.size))
+                    throw std::runtime_error("dumpable: cannot read segment " + names_[index]);
+                buffers_.push_back(std::move(buffer));
+                return buffers_.back().get();
+#endif
+            }
+
+            bool read_at(std::uint64_t offset, void* out, std::size_t size) const
+            {
+#ifdef DUMPABLE_POSIX
+                std::size_t done = 0;
+                while(done < size)
+                {
+                    ssize_t n = pread(fd_, (char*)out + done, size - done, (off_t)(offset + done));
+                    if (n <= 0)
+                        return false;
+                    done += (std::size_t)n;
+                }
+                return true;
+#else
+                std::ifstream in(path_.c_str(), std::ios::binary);
+                in.seekg((std::streamoff)offset);
+                in.read((char*)out, size);
+                return (std::size_t)in.gcount() == size;
+#endif
+            }
+
+            void close_file()
+            {
+#ifdef DUMPABLE_POSIX
+                if (fd_ >= 0)
+                    close(fd_);
+                fd_ = -1;
+#endif
+            }
+
+            std::string path_;
+#ifdef DUMPABLE_POSIX
+            int fd_;
+#else
+            mutable std::vector<std::unique_ptr<char[]>> buffers_;
+#endif
+            std::vector<detail::segment_entry> entries_;
+            std::vector<std::string> names_;
+            std::unique_ptr<std::atomic<const char*>[]> loaded_;
+            mutable std::mutex mutex_;
+    };
+}
@@ -0,0 +1,183 @@
+// Copyright (c) 2014 ipkn.
+// Licensed under the MIT license.
+
+#pragma once
+
+#include <vector>
+#include <utility>
+#include "dvector.h"
+
+namespace dumpable
+{
+    namespace detail
+    {
+        template <typename... Fields>
+        struct soa_columns;
+
+        template <>
+        struct soa_columns<>
+        {
+            void push_back() {}
+            void resize(dumpable::size_t) {}
+            void clear() {}
+        };
+
+        template <typename F, typename... Rest>
+        struct soa_columns<F, Rest...> : soa_columns<Rest...>
+        {
+            dvector<F> column;
+
+            void push_back(const F& value, const Rest&... rest)
+            {
+                column.push_back(value);
+                soa_columns<Rest...>::push_back(rest...);
+            }
+            void resize(dumpable::size_t size)
+            {
+                column.resize(size);
+                soa_columns<Rest...>::resize(size);
+            }
+            void clear()
+            {
+                column.clear();
+                soa_columns<Rest...>::clear();
+            }
+        };
+
+        template <std::size_t I, typename Columns>
+        struct soa_element;
+
+        template <typename F, typename... Rest>
+        struct soa_element<0, soa_columns<F, Rest...>>
+        {
+            typedef F type;
+            typedef soa_columns<F, Rest...> holder;
+        };
+
+        template <std::size_t I, typename F, typename... Rest>
+        struct soa_element<I, soa_columns<F, Rest...>> : soa_element<I-1, soa_columns<Rest...>>
+        {
+        };
+    }
+
+    // Struct of arrays: every field is stored as its own dvector, so a scan over one field
+    // touches only that field's memory. Rows are accessed through a lightweight proxy.
+    template <typename... Fields>
+    class dsoa
+    {
+        static_assert(sizeof...(Fields) > 0, "dsoa needs at least one field");
+        typedef detail::soa_columns<Fields...> columns_type;
+
+        public:
+            typedef dumpable::size_t size_type;
+
+            template <std::size_t I>
+            struct field
+            {
+                typedef typename detail::soa_element<I, columns_type>::type type;
+            };
+
+            template <typename Owner>
+            class basic_row
+            {
+                public:
+                    basic_row(Owner& owner, size_type index) : owner_(owner), index_(index) {}
+
+                    template <std::size_t I>
+                    auto get() const -> decltype(std::declval<Owner&>().template column<I>()[0])
+                    {
+                        return owner_.template column<I>()[index_];
+                    }
+                    size_type index() const { return index_; }
+
+                private:
+                    Owner& owner_;
+                    size_type index_;
+            };
+            typedef basic_row<dsoa> row;
+            typedef basic_row<const dsoa> const_row;
+
+            size_type size() const { return columns_.column.size(); }
+            bool empty() const { return columns_.column.empty(); }
+
+            template <std::size_t I>
+            dvector<typename field<I>::type>& column()
+            {
+                return static_cast<typename detail::soa_element<I, columns_type>::holder&>(columns_).column;
+            }
+            template <std::size_t I>
+            const dvector<typename field<I>::type>& column() const
+            {
+                return static_cast<const typename detail::soa_element<I, columns_type>::holder&>(columns_).column;
+            }
+
+            row operator[](size_type index) { return row(*this, index); }
+            const_row operator[](size_type index) const { return const_row(*this, index); }
+
+            void push_back(const Fields&... values)
+            {
+                columns_.push_back(values...);
+            }
+            void resize(size_type size)
+            {
+                columns_.resize(size);
+            }
+            void clear()
+            {
+                columns_.clear();
+            }
+
+        private:
+            columns_type columns_;
+    };
+
+    // Sum of a column. Independent accumulators let the compiler keep several vector lanes busy.
+    template <typename Acc, typename T>
+    Acc column_sum(const dvector<T>& column)
+    {
+        const T* p = column.data();
+        dumpable::size_t n = column.size(), i = 0;
+        Acc s0 = Acc(), s1 = Acc(), s2 = Acc(), s3 = Acc();
+        for(; i + 4 <= n; i += 4)
+        {
+            s0 += p[i];
+            s1 += p[i+1];
+            s2 += p[i+2];
+            s3 += p[i+3];
+        }
+        for(; i < n; i ++)
+            s0 += p[i];
+        return (s0 + s1) + (s2 + s3);
+    }
+
+    // Appends the row index of every element matching pred to out, without branching on pred.
+    template <typename T, typename Pred>
+    void column_filter(const dvector<T>& column, Pred pred, std::vector<dumpable::size_t>& out)
+    {
+        const T* p = column.data();
+        dumpable::size_t n = column.size();
+        std::size_t found = out.size();
+        out.resize(found + n);
+        for(dumpable::size_t i = 0; i < n; i ++)
+        {
+            out[found] = i;
+            found += pred(p[i]) ? 1 : 0;
+        }
+        out.resize(found);
+    }
+
+    // Keeps only the rows of selection whose element matches pred.
+    template <typename T, typename Pred>
+    void column_refine(const dvector<T>& column, Pred pred, std::vector<dumpable::size_t>& selection)
+    {
+        const T* p = column.data();
+        std::size_t found = 0;
+        for(std::size_t i = 0; i < selection.size(); i ++)
+        {
+            dumpable::size_t row = selection[i];
+            selection[found] = row;
+            found += pred(p[row]) ? 1 : 0;
+        }
+        selection.resize(found);
+    }
+}
@@ -4,8 +4,12 @@
 #pragma once
 
 #include "dptr.h"
+#include "dutility.h"
 #include <string>
+#include <functional>
 #include <cstring>
+#include <algorithm>
+#include <cstdint>
 #include <iostream>
 
 namespace dumpable
@@ -23,21 +27,19 @@ namespace dumpable
                 }
                 if (dumpable::detail::dptr_alloc())
                 {
-                    isPooled_ = true;
+                    isPooled_ = detail::storage_pool;
                     size_ = size;
-                    void* buf = dptr<T>::alloc_internal((size+1) * sizeof(T));
-                    Traits::copy((T*)buf, begin, size+1);
+                    dptr<T>::commit_internal(dptr<T>::alloc_shared_internal(begin, (size+1) * sizeof(T)));
                 }
                 else
                 {
-                    isPooled_ = false;
                     size_ = size;
-                    dptr<T>::operator =(new T[size+1]);
+                    dptr<T>::operator =(detail::new_array<T>(size+1, isPooled_));
                     Traits::copy((T*)*this, begin, size+1);
                 }
             }
         public:
-            explicit dbasic_string() : size_(0), isPooled_(false) {}
+            explicit dbasic_string() : size_(0), isPooled_(detail::storage_heap) {}
             dbasic_string(const T* str)
             {
                 dumpable::size_t length = Traits::length(str);
@@ -55,7 +57,7 @@ namespace dumpable
                 : dptr<T>(std::move(s)), size_(s.size_), isPooled_(s.isPooled_)
                 {
                     s.size_ = 0;
-                    s.isPooled_ = false;
+                    s.isPooled_ = detail::storage_heap;
                 }
             ~dbasic_string()
             {
@@ -71,7 +73,7 @@ namespace dumpable
                 }
                 dptr<T>::operator =(nullptr);
                 size_ = 0;
-                isPooled_ = false;
+                isPooled_ = detail::storage_heap;
             }
             T* begin() const noexcept { return (T*)*this; }
             T* end() const noexcept { return begin() + size(); }
@@ -124,13 +126,14 @@ namespace dumpable
             {
                 if (&s == this)
                     return *this;
+                clear();
                 size_ = s.size_;
                 isPooled_ = s.isPooled_;
 
                 dptr<T>::operator =(std::move(s));
 
                 s.size_ = 0;
-                s.isPooled_ = false;
+                s.isPooled_ = detail::storage_heap;
 
                 return *this;
             }
@@ -223,4 +226,159 @@ namespace dumpable
     {
         return !(a==b);
     }
+
+    namespace detail
+    {
+        template <typename T, typename Traits>
+        inline int compare_strings(const dbasic_string<T, Traits>& a, const dbasic_string<T, Traits>& b)
+        {
+            int ret = Traits::compare(a.c_str(), b.c_str(), std::min(a.size(), b.size()));
+            if (ret)
+                return ret;
+            return a.size() < b.size() ? -1 : a.size() > b.size() ? 1 : 0;
+        }
+    }
+
+    template <typename T, typename Traits>
+    inline bool operator < (const dbasic_string<T, Traits>& a, const dbasic_string<T, Traits>& b)
+    {
+        return detail::compare_strings(a, b) < 0;
+    }
+
+    template <typename T, typename Traits>
+    inline bool operator > (const dbasic_string<T, Traits>& a, const dbasic_string<T, Traits>& b)
+    {
+        return detail::compare_strings(a, b) > 0;
+    }
+
+    template <typename T, typename Traits>
+    inline bool operator <= (const dbasic_string<T, Traits>& a, const dbasic_string<T, Traits>& b)
+    {
+        return detail::compare_strings(a, b) <= 0;
+    }
+
+    template <typename T, typename Traits>
+    inline bool operator >= (const dbasic_string<T, Traits>& a, const dbasic_string<T, Traits>& b)
+    {
+        return detail::compare_strings(a, b) >= 0;
+    }
+
+    // dbasic_string that also stores the 64-bit FNV-1a hash of its contents, computed when it is assigned.
+    // Unequal strings are rejected by comparing hashes, and hashing a loaded string costs nothing.
+    // The hash is only updated by assignment: writing characters through operator[] or begin()
+    // leaves it stale, so reassign the string after editing it in place.
+    template <typename T, typename Traits = std::char_traits<T>>
+    class dbasic_hashed_string : public dbasic_string<T, Traits>
+    {
+        typedef dbasic_string<T, Traits> base;
+        public:
+            dbasic_hashed_string() : hash_(hash_of(nullptr, 0)) {}
+            dbasic_hashed_string(const T* str)
+                : base(str), hash_(hash_of(str, Traits::length(str)))
+            {
+            }
+            dbasic_hashed_string(const std::basic_string<T, Traits>& s)
+                : base(s), hash_(hash_of(s.c_str(), s.size()))
+            {
+            }
+            dbasic_hashed_string(const base& s)
+                : base(s), hash_(hash_of(s.c_str(), s.size()))
+            {
+            }
+            dbasic_hashed_string(const dbasic_hashed_string<T, Traits>& s)
+                : base(s), hash_(s.hash_)
+            {
+            }
+            dbasic_hashed_string(dbasic_hashed_string<T, Traits>&& s) noexcept
+                : base(std::move(s)), hash_(s.hash_)
+            {
+                s.hash_ = hash_of(nullptr, 0);
+            }
+
+            void clear()
+            {
+                base::clear();
+                hash_ = hash_of(nullptr, 0);
+            }
+
+            std::uint64_t hash() const noexcept { return hash_; }
+
+            static std::uint64_t hash_of(const T* str, dumpable::size_t size) noexcept
+            {
+                return detail::hash_bytes(str, size * sizeof(T));
+            }
+            static std::uint64_t hash_of(const T* str) noexcept
+            {
+                return hash_of(str, Traits::length(str));
+            }
+
+            // The hash always comes from the source: while dumping, our own pooled characters cannot be read back.
+            dbasic_hashed_string<T, Traits>& operator = (const T* str)
+            {
+                base::operator=(str);
+                hash_ = hash_of(str);
+                return *this;
+            }
+            dbasic_hashed_string<T, Traits>& operator = (const std::basic_string<T, Traits>& s)
+            {
+                base::operator=(s);
+                hash_ = hash_of(s.c_str(), s.size());
+                return *this;
+            }
+            dbasic_hashed_string<T, Traits>& operator = (const base& s)
+            {
+                base::operator=(s);
+                hash_ = hash_of(s.c_str(), s.size());
+                return *this;
+            }
+            dbasic_hashed_string<T, Traits>& operator = (const dbasic_hashed_string<T, Traits>& s)
+            {
+                base::operator=(s);
+                hash_ = s.hash_;
+                return *this;
+            }
+            dbasic_hashed_string<T, Traits>& operator = (dbasic_hashed_string<T, Traits>&& s)
+            {
+                if (&s == this)
+                    return *this;
+                hash_ = s.hash_;
+                base::operator=(std::move(s));
+                s.hash_ = hash_of(nullptr, 0);
+                return *this;
+            }
+        private:
+            // the same width on every target, so images and hash values match across architectures
+            std::uint64_t hash_;
+    };
+
+    typedef dbasic_hashed_string<char> dhstring;
+    typedef dbasic_hashed_string<wchar_t> dhwstring;
+
+    template <typename T, typename Traits>
+    bool operator == (const dbasic_hashed_string<T, Traits>& a, const dbasic_hashed_string<T, Traits>& b)
+    {
+        if (a.hash() != b.hash() || a.size() != b.size())
+            return false;
+        if (a.c_str() == b.c_str())
+            return true;
+        return !Traits::compare(a.c_str(), b.c_str(), a.size());
+    }
+
+    template <typename T, typename Traits>
+    inline bool operator != (const dbasic_hashed_string<T, Traits>& a, const dbasic_hashed_string<T, Traits>& b)
+    {
+        return !(a==b);
+    }
+}
+
+namespace std
+{
+    template <typename T, typename Traits>
+    struct hash<dumpable::dbasic_hashed_string<T, Traits>>
+    {
+        std::size_t operator()(const dumpable::dbasic_hashed_string<T, Traits>& s) const noexcept
+        {
+            return (std::size_t)s.hash();
+        }
+    };
 }
@@ -0,0 +1,105 @@
+// Copyright (c) 2014 ipkn.
+// Licensed under the MIT license.
+
+#pragma once
+
+#include <type_traits>
+#include <array>
+#include "dumpableconf.h"
+#include "dptr.h"
+#include "dvector.h"
+#include "dstring.h"
+#include "dmap.h"
+#include "dbitset.h"
+#include "dsoa.h"
+#include "dpacked.h"
+#include "dtrie.h"
+#include "dgraph.h"
+#include "dversioned.h"
+#include "doptional.h"
+#include "dvariant.h"
+#include "dutility.h"
+
+namespace dumpable
+{
+    namespace detail
+    {
+        template <bool... Bs>
+        struct all_true;
+        template <>
+        struct all_true<> : std::true_type {};
+        template <bool B, bool... Bs>
+        struct all_true<B, Bs...> : std::integral_constant<bool, B && all_true<Bs...>::value> {};
+    }
+
+    // A type whose image is just its own bytes: no dptr inside, so dumping it is one memcpy.
+    // Every dumpable container has a user-provided copy, so a trivially copyable type holds none.
+    template <typename T>
+    struct is_trivially_dumpable : std::integral_constant<bool, std::is_trivially_copyable<T>::value>
+    {
+    };
+
+    // Image size known at compile time, e.g. to size fixed packet buffers.
+    // Only defined for trivially dumpable types; other images carry their pool after the root.
+    template <typename T, typename = void>
+    struct static_image_size;
+
+    template <typename T>
+    struct static_image_size<T, typename std::enable_if<is_trivially_dumpable<T>::value>::type>
+        : std::integral_constant<dumpable::size_t, sizeof(T)>
+    {
+    };
+
+    // Whether a member of type T survives dumping. std::string, std::vector, raw pointers and the
+    // like do not: they point outside the image. Mark structs made of dumpable members with
+    // DUMPABLE_STRUCT so they can be nested.
+    template <typename T>
+    struct is_dumpable : std::integral_constant<bool, is_trivially_dumpable<T>::value && !std::is_pointer<T>::value>
+    {
+    };
+
+    template <typename T, std::size_t N>
+    struct is_dumpable<T[N]> : is_dumpable<T> {};
+    template <typename T, std::size_t N>
+    struct is_dumpable<std::array<T, N>> : is_dumpable<T> {};
+    template <typename T>
+    struct is_dumpable<dptr<T>> : is_dumpable<T> {};
+    template <typename T>
+    struct is_dumpable<dvector<T>> : is_dumpable<T> {};
+    template <typename T, typename Traits>
+    struct is_dumpable<dbasic_string<T, Traits>> : std::true_type {};
+    template <typename T, typename Traits>
+    struct is_dumpable<dbasic_hashed_string<T, Traits>> : std::true_type {};
+    template <typename K, typename V, typename Compare, bool Multi>
+    struct is_dumpable<dmap<K, V, Compare, Multi>> : std::integral_constant<bool, is_dumpable<K>::value && is_dumpable<V>::value> {};
+    template <>
+    struct is_dumpable<dbitset> : std::true_type {};
+    template <typename... Fields>
+    struct is_dumpable<dsoa<Fields...>> : detail::all_true<is_dumpable<Fields>::value...> {};
+    template <typename T>
+    struct is_dumpable<dpacked_vector<T>> : std::true_type {};
+    template <>
+    struct is_dumpable<dtrie> : std::true_type {};
+    template <typename Node, typename Weight>
+    struct is_dumpable<dgraph<Node, Weight>> : is_dumpable<Node> {};
+    template <typename T>
+    struct is_dumpable<dversioned<T>> : is_dumpable<T> {};
+    template <typename T>
+    struct is_dumpable<dversioned_vector<T>> : is_dumpable<T> {};
+    template <typename T>
+    struct is_dumpable<doptional<T>> : is_dumpable<T> {};
+    template <typename... Ts>
+    struct is_dumpable<dvariant<Ts...>> : detail::all_true<is_dumpable<Ts>::value...> {};
+    // emptied while dumping
+    template <typename T>
+    struct is_dumpable<not_dump<T>> : std::true_type {};
+}
+
+// Declares a struct built only from dumpable members; use at global scope with the qualified name.
+#define DUMPABLE_STRUCT(T) \
+    namespace dumpable { template <> struct is_dumpable<T> : std::true_type {}; }
+
+// Rejects, at compile time, a member that would dangle after dumping (e.g. std::string without not_dump).
+#define DUMPABLE_ASSERT_MEMBER(T, member) \
+    static_assert(::dumpable::is_dumpable<decltype(T::member)>::value, \
+            #T "::" #member " is not dumpable; use a dumpable container or not_dump<>")
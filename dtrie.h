@@ -0,0 +1,192 @@
+// Copyright (c) 2014 ipkn.
+// Licensed under the MIT license.
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+#include "dvector.h"
+#include "dstring.h"
+#include "dbitset.h"
+
+namespace dumpable
+{
+    // Static string dictionary stored as a LOUDS trie: shared prefixes are stored once and the
+    // tree shape costs about 2 bits per node (plus one label byte and one terminal bit).
+    //
+    // louds_ lists, for the super root and then every node in breadth-first order, one 1 bit per child
+    // followed by a 0 bit. Node n (root = 0) is the n-th 1 bit, so
+    //   children of n start at select0(n) + 1, the child at bit p is rank(p),
+    //   the parent of n is rank0(select(n)) - 1.
+    // labels_[n-1] is the byte on the edge into node n; siblings are sorted.
+    // Keys are numbered 0..size()-1 by the rank of their node among terminal nodes (breadth-first, not sorted).
+    class dtrie
+    {
+        public:
+            typedef dumpable::size_t size_type;
+            static const size_type npos = (size_type)-1;
+
+            dtrie() {}
+
+            // Duplicates are ignored; the input does not need to be sorted.
+            template <typename Iter>
+            dtrie(Iter first, Iter last)
+            {
+                std::vector<std::string> keys;
+                for(; first != last; ++first)
+                    keys.push_back(std::string(first->c_str(), first->size()));
+                build(keys);
+            }
+            explicit dtrie(std::vector<std::string> keys)
+            {
+                build(keys);
+            }
+
+            size_type size() const { return terminal_.count(); }
+            bool empty() const { return !size(); }
+            size_type node_count() const { return terminal_.size(); }
+
+            // id of key, or npos
+            size_type find(const char* key, size_type length) const
+            {
+                size_type node = walk(key, length);
+                if (node == npos || !terminal_.test(node))
+                    return npos;
+                return terminal_.rank(node);
+            }
+            size_type find(const char* key) const { return find(key, std::strlen(key)); }
+            size_type find(const std::string& key) const { return find(key.c_str(), key.size()); }
+            size_type find(const dstring& key) const { return find(key.c_str(), key.size()); }
+
+            bool contains(const char* key) const { return find(key) != npos; }
+            bool contains(const std::string& key) const { return find(key) != npos; }
+
+            // the key numbered id; throws std::out_of_range unless id < size()
+            std::string key(size_type id) const
+            {
+                if (id >= size())
+                    throw std::out_of_range("dumpable::dtrie: no such key id");
+                std::string ret;
+                for(size_type node = terminal_.select(id); node; node = parent(node))
+                    ret += (char)labels_[node-1];
+                std::reverse(ret.begin(), ret.end());
+                return ret;
+            }
+
+            // Calls f(key, id) for every key starting with prefix, in sorted order; returns how many.
+            template <typename F>
+            size_type enumerate_prefix(const std::string& prefix, F f) const
+            {
+                size_type start = walk(prefix.c_str(), prefix.size());
+                if (start == npos)
+                    return 0;
+                size_type found = 0;
+                std::string key = prefix;
+                // (node, depth) pairs; children pushed in reverse so they pop in label order
+                std::vector<std::pair<size_type, size_type>> stack(1, std::make_pair(start, prefix.size()));
+                while(!stack.empty())
+                {
+                    size_type node = stack.back().first;
+                    key.resize(stack.back().second);
+                    stack.pop_back();
+                    if (node != start)
+                        key += (char)labels_[node-1];
+                    if (terminal_.test(node))
+                    {
+                        f(key, terminal_.rank(node));
+                        found ++;
+                    }
+                    size_type first, last;
+                    children(node, first, last);
+                    for(size_type c = last; c > first; c --)
+                        stack.push_back(std::make_pair(c - 1, key.size()));
+                }
+                return found;
+            }
+
+        private:
+            // children of node are the nodes [first, last)
+            void children(size_type node, size_type& first, size_type& last) const
+            {
+                size_type pos = louds_.select0(node) + 1;
+                size_type end = louds_.select0(node + 1);
+                first = louds_.rank(pos);
+                last = first + (end - pos);
+            }
+
+            size_type parent(size_type node) const
+            {
+                return louds_.rank0(louds_.select(node)) - 1;
+            }
+
+            size_type walk(const char* key, size_type length) const
+            {
+                if (terminal_.empty())
+                    return npos;
+                size_type node = 0;
+                for(size_type i = 0; i < length; i ++)
+                {
+                    size_type first, last;
+                    children(node, first, last);
+                    const unsigned char* begin = labels_.data() + first - 1;
+                    const unsigned char* end = labels_.data() + last - 1;
+                    const unsigned char* it = std::lower_bound(begin, end, (unsigned char)key[i]);
+                    if (it == end || *it != (unsigned char)key[i])
+                        return npos;
+                    node = first + (it - begin);
+                }
+                return node;
+            }
+
+            void build(std::vector<std::string>& keys)
+            {
+                std::sort(keys.begin(), keys.end());
+                keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+
+                std::vector<bool> louds(1, true);
+                louds.push_back(false);
+                std::vector<bool> terminal;
+                std::vector<unsigned char> labels;
+
+                // every node is a run [lo, hi) of keys sharing their first depth bytes
+                struct range { size_type lo, hi, depth; };
+                std::deque<range> queue;
+                range root = {0, (size_type)keys.size(), 0};
+                queue.push_back(root);
+                while(!queue.empty())
+                {
+                    range r = queue.front();
+                    queue.pop_front();
+                    bool ends = r.lo < r.hi && keys[r.lo].size() == r.depth;
+                    terminal.push_back(ends);
+                    if (ends)
+                        r.lo ++;
+                    while(r.lo < r.hi)
+                    {
+                        unsigned char c = keys[r.lo][r.depth];
+                        size_type hi = r.lo + 1;
+                        while(hi < r.hi && (unsigned char)keys[hi][r.depth] == c)
+                            hi ++;
+                        louds.push_back(true);
+                        labels.push_back(c);
+                        range child = {r.lo, hi, r.depth + 1};
+                        queue.push_back(child);
+                        r.lo = hi;
+                    }
+                    louds.push_back(false);
+                }
+
+                louds_ = dbitset(louds);
+                terminal_ = dbitset(terminal);
+                labels_ = labels;
+            }
+
+            dbitset louds_;
+            dbitset terminal_;
+            dvector<unsigned char> labels_;
+    };
+}
@@ -12,7 +12,30 @@
 #include "dvector.h"
 #include "dstring.h"
 #include "dmap.h"
+#include "dbitset.h"
+#include "dsoa.h"
+#include "dpacked.h"
+#include "dtrie.h"
+#include "dgraph.h"
+#include "dversioned.h"
+#include "doptional.h"
+#include "dvariant.h"
 #include "dutility.h"
+#include "darena.h"
+#include "dimage.h"
+#include "deditor.h"
+#include "ddiff.h"
+#include "dcompress.h"
+#include "drecord.h"
+#include "dnuma.h"
+#include "dbuilder.h"
+#include "dtraits.h"
+#include "dfile.h"
+#include "dasync.h"
+#include "dsegment.h"
+#include "dchecksum.h"
+#include "dframe.h"
+#include "dconvert.h"
 
 namespace dumpable
 {
@@ -28,17 +51,33 @@ namespace dumpable
         return (T*)buffer;
     }
 
+    namespace detail
+    {
+        // no pointers inside: the object is its own image
+        template <typename T>
+        void write_image(const T& data, std::ostream& os, std::true_type)
+        {
+            os.write((const char*)&data, sizeof(T));
+        }
+
+        template <typename T>
+        void write_image(const T& data, std::ostream& os, std::false_type)
+        {
+            T x;
+            dpool local_pool(&x, sizeof(T));
+            dumpable::detail::dptr_alloc() = [&local_pool](void* self, dumpable::size_t size)->std::pair<void*, dumpable::ptrdiff_t>{
+                    return local_pool.alloc(self, size);
+                };
+            x = data;
+            os.write((const char*)&x, sizeof(x));
+            local_pool.write(os);
+            dumpable::detail::dptr_alloc() = nullptr;
+        }
+    }
+
     template <typename T>
     void write(const T& data, std::ostream& os)
     {
-        T x;
-        dpool local_pool(&x, sizeof(T));
-        dumpable::detail::dptr_alloc() = [&local_pool](void* self, dumpable::size_t size)->std::pair<void*, dumpable::ptrdiff_t>{
-                return local_pool.alloc(self, size);
-            };
-        x = data;
-        os.write((const char*)&x, sizeof(x));
-        local_pool.write(os);
-        dumpable::detail::dptr_alloc() = nullptr;
+        detail::write_image(data, os, is_trivially_dumpable<T>());
     }
 }
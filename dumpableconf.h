@@ -9,6 +9,16 @@
 
 #define DUMPABLE_ALIGNED_POOL
 
+// mmap/mprotect/signals are available; features built on them fall back or are left out otherwise.
+#if defined(__unix__) || defined(__APPLE__)
+#define DUMPABLE_POSIX
+#endif
+
+// NUMA placement through the Linux mbind syscall (no libnuma needed).
+#if defined(DUMPABLE_POSIX) && defined(__linux__)
+#define DUMPABLE_NUMA
+#endif
+
 #if defined(_MSC_VER) && !defined(noexcept)
 #define noexcept throw()
 #endif
@@ -0,0 +1,89 @@
+// Copyright (c) 2014 ipkn.
+// Licensed under the MIT license.
+
+// dumpconv <schema> <root struct> <from layout> <to layout> <input image> <output image>
+//
+// Layouts: 64, 32, compat, or <word size>:<alignment of 64-bit members> such as 4:8.
+
+#include <fstream>
+#include <sstream>
+#include <iostream>
+#include <string>
+#include <cstdlib>
+
+#include "dumpable.h"
+
+using namespace std;
+
+static bool read_file(const char* path, string& out)
+{
+    ifstream in(path, ios::binary);
+    if (!in)
+        return false;
+    ostringstream ss;
+    ss << in.rdbuf();
+    out = ss.str();
+    return true;
+}
+
+static bool parse_layout(const string& name, dumpable::abi_layout& layout)
+{
+    if (name == "64")
+        layout = dumpable::abi_layout::native64();
+    else if (name == "32")
+        layout = dumpable::abi_layout::native32();
+    else if (name == "compat")
+        layout = dumpable::abi_layout::compatible();
+    else
+    {
+        size_t colon = name.find(':');
+        if (colon == string::npos)
+            return false;
+        layout.word_size = (unsigned)atoi(name.substr(0, colon).c_str());
+        layout.int64_align = (unsigned)atoi(name.substr(colon + 1).c_str());
+    }
+    return true;
+}
+
+static int usage()
+{
+    cerr << "usage: dumpconv <schema> <root struct> <from layout> <to layout> <input image> <output image>" << endl;
+    cerr << "       layouts: 64, 32, compat, or <word size>:<alignment of 64-bit members>" << endl;
+    return 2;
+}
+
+int main(int argc, char* argv[])
+{
+    if (argc != 7)
+        return usage();
+    dumpable::abi_layout from, to;
+    if (!parse_layout(argv[3], from) || !parse_layout(argv[4], to))
+        return usage();
+    string schemaText, image;
+    if (!read_file(argv[1], schemaText) || !read_file(argv[5], image))
+    {
+        cerr << "dumpconv: cannot read input" << endl;
+        return 1;
+    }
+    // converted in memory first, so a failed conversion leaves the output alone
+    ostringstream converted;
+    try
+    {
+        dumpable::layout_schema schema(schemaText);
+        dumpable::convert_layout(image.data(), image.size(), schema, argv[2], from, to, converted);
+    }
+    catch(std::exception& e)
+    {
+        cerr << "dumpconv: " << e.what() << endl;
+        return 1;
+    }
+    string result = converted.str();
+    ofstream out(argv[6], ios::binary);
+    out.write(result.data(), result.size());
+    if (!out)
+    {
+        cerr << "dumpconv: cannot write " << argv[6] << endl;
+        return 1;
+    }
+    return 0;
+}
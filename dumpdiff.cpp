@@ -0,0 +1,78 @@
+// Copyright (c) 2014 ipkn.
+// Licensed under the MIT license.
+
+// dumpdiff diff <old image> <new image> <patch>
+// dumpdiff apply <old image> <patch> <new image>
+
+#include <fstream>
+#include <sstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "dumpable.h"
+
+using namespace std;
+
+static bool read_file(const char* path, string& out)
+{
+    ifstream in(path, ios::binary);
+    if (!in)
+        return false;
+    ostringstream ss;
+    ss << in.rdbuf();
+    out = ss.str();
+    return true;
+}
+
+static int usage()
+{
+    cerr << "usage: dumpdiff diff <old image> <new image> <patch>" << endl;
+    cerr << "       dumpdiff apply <old image> <patch> <new image>" << endl;
+    return 2;
+}
+
+int main(int argc, char* argv[])
+{
+    if (argc != 5)
+        return usage();
+    string command = argv[1];
+    if (command != "diff" && command != "apply")
+        return usage();
+    string a, b;
+    if (!read_file(argv[2], a) || !read_file(argv[3], b))
+    {
+        cerr << "dumpdiff: cannot read input" << endl;
+        return 1;
+    }
+    // the output is only opened once there is something to write, so a failure leaves it alone
+    string result;
+    try
+    {
+        if (command == "diff")
+        {
+            ostringstream patch;
+            dumpable::diff(a.data(), a.size(), b.data(), b.size(), patch);
+            result = patch.str();
+        }
+        else
+        {
+            vector<char> image;
+            dumpable::apply_patch(a.data(), a.size(), b.data(), b.size(), image);
+            result.assign(image.begin(), image.end());
+        }
+    }
+    catch(std::exception& e)
+    {
+        cerr << "dumpdiff: " << e.what() << endl;
+        return 1;
+    }
+    ofstream out(argv[4], ios::binary);
+    out.write(result.data(), result.size());
+    if (!out)
+    {
+        cerr << "dumpdiff: cannot write " << argv[4] << endl;
+        return 1;
+    }
+    return 0;
+}
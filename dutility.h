@@ -1,10 +1,27 @@
 #pragma once
 
 #include <memory>
+#include <cstdint>
 #include "dptr.h"
 
 namespace dumpable
 {
+    namespace detail
+    {
+        // 64-bit FNV-1a; stable across processes and platforms, so it can be stored in images.
+        inline std::uint64_t hash_bytes(const void* data, std::size_t size, std::uint64_t seed = 14695981039346656037ULL)
+        {
+            const unsigned char* p = (const unsigned char*)data;
+            std::uint64_t h = seed;
+            for(std::size_t i = 0; i < size; i ++)
+            {
+                h ^= p[i];
+                h *= 1099511628211ULL;
+            }
+            return h;
+        }
+    }
+
     template <typename T>
     struct not_dump : public T
     {
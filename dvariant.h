@@ -0,0 +1,206 @@
+// Copyright (c) 2014 ipkn.
+// Licensed under the MIT license.
+
+#pragma once
+
+#include <new>
+#include <utility>
+#include <tuple>
+#include <cstdint>
+#include <stdexcept>
+#include <type_traits>
+#include "dumpableconf.h"
+
+namespace dumpable
+{
+    namespace detail
+    {
+        template <std::size_t... Ns>
+        struct max_of;
+        template <std::size_t N>
+        struct max_of<N> : std::integral_constant<std::size_t, N> {};
+        template <std::size_t N, std::size_t... Ns>
+        struct max_of<N, Ns...> : std::integral_constant<std::size_t, (N > max_of<Ns...>::value ? N : max_of<Ns...>::value)> {};
+
+        // position of T in Ts, or sizeof...(Ts) when absent
+        template <typename T, typename... Ts>
+        struct type_index;
+        template <typename T>
+        struct type_index<T> : std::integral_constant<std::size_t, 0> {};
+        template <typename T, typename... Ts>
+        struct type_index<T, T, Ts...> : std::integral_constant<std::size_t, 0> {};
+        template <typename T, typename U, typename... Ts>
+        struct type_index<T, U, Ts...> : std::integral_constant<std::size_t, 1 + type_index<T, Ts...>::value> {};
+    }
+
+    // A tagged union stored inline: the largest alternative plus a 32-bit index.
+    //
+    // It always holds one of Ts (the first one when default-constructed). Like doptional, a new
+    // alternative is default-constructed in place and then assigned, so its dstring/dvector members
+    // go to the pool while dumping. get/get_if compare the index only; visit calls through a
+    // table indexed by it.
+    template <typename... Ts>
+    class dvariant
+    {
+        static_assert(sizeof...(Ts) > 0, "dvariant needs at least one alternative");
+
+        template <typename T>
+        struct index_of : detail::type_index<typename std::decay<T>::type, Ts...>
+        {
+            static_assert(detail::type_index<typename std::decay<T>::type, Ts...>::value < sizeof...(Ts), "not an alternative of this dvariant");
+        };
+
+        public:
+            dvariant() : index_(0)
+            {
+                construct<typename std::tuple_element<0, std::tuple<Ts...>>::type>();
+            }
+            template <typename T, typename = typename std::enable_if<
+                (detail::type_index<typename std::decay<T>::type, Ts...>::value < sizeof...(Ts))>::type>
+            dvariant(T&& value)
+                : index_(0)
+            {
+                construct<typename std::tuple_element<0, std::tuple<Ts...>>::type>();
+                *this = std::forward<T>(value);
+            }
+            dvariant(const dvariant& v)
+                : index_(0)
+            {
+                construct<typename std::tuple_element<0, std::tuple<Ts...>>::type>();
+                *this = v;
+            }
+            dvariant(dvariant&& v)
+                : index_(0)
+            {
+                construct<typename std::tuple_element<0, std::tuple<Ts...>>::type>();
+                *this = std::move(v);
+            }
+            ~dvariant()
+            {
+                destroy();
+            }
+
+            template <typename T, typename = typename std::enable_if<
+                (detail::type_index<typename std::decay<T>::type, Ts...>::value < sizeof...(Ts))>::type>
+            dvariant& operator = (T&& value)
+            {
+                typedef typename std::decay<T>::type U;
+                emplace<U>() = std::forward<T>(value);
+                return *this;
+            }
+            dvariant& operator = (const dvariant& v)
+            {
+                if (&v != this)
+                {
+                    static void (* const copy[])(dvariant&, const dvariant&) = { &copy_from<Ts>... };
+                    copy[v.index_](*this, v);
+                }
+                return *this;
+            }
+            dvariant& operator = (dvariant&& v)
+            {
+                if (&v != this)
+                {
+                    static void (* const move[])(dvariant&, dvariant&) = { &move_from<Ts>... };
+                    move[v.index_](*this, v);
+                }
+                return *this;
+            }
+
+            // Switches to a default-constructed T unless T is already held. If T() throws,
+            // the variant holds a default-constructed first alternative, whose constructor must not throw.
+            template <typename T>
+            T& emplace()
+            {
+                if (index_ != index_of<T>::value)
+                {
+                    destroy();
+                    try
+                    {
+                        construct<T>();
+                    }
+                    catch(...)
+                    {
+                        construct<typename std::tuple_element<0, std::tuple<Ts...>>::type>();
+                        throw;
+                    }
+                }
+                return *(T*)&storage_;
+            }
+
+            std::size_t index() const { return index_; }
+            template <typename T>
+            bool holds() const { return index_ == index_of<T>::value; }
+
+            template <typename T>
+            const T* get_if() const
+            {
+                return holds<T>() ? (const T*)&storage_ : nullptr;
+            }
+            template <typename T>
+            T* get_if()
+            {
+                return holds<T>() ? (T*)&storage_ : nullptr;
+            }
+            template <typename T>
+            const T& get() const
+            {
+                if (!holds<T>())
+                    throw std::invalid_argument("dumpable::dvariant: another alternative is held");
+                return *(const T*)&storage_;
+            }
+            template <typename T>
+            T& get()
+            {
+                if (!holds<T>())
+                    throw std::invalid_argument("dumpable::dvariant: another alternative is held");
+                return *(T*)&storage_;
+            }
+
+            // Calls f with the held alternative; every overload must return the same type.
+            template <typename F>
+            auto visit(F&& f) const -> decltype(f(std::declval<const typename std::tuple_element<0, std::tuple<Ts...>>::type&>()))
+            {
+                typedef decltype(f(std::declval<const typename std::tuple_element<0, std::tuple<Ts...>>::type&>())) result_type;
+                static result_type (* const call[])(F&, const void*) = { &invoke<result_type, F, Ts>... };
+                return call[index_](f, &storage_);
+            }
+
+        private:
+            template <typename T>
+            void construct()
+            {
+                new (&storage_) T();
+                index_ = (std::uint32_t)index_of<T>::value;
+            }
+            void destroy()
+            {
+                static void (* const destroy[])(void*) = { &destroy_as<Ts>... };
+                destroy[index_](&storage_);
+            }
+
+            template <typename T>
+            static void destroy_as(void* p)
+            {
+                ((T*)p)->~T();
+            }
+            template <typename T>
+            static void copy_from(dvariant& self, const dvariant& v)
+            {
+                self.emplace<T>() = *(const T*)&v.storage_;
+            }
+            template <typename T>
+            static void move_from(dvariant& self, dvariant& v)
+            {
+                self.emplace<T>() = std::move(*(T*)&v.storage_);
+            }
+            template <typename R, typename F, typename T>
+            static R invoke(F& f, const void* p)
+            {
+                return f(*(const T*)p);
+            }
+
+            typename std::aligned_storage<detail::max_of<sizeof(Ts)...>::value, detail::max_of<alignof(Ts)...>::value>::type storage_;
+            std::uint32_t index_;
+    };
+}
@@ -6,6 +6,9 @@
 #include "dptr.h"
 #include <vector>
 #include <cassert>
+#include <type_traits>
+#include <iterator>
+#include <algorithm>
 
 namespace dumpable
 {
@@ -42,6 +45,10 @@ namespace dumpable
                 return 8;
             return n;
         }
+
+        // fails substitution for anything without an iterator category, such as dvector<int>(5, 3)
+        template <typename Iter>
+        using iterator_category_of = typename std::iterator_traits<Iter>::iterator_category;
     }
     template <typename T>
     class dvector : protected dptr<T>
@@ -62,32 +69,91 @@ namespace dumpable
                 }
                 if (dumpable::detail::dptr_alloc())
                 {
-                    isPooled_ = true;
+                    isPooled_ = detail::storage_pool;
                     size_ = size;
-                    void* buf = dptr<T>::alloc_internal(size * sizeof(T));
-                    std::copy(begin, begin+size, (T*)buf);
+                    copy_to_pool(begin, size, std::is_trivially_copyable<T>());
                 }
                 else
                 {
-                    isPooled_ = false;
                     size_ = size;
                     size_type capacity = detail::find_power_of_2_greater_than(size);
-                    dptr<T>::operator =(new T[capacity]);
+                    dptr<T>::operator =(detail::new_array<T>(capacity, isPooled_));
                     std::copy(begin, begin+size, (T*)*this);
                 }
             }
 
+            // plain bytes may share storage with an identical payload; anything else is assigned element-wise
+            void copy_to_pool(const T* begin, size_type size, std::true_type)
+            {
+                dptr<T>::commit_internal(dptr<T>::alloc_shared_internal(begin, size * sizeof(T)));
+            }
+            void copy_to_pool(const T* begin, size_type size, std::false_type)
+            {
+                void* buf = dptr<T>::alloc_internal(size * sizeof(T));
+                std::copy(begin, begin+size, (T*)buf);
+                dptr<T>::commit_internal(buf);
+            }
+
+            template <typename Iter>
+            void assign_range(Iter first, Iter last, std::input_iterator_tag)
+            {
+                std::vector<T> v(first, last);
+                assign(v.data(), v.size());
+            }
+            template <typename Iter>
+            void assign_range(Iter first, Iter last, std::forward_iterator_tag)
+            {
+                size_type size = (size_type)std::distance(first, last);
+                if (!size)
+                    return;
+                T* buffer;
+                if (dumpable::detail::dptr_alloc())
+                {
+                    isPooled_ = detail::storage_pool;
+                    buffer = (T*)dptr<T>::alloc_internal(size * sizeof(T));
+                }
+                else
+                {
+                    buffer = detail::new_array<T>(detail::find_power_of_2_greater_than(size), isPooled_);
+                    dptr<T>::operator =(buffer);
+                }
+                size_ = size;
+                std::copy(first, last, buffer);
+                if (isPooled_ == detail::storage_pool)
+                    dptr<T>::commit_internal(buffer);
+            }
+
             void uninitialized_resize(size_type newSize)
             {
-                assert(!dumpable::detail::dptr_alloc());
+                assert(!dumpable::detail::dptr_alloc() || dumpable::detail::dptr_editing());
                 size_type oldCapacity = detail::find_power_of_2_greater_than(size());
-                if (isPooled_)
+                if (isPooled_ == detail::storage_pool)
                     oldCapacity = size_;
 
                 size_type newCapacity = detail::find_power_of_2_greater_than(newSize);
+                if (dumpable::detail::dptr_editing())
+                {
+                    // Editing a loaded image: grow into the pool and leave the old storage behind unused.
+                    if (newSize > oldCapacity)
+                    {
+                        T* oldBuffer = (T*)*this;
+                        T* newBuffer = (T*)dptr<T>::alloc_internal(newCapacity * sizeof(T));
+                        for(size_type i = 0; i < size_; i ++)
+                        {
+                            new (newBuffer+i) T(std::move(*(oldBuffer+i)));
+                            (oldBuffer+i)->~T();
+                        }
+                        if (isPooled_ == detail::storage_heap && oldBuffer)
+                            delete[](oldBuffer);
+                        isPooled_ = detail::storage_pool_growable;
+                    }
+                    size_ = newSize;
+                    return;
+                }
                 if (oldCapacity != newCapacity)
                 {
-                    T* newBuffer = newCapacity ? new T[newCapacity] : nullptr;
+                    char kind = detail::storage_heap;
+                    T* newBuffer = newCapacity ? detail::new_array<T>(newCapacity, kind) : nullptr;
                     T* oldBuffer = (T*)*this;
                     for(size_type i = 0; i < std::min(size_, newCapacity); i ++)
                     {
@@ -97,12 +163,12 @@ namespace dumpable
                     if (!isPooled_)
                         delete[](oldBuffer);
                     dptr<T>::operator =(newBuffer);
-                    isPooled_ = false;
+                    isPooled_ = kind;
                 }
                 size_ = newSize;
             }
         public:
-            dvector() : size_(0), isPooled_(false) {}
+            dvector() : size_(0), isPooled_(detail::storage_heap) {}
             dvector(const std::vector<T>& v)
             { 
                 assign(v.data(), v.size());
@@ -113,10 +179,16 @@ namespace dumpable
                 assign(v.data(), v.size());
             }
 
-            template <typename Iter>
+            template <typename Iter, typename = detail::iterator_category_of<Iter>>
             dvector(Iter first, Iter last)
+                : size_(0), isPooled_(detail::storage_heap)
             {
-                std::vector<T> v(first, last);
+                assign(first, last);
+            }
+            dvector(size_type count, const T& value)
+                : size_(0), isPooled_(detail::storage_heap)
+            {
+                std::vector<T> v(count, value);
                 assign(v.data(), v.size());
             }
 
@@ -124,7 +196,7 @@ namespace dumpable
                 : dptr<T>(std::move(v)), size_(v.size_), isPooled_(v.isPooled_)
             {
                 v.size_ = 0;
-                v.isPooled_ = false;
+                v.isPooled_ = detail::storage_heap;
             }
 
             ~dvector()
@@ -141,7 +213,7 @@ namespace dumpable
                 }
                 dptr<T>::operator =(nullptr);
                 size_ = 0;
-                isPooled_ = false;
+                isPooled_ = detail::storage_heap;
             }
 
             typedef T* iterator;
@@ -196,6 +268,14 @@ namespace dumpable
                 new (buffer+size_-1) T(std::move(value));
             }
 
+            // Replaces the contents, copying forward ranges straight into the new storage.
+            template <typename Iter, typename = detail::iterator_category_of<Iter>>
+            void assign(Iter first, Iter last)
+            {
+                clear();
+                assign_range(first, last, typename std::iterator_traits<Iter>::iterator_category());
+            }
+
             dvector<T>& operator = (const std::vector<T>& v)
             {
                 clear();
@@ -215,13 +295,14 @@ namespace dumpable
             {
                 if (this == &v)
                     return *this;
+                clear();
                 size_ = v.size_;
                 isPooled_ = v.isPooled_;
 
                 dptr<T>::operator =(std::move(v));
 
                 v.size_ = 0;
-                v.isPooled_ = false;
+                v.isPooled_ = detail::storage_heap;
 
                 return *this;
             }
@@ -0,0 +1,219 @@
+// Copyright (c) 2014 ipkn.
+// Licensed under the MIT license.
+
+#pragma once
+
+#include <vector>
+#include <cstdint>
+#include <stdexcept>
+#include <type_traits>
+#include "dumpableconf.h"
+#include "dvector.h"
+
+namespace dumpable
+{
+    namespace detail
+    {
+        // offsetof for a member pointer; T is never constructed
+        template <typename T, typename M>
+        inline dumpable::size_t member_offset(M T::*member)
+        {
+            static typename std::aligned_storage<sizeof(T), alignof(T)>::type probe;
+            return (dumpable::size_t)((const char*)&(((const T*)&probe)->*member) - (const char*)&probe);
+        }
+    }
+
+    // A struct that may gain fields over time, stored out of line together with its size and version at dump time.
+    //
+    // New fields must only be appended, and T must declare its version, raised whenever fields are added:
+    //     struct player { int id; dstring name; double score; enum { version = 2 }; };
+    // Lookups name the version that added the field: get(2, &player::score) returns a default on an
+    // image written by version 1. The size alone cannot tell, since an appended field may occupy
+    // what used to be the tail padding of the old struct. operator-> is unchecked and is for fields
+    // every version has. dversioned<T> has the same size for every T, so it can sit inside other dumped structs.
+    template <typename T>
+    class dversioned
+    {
+        public:
+            typedef T value_type;
+            typedef dumpable::size_t size_type;
+
+            dversioned() : size_(0), version_(0) {}
+            dversioned(const T& value)
+                : size_(0), version_(0)
+            {
+                *this = value;
+            }
+            dversioned(const dversioned<T>& v)
+                : size_(0), version_(0)
+            {
+                *this = v;
+            }
+
+            dversioned<T>& operator = (const T& value)
+            {
+                value_.assign(&value, &value + 1);
+                size_ = sizeof(T);
+                version_ = T::version;
+                return *this;
+            }
+            dversioned<T>& operator = (const dversioned<T>& v)
+            {
+                if (&v == this)
+                    return *this;
+                if (v.empty())
+                {
+                    value_.clear();
+                    size_ = 0;
+                    version_ = 0;
+                    return *this;
+                }
+                // newer values are cut down to T; older ones lack fields T would copy
+                if (v.version_ < (std::uint32_t)T::version || v.size_ < sizeof(T))
+                    throw std::invalid_argument("dumpable::dversioned: cannot copy a value written by an older version");
+                return *this = *v;
+            }
+
+            bool empty() const { return !size_; }
+            // sizeof(T) and T::version of the writer; 0 when empty
+            size_type stored_size() const { return size_; }
+            std::uint32_t stored_version() const { return version_; }
+
+            const T& operator* () const { return *value_.data(); }
+            const T* operator-> () const { return value_.data(); }
+
+            // whether the field added in version since is present
+            template <typename M>
+            bool has(std::uint32_t since, M T::*member) const
+            {
+                return find(since, member) != nullptr;
+            }
+            // the field, or nullptr when the image predates it
+            template <typename M>
+            const M* find(std::uint32_t since, M T::*member) const
+            {
+                size_type offset = detail::member_offset(member);
+                if (version_ < since || offset + sizeof(M) > size_)
+                    return nullptr;
+                return (const M*)((const char*)value_.data() + offset);
+            }
+            // by value, so a temporary fallback cannot dangle
+            template <typename M>
+            M get(std::uint32_t since, M T::*member, const M& fallback) const
+            {
+                const M* p = find(since, member);
+                return p ? *p : fallback;
+            }
+            // a default-constructed M when the image predates the field
+            template <typename M>
+            const M& get(std::uint32_t since, M T::*member) const
+            {
+                static const M fallback = M();
+                const M* p = find(since, member);
+                return p ? *p : fallback;
+            }
+
+        private:
+            dvector<T> value_;
+            size_type size_;
+            std::uint32_t version_;
+    };
+
+    // Array of structs that may gain appended fields, stored with the element size and version at dump time.
+    // Elements are found by that stride, so older images stay readable; see dversioned.
+    template <typename T>
+    class dversioned_vector
+    {
+        public:
+            typedef T value_type;
+            typedef dumpable::size_t size_type;
+
+            dversioned_vector() : stride_(sizeof(T)), version_(T::version) {}
+            dversioned_vector(const std::vector<T>& v)
+                : items_(v), stride_(sizeof(T)), version_(T::version)
+            {
+            }
+            dversioned_vector(const dversioned_vector<T>& v)
+                : stride_(sizeof(T)), version_(T::version)
+            {
+                *this = v;
+            }
+
+            dversioned_vector<T>& operator = (const std::vector<T>& v)
+            {
+                items_ = v;
+                stride_ = sizeof(T);
+                version_ = T::version;
+                return *this;
+            }
+            dversioned_vector<T>& operator = (const dversioned_vector<T>& v)
+            {
+                if (&v == this)
+                    return *this;
+                if ((v.stride_ != sizeof(T) || v.version_ != (std::uint32_t)T::version) && !v.empty())
+                    throw std::invalid_argument("dumpable::dversioned_vector: cannot copy elements written by another version");
+                items_ = v.items_;
+                stride_ = sizeof(T);
+                version_ = T::version;
+                return *this;
+            }
+
+            void push_back(const T& value)
+            {
+                if ((stride_ != sizeof(T) || version_ != (std::uint32_t)T::version) && !empty())
+                    throw std::invalid_argument("dumpable::dversioned_vector: cannot append to elements written by another version");
+                items_.push_back(value);
+                stride_ = sizeof(T);
+                version_ = T::version;
+            }
+            void clear()
+            {
+                items_.clear();
+                stride_ = sizeof(T);
+                version_ = T::version;
+            }
+
+            size_type size() const { return items_.size(); }
+            bool empty() const { return items_.empty(); }
+            // sizeof(T) and T::version of the writer
+            size_type stride() const { return stride_; }
+            std::uint32_t stored_version() const { return version_; }
+
+            // unchecked; for fields every version has
+            const T& operator[](size_type i) const
+            {
+                return *(const T*)((const char*)items_.data() + i * stride_);
+            }
+
+            template <typename M>
+            bool has(std::uint32_t since, M T::*member) const
+            {
+                return version_ >= since && detail::member_offset(member) + sizeof(M) <= stride_;
+            }
+            template <typename M>
+            const M* find(size_type i, std::uint32_t since, M T::*member) const
+            {
+                if (!has(since, member))
+                    return nullptr;
+                return (const M*)((const char*)items_.data() + i * stride_ + detail::member_offset(member));
+            }
+            template <typename M>
+            M get(size_type i, std::uint32_t since, M T::*member, const M& fallback) const
+            {
+                const M* p = find(i, since, member);
+                return p ? *p : fallback;
+            }
+            template <typename M>
+            const M& get(size_type i, std::uint32_t since, M T::*member) const
+            {
+                static const M fallback = M();
+                const M* p = find(i, since, member);
+                return p ? *p : fallback;
+            }
+
+        private:
+            dvector<T> items_;
+            size_type stride_;
+            std::uint32_t version_;
+    };
+}
@@ -0,0 +1,139 @@
+// Copyright (c) 2014 ipkn.
+// Licensed under the MIT license.
+
+#pragma once
+
+#include "dumpableconf.h"
+
+#ifdef DUMPABLE_POSIX
+
+#include <atomic>
+#include <mutex>
+#include <cstdlib>
+#include <stdexcept>
+#include <csignal>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+namespace dumpable
+{
+    namespace detail
+    {
+        inline std::size_t page_size()
+        {
+            static std::size_t size = (std::size_t)sysconf(_SC_PAGESIZE);
+            return size;
+        }
+
+        inline std::size_t round_up_to_page(std::size_t size)
+        {
+            return (size + page_size() - 1) / page_size() * page_size();
+        }
+
+        // An address range kept PROT_NONE until first touched.
+        // on_fault runs inside the SIGSEGV/SIGBUS handler: it may only use async-signal-safe
+        // calls (mprotect, memcpy, atomics) and returns false if addr is not in the region.
+        // The kernel never raises the signal for its own accesses: a system call given an
+        // untouched part of the region fails with EFAULT, so owners offer a prefetch for that.
+        class lazy_region
+        {
+            public:
+                virtual bool on_fault(void* addr) = 0;
+            protected:
+                ~lazy_region() {}
+        };
+
+        const int max_lazy_regions = 64;
+
+        inline std::atomic<lazy_region*>* lazy_regions()
+        {
+            static std::atomic<lazy_region*> regions[max_lazy_regions];
+            return regions;
+        }
+
+        inline struct sigaction* previous_fault_actions()
+        {
+            // [0] SIGSEGV, [1] SIGBUS
+            static struct sigaction actions[2];
+            return actions;
+        }
+
+        inline void lazy_fault_handler(int sig, siginfo_t* info, void* context)
+        {
+            std::atomic<lazy_region*>* regions = lazy_regions();
+            for(int i = 0; i < max_lazy_regions; i ++)
+            {
+                lazy_region* r = regions[i].load();
+                if (r && r->on_fault(info->si_addr))
+                    return;
+            }
+            struct sigaction& previous = previous_fault_actions()[sig == SIGSEGV ? 0 : 1];
+            if (previous.sa_flags & SA_SIGINFO)
+                previous.sa_sigaction(sig, info, context);
+            else if (previous.sa_handler != SIG_DFL && previous.sa_handler != SIG_IGN)
+                previous.sa_handler(sig);
+            else
+            {
+                // not ours: let the access fault again with the default action
+                signal(sig, SIG_DFL);
+            }
+        }
+
+        inline void register_lazy_region(lazy_region* region)
+        {
+            static std::once_flag installed;
+            std::call_once(installed, []{
+                struct sigaction sa;
+                sa.sa_sigaction = lazy_fault_handler;
+                sigemptyset(&sa.sa_mask);
+                sa.sa_flags = SA_SIGINFO | SA_NODEFER;
+                sigaction(SIGSEGV, &sa, &previous_fault_actions()[0]);
+                sigaction(SIGBUS, &sa, &previous_fault_actions()[1]);
+            });
+            std::atomic<lazy_region*>* regions = lazy_regions();
+            for(int i = 0; i < max_lazy_regions; i ++)
+            {
+                lazy_region* expected = nullptr;
+                if (regions[i].compare_exchange_strong(expected, region))
+                    return;
+            }
+            throw std::length_error("dumpable: too many lazy regions");
+        }
+
+        inline void unregister_lazy_region(lazy_region* region)
+        {
+            std::atomic<lazy_region*>* regions = lazy_regions();
+            for(int i = 0; i < max_lazy_regions; i ++)
+            {
+                lazy_region* expected = region;
+                if (regions[i].compare_exchange_strong(expected, nullptr))
+                    return;
+            }
+        }
+
+        // Anonymous shared memory that can be mapped more than once; returns -1 on failure.
+        inline int shared_memory_fd(std::size_t size)
+        {
+            int fd;
+#if defined(__linux__) && defined(MFD_CLOEXEC)
+            fd = memfd_create("dumpable", MFD_CLOEXEC);
+#else
+            char path[] = "/tmp/dumpable.XXXXXX";
+            fd = mkstemp(path);
+            if (fd >= 0)
+                unlink(path);
+#endif
+            if (fd < 0)
+                return -1;
+            if (ftruncate(fd, (off_t)size) != 0)
+            {
+                close(fd);
+                return -1;
+            }
+            return fd;
+        }
+    }
+}
+
+#endif
@@ -3,9 +3,17 @@
 #include <string>
 #include <iostream>
 #include <functional>
+#include <thread>
+#include <atomic>
+#include <unordered_map>
+#include <cstring>
 
 #include "dumpable.h"
 
+#ifdef DUMPABLE_POSIX
+#include <sys/socket.h>
+#endif
+
 using namespace std;
 using namespace dumpable;
 
@@ -192,6 +200,9 @@ TEST(vector)
     ASSERT_EQUAL(false, v4.empty());
     v4.resize(0);
     ASSERT_EQUAL(true, v4.empty());
+    dvector<int> filled(5, 3);
+    ASSERT_EQUAL(5, filled.size());
+    ASSERT_EQUAL(3, filled[4]);
 
     ASSERT_EQUAL(3, v3.size());
     ASSERT_EQUAL(300, v3[1]);
@@ -453,6 +464,2013 @@ TEST(basic_implementation)
     ASSERT_EQUAL(3, e->c);
 }
 
+TEST(bitset)
+{
+    struct flags
+    {
+        int owner;
+        dbitset unlocked;
+    };
+
+    vector<bool> bits(1000);
+    for(int i = 0; i < 1000; i += 3)
+        bits[i] = true;
+
+    flags f;
+    f.owner = 7;
+    f.unlocked = dbitset(bits);
+    ASSERT_EQUAL(1000, f.unlocked.size());
+    ASSERT_EQUAL(334, f.unlocked.count());
+    ASSERT_EQUAL(true, f.unlocked.test(999));
+    ASSERT_EQUAL(false, f.unlocked.test(998));
+
+    f.unlocked.set(1);
+    ASSERT_EQUAL(false, f.unlocked.has_index());
+    ASSERT_EQUAL(335, f.unlocked.count());
+    ASSERT_EQUAL(3, f.unlocked.rank(4));
+    f.unlocked.reset(1);
+
+    ostringstream os;
+    dumpable::write(f, os);
+    f.unlocked = dbitset();
+
+    string buffer = os.str();
+    const flags* p = dumpable::from_dumped_buffer<flags>(buffer.data());
+    const dbitset& b = p->unlocked;
+    ASSERT_EQUAL(7, p->owner);
+    ASSERT_EQUAL(true, b.has_index());
+    ASSERT_EQUAL(334, b.count());
+    ASSERT_EQUAL(0, b.rank(0));
+    ASSERT_EQUAL(1, b.rank(1));
+    ASSERT_EQUAL(1, b.rank(3));
+    ASSERT_EQUAL(2, b.rank(4));
+    ASSERT_EQUAL(171, b.rank(512));
+    ASSERT_EQUAL(333, b.rank(999));
+    ASSERT_EQUAL(334, b.rank(1000));
+    ASSERT_EQUAL(0, b.select(0));
+    ASSERT_EQUAL(3, b.select(1));
+    ASSERT_EQUAL(513, b.select(171));
+    ASSERT_EQUAL(999, b.select(333));
+    ASSERT_EQUAL(1000, b.select(334));
+    for(dbitset::size_type i = 0; i < b.count(); i ++)
+        if (b.rank(b.select(i)) != i)
+            fail("rank(select(i)) != i");
+
+    dbitset odd(1000), low(200);
+    for(int i = 1; i < 1000; i += 2)
+        odd.set(i);
+    for(int i = 0; i < 200; i ++)
+        low.set(i);
+
+    dbitset both = b & odd;
+    ASSERT_EQUAL(167, both.count());
+    ASSERT_EQUAL(3, both.select(0));
+    dbitset either = b | odd;
+    ASSERT_EQUAL(667, either.count());
+    dbitset rest(b);
+    rest.and_not(low);
+    ASSERT_EQUAL(267, rest.count());
+    ASSERT_EQUAL(201, rest.select(0));
+    low |= odd;
+    ASSERT_EQUAL(200, low.size());
+    ASSERT_EQUAL(200, low.count());
+}
+
+TEST(soa)
+{
+    struct inventory
+    {
+        dsoa<int, double, dstring> items;
+    };
+
+    inventory inv;
+    for(int i = 0; i < 100; i ++)
+    {
+        ostringstream name;
+        name << "item" << i;
+        inv.items.push_back(i % 10, i * 0.5, name.str().c_str());
+    }
+    ASSERT_EQUAL(100, inv.items.size());
+    inv.items[3].get<1>() = 100.0;
+    ASSERT_EQUAL(100.0, inv.items.column<1>()[3]);
+
+    ostringstream os;
+    dumpable::write(inv, os);
+    inv.items.clear();
+    ASSERT_EQUAL(true, inv.items.empty());
+
+    string buffer = os.str();
+    const inventory* p = dumpable::from_dumped_buffer<inventory>(buffer.data());
+    const dsoa<int, double, dstring>& items = p->items;
+
+    ASSERT_EQUAL(100, items.size());
+    ASSERT_EQUAL(7, items[57].get<0>());
+    ASSERT_EQUAL(28.5, items[57].get<1>());
+    ASSERT_EQUAL("item57", items[57].get<2>());
+    ASSERT_EQUAL(450, column_sum<int>(items.column<0>()));
+    ASSERT_EQUAL(2475.0 - 1.5 + 100.0, column_sum<double>(items.column<1>()));
+
+    vector<dumpable::size_t> selected;
+    column_filter(items.column<0>(), [](int level){ return level == 3; }, selected);
+    ASSERT_EQUAL(10, selected.size());
+    ASSERT_EQUAL(93, selected.back());
+    column_refine(items.column<1>(), [](double price){ return price > 20; }, selected);
+    ASSERT_EQUAL(7, selected.size());
+    ASSERT_EQUAL(3, selected.front());
+    ASSERT_EQUAL("item3", items[3].get<2>());
+}
+
+TEST(packed_vector)
+{
+    struct posting
+    {
+        dpacked_vector<std::uint32_t> ids;
+        dpacked_vector<std::uint64_t> scores;
+    };
+
+    vector<std::uint32_t> ids, other;
+    vector<std::uint64_t> scores;
+    std::uint32_t id = 1000;
+    for(int i = 0; i < 1000; i ++)
+    {
+        id += 1 + (i * 7) % 13;
+        ids.push_back(id);
+        scores.push_back((i * 2654435761ULL) % 5000 + (i == 500 ? (1ULL << 63) : 0));
+        if (i % 3 == 0)
+            other.push_back(id);
+        other.push_back(id + 1);
+    }
+
+    posting p;
+    p.ids = ids;
+    p.scores = scores;
+    ASSERT_EQUAL(true, p.ids.is_sorted());
+    ASSERT_EQUAL(false, p.scores.is_sorted());
+    ASSERT_EQUAL(true, (p.ids.packed_bytes() < ids.size() * sizeof(std::uint32_t) / 3));
+
+    ostringstream os;
+    dumpable::write(p, os);
+    p.ids = dpacked_vector<std::uint32_t>();
+
+    string buffer = os.str();
+    const posting* q = dumpable::from_dumped_buffer<posting>(buffer.data());
+    ASSERT_EQUAL(1000, q->ids.size());
+    ASSERT_EQUAL(8, q->ids.block_count());
+    ASSERT_EQUAL(ids[0], q->ids.block_first(0));
+    ASSERT_EQUAL(ids[128], q->ids.block_first(1));
+    bool same = true;
+    for(size_t i = 0; i < ids.size(); i ++)
+        same = same && q->ids[i] == ids[i] && q->scores[i] == scores[i];
+    ASSERT_EQUAL(true, same);
+
+    vector<std::uint32_t> decoded;
+    q->ids.decode(decoded);
+    ASSERT_EQUAL(true, (decoded == ids));
+    vector<std::uint64_t> decodedScores;
+    q->scores.decode(decodedScores);
+    ASSERT_EQUAL(true, (decodedScores == scores));
+
+    ASSERT_EQUAL(0, q->ids.lower_bound(0));
+    ASSERT_EQUAL(300, q->ids.lower_bound(ids[300]));
+    ASSERT_EQUAL(301, q->ids.lower_bound(ids[300] + 1));
+    ASSERT_EQUAL(1000, q->ids.lower_bound(ids.back() + 1));
+    ASSERT_EQUAL(true, q->ids.contains(ids[777]));
+    ASSERT_EQUAL(false, q->ids.contains(ids[777] + 1));
+
+    dpacked_vector<std::uint32_t> o(other);
+    vector<std::uint32_t> common, expected;
+    intersect(q->ids, o, common);
+    set_intersection(ids.begin(), ids.end(), other.begin(), other.end(), back_inserter(expected));
+    ASSERT_EQUAL(true, (common == expected));
+    ASSERT_EQUAL(false, common.empty());
+}
+
+TEST(hashed_string)
+{
+    struct entry
+    {
+        dhstring key;
+        int value;
+    };
+
+    dhstring empty;
+    ASSERT_EQUAL(dhstring::hash_of(""), empty.hash());
+    dhstring abc("abc"), abc2(string("abc")), abd("abd");
+    ASSERT_EQUAL(abc, abc2);
+    ASSERT_EQUAL(abc.hash(), abc2.hash());
+    ASSERT_EQUAL(dhstring::hash_of("abc"), abc.hash());
+    ASSERT_NOT_EQUAL(abc, abd);
+    ASSERT_NOT_EQUAL(abc.hash(), abd.hash());
+    ASSERT_EQUAL(abc, "abc");
+    ASSERT_EQUAL(string("abc"), abc);
+    ASSERT_EQUAL(dstring("abc"), abc);
+
+    abd = "abc";
+    ASSERT_EQUAL(abc.hash(), abd.hash());
+    abd.clear();
+    ASSERT_EQUAL(empty.hash(), abd.hash());
+    dhstring moved(std::move(abc2));
+    ASSERT_EQUAL(abc, moved);
+    ASSERT_EQUAL(empty.hash(), abc2.hash());
+
+    dvector<entry> entries;
+    const char* names[] = {"sword", "shield", "potion", "arrow"};
+    for(int i = 0; i < 4; i ++)
+    {
+        entry e;
+        e.key = names[i];
+        e.value = i;
+        entries.push_back(e);
+    }
+
+    ostringstream os;
+    dumpable::write(entries, os);
+    entries.clear();
+
+    string buffer = os.str();
+    const dvector<entry>* loaded = dumpable::from_dumped_buffer<dvector<entry>>(buffer.data());
+    ASSERT_EQUAL(4, loaded->size());
+    ASSERT_EQUAL("potion", (*loaded)[2].key);
+    ASSERT_EQUAL(dhstring::hash_of("potion"), (*loaded)[2].key.hash());
+    ASSERT_EQUAL(false, ((*loaded)[0].key == (*loaded)[1].key));
+
+    unordered_map<dhstring, int> index;
+    for(auto it = loaded->begin(); it != loaded->end(); ++it)
+        index[it->key] = it->value;
+    ASSERT_EQUAL(3, index[dhstring("arrow")]);
+    ASSERT_EQUAL(1, index.count(dhstring("shield")));
+    ASSERT_EQUAL(0, index.count(dhstring("bow")));
+}
+
+TEST(image_editor)
+{
+    struct student
+    {
+        dstring name;
+        int score;
+    };
+    struct classroom
+    {
+        int year;
+        dstring class_name;
+        dvector<student> students;
+    };
+
+    classroom c;
+    c.year = 2014;
+    c.class_name = "1001";
+    for(int i = 0; i < 3; i ++)
+    {
+        student s;
+        s.name = string(1, (char)('A' + i));
+        s.score = i;
+        c.students.push_back(s);
+    }
+
+    ostringstream os;
+    dumpable::write(c, os);
+    string original = os.str();
+
+    string buffer = original;
+    buffer.resize(original.size() + 1024);
+    string edited;
+    {
+        image_editor<classroom> editor(&buffer[0], original.size(), buffer.size());
+        classroom* p = editor.root();
+
+        // in place
+        p->year = 2015;
+        p->students[1].score = 100;
+
+        // copy on write
+        p->class_name = "1002-advanced";
+        student s;
+        s.name = "D";
+        s.score = 3;
+        p->students.push_back(s);
+        p->students[0].name = "Alice";
+        ASSERT_EQUAL("1002-advanced", p->class_name);
+        ASSERT_EQUAL(4, p->students.size());
+        ASSERT_EQUAL("D", p->students[3].name);
+
+        ostringstream out;
+        editor.write(out);
+        edited = out.str();
+        ASSERT_EQUAL(editor.size(), edited.size());
+    }
+    ASSERT_EQUAL(true, (edited.size() > original.size()));
+    // the original region is emitted as is, apart from the patched fields and headers
+    int changed = 0;
+    for(size_t i = 0; i < original.size(); i ++)
+        changed += edited[i] != original[i];
+    ASSERT_EQUAL(true, (changed < 48));
+
+    const classroom* q = dumpable::from_dumped_buffer<classroom>(edited.data());
+    ASSERT_EQUAL(2015, q->year);
+    ASSERT_EQUAL("1002-advanced", q->class_name);
+    ASSERT_EQUAL(4, q->students.size());
+    ASSERT_EQUAL("Alice", q->students[0].name);
+    ASSERT_EQUAL("B", q->students[1].name);
+    ASSERT_EQUAL(100, q->students[1].score);
+    ASSERT_EQUAL("C", q->students[2].name);
+    ASSERT_EQUAL("D", q->students[3].name);
+    ASSERT_EQUAL(3, q->students[3].score);
+
+    // heap editing works again once the editor is gone
+    classroom* r = dumpable::from_dumped_buffer<classroom>(&buffer[0]);
+    r->students.push_back(student());
+    ASSERT_EQUAL(5, r->students.size());
+    ASSERT_EQUAL("D", r->students[3].name);
+}
+
+TEST(diff_patch)
+{
+    struct item
+    {
+        int id;
+        dstring name;
+        dvector<int> stats;
+    };
+
+    dvector<item> items;
+    for(int i = 0; i < 200; i ++)
+    {
+        item it;
+        it.id = i;
+        ostringstream name;
+        name << "item number " << i << " with a reasonably long description";
+        it.name = name.str();
+        it.stats.resize(16);
+        it.stats[0] = i;
+        items.push_back(it);
+    }
+    ostringstream os;
+    dumpable::write(items, os);
+    string oldImage = os.str();
+
+    // same-size change: patch is applicable in place
+    items[50].id = 5000;
+    items[120].stats[3] = 7;
+    ostringstream os2;
+    dumpable::write(items, os2);
+    string sameSize = os2.str();
+
+    // growing change: payloads after the new string move
+    items[10].name = "renamed item with an even longer description than before";
+    ostringstream os3;
+    dumpable::write(items, os3);
+    string grown = os3.str();
+
+    ostringstream patch1, patch2;
+    dumpable::diff(oldImage.data(), oldImage.size(), sameSize.data(), sameSize.size(), patch1);
+    dumpable::diff(oldImage.data(), oldImage.size(), grown.data(), grown.size(), patch2);
+    string p1 = patch1.str(), p2 = patch2.str();
+    ASSERT_EQUAL(true, (p1.size() < 256));
+    // the offsets held by the item array change, the moved payloads do not
+    ASSERT_EQUAL(true, (p2.size() < grown.size() / 3));
+
+    vector<char> result;
+    dumpable::apply_patch(oldImage.data(), oldImage.size(), p2.data(), p2.size(), result);
+    ASSERT_EQUAL(true, (string(result.begin(), result.end()) == grown));
+    const dvector<item>* loaded = dumpable::from_dumped_buffer<dvector<item>>(result.data());
+    ASSERT_EQUAL("renamed item with an even longer description than before", (*loaded)[10].name);
+    ASSERT_EQUAL(5000, (*loaded)[50].id);
+    ASSERT_EQUAL(199, (*loaded)[199].stats[0]);
+
+    string inPlace = oldImage;
+    ASSERT_EQUAL(false, dumpable::apply_patch_in_place(&inPlace[0], inPlace.size(), inPlace.size(), p2.data(), p2.size()));
+    ASSERT_EQUAL(true, (inPlace == oldImage));
+    size_t newSize = 0;
+    ASSERT_EQUAL(true, dumpable::apply_patch_in_place(&inPlace[0], inPlace.size(), inPlace.size(), p1.data(), p1.size(), &newSize));
+    ASSERT_EQUAL(sameSize.size(), newSize);
+    ASSERT_EQUAL(true, (inPlace == sameSize));
+
+    bool thrown = false;
+    try
+    {
+        dumpable::apply_patch(grown.data(), grown.size(), p1.data(), p1.size(), result);
+    }
+    catch(std::runtime_error&)
+    {
+        thrown = true;
+    }
+    ASSERT_EQUAL(true, thrown);
+
+    // another image of the same size: every op fits, only the hash tells
+    string other = oldImage;
+    other[other.size() - 1] ^= 1;
+    thrown = false;
+    try
+    {
+        dumpable::apply_patch_in_place(&other[0], other.size(), other.size(), p1.data(), p1.size());
+    }
+    catch(std::runtime_error&)
+    {
+        thrown = true;
+    }
+    ASSERT_EQUAL(true, thrown);
+
+    // lengths that wrap around when added to an offset or rounded up
+    const uint64_t huge[][3] = {
+        {dumpable::detail::patch_op_copy, 8, ~(uint64_t)0 - 7},
+        {dumpable::detail::patch_op_copy, ~(uint64_t)0, 16},
+        {dumpable::detail::patch_op_insert, ~(uint64_t)0, 0},
+    };
+    for(auto& op : huge)
+    {
+        ostringstream hostile;
+        hostile.write(dumpable::detail::patch_magic, sizeof(dumpable::detail::patch_magic));
+        dumpable::detail::write_u64(hostile, oldImage.size());
+        dumpable::detail::write_u64(hostile, 16);
+        dumpable::detail::write_u64(hostile, 0);
+        dumpable::detail::write_u64(hostile, op[0]);
+        dumpable::detail::write_u64(hostile, op[1]);
+        if (op[0] == dumpable::detail::patch_op_copy)
+            dumpable::detail::write_u64(hostile, op[2]);
+        string h = hostile.str();
+        thrown = false;
+        try
+        {
+            dumpable::apply_patch(oldImage.data(), oldImage.size(), h.data(), h.size(), result, false);
+        }
+        catch(std::runtime_error&)
+        {
+            thrown = true;
+        }
+        ASSERT_EQUAL(true, thrown);
+        // refused one way or the other, never written
+        bool applied = false;
+        inPlace = oldImage;
+        try
+        {
+            applied = dumpable::apply_patch_in_place(&inPlace[0], inPlace.size(), inPlace.size(), h.data(), h.size());
+        }
+        catch(std::runtime_error&)
+        {
+        }
+        ASSERT_EQUAL(false, applied);
+        ASSERT_EQUAL(true, (inPlace == oldImage));
+    }
+}
+
+TEST(compressed_image)
+{
+    struct world
+    {
+        dstring name;
+        dvector<int> tiles;
+        dvector<dstring> labels;
+    };
+
+    world w;
+    w.name = "overworld";
+    vector<int> tiles(200000);
+    for(size_t i = 0; i < tiles.size(); i ++)
+        tiles[i] = (int)(i / 100 % 7);
+    w.tiles = tiles;
+    for(int i = 0; i < 1000; i ++)
+    {
+        ostringstream label;
+        label << "label " << i;
+        w.labels.push_back(dstring(label.str()));
+    }
+
+    ostringstream os;
+    dumpable::write(w, os);
+    string image = os.str();
+
+    ostringstream cos;
+    dumpable::compress_image(image.data(), image.size(), cos);
+    string compressed = cos.str();
+    ASSERT_EQUAL(true, (compressed.size() * 4 < image.size()));
+
+    for(int mode = 0; mode < 2; mode ++)
+    {
+        compressed_image img(compressed.data(), compressed.size(),
+                mode ? compressed_image::load_eager : compressed_image::load_lazy);
+        ASSERT_EQUAL(image.size(), img.size());
+        ASSERT_EQUAL(true, (img.chunk_count() > 8));
+        if (!img.is_lazy())
+        {
+            ASSERT_EQUAL(img.chunk_count(), img.loaded_chunks());
+        }
+        else
+        {
+            ASSERT_EQUAL(0, img.loaded_chunks());
+        }
+
+        const world* p = img.root<world>();
+        ASSERT_EQUAL("overworld", p->name);
+        ASSERT_EQUAL(200000, p->tiles.size());
+        ASSERT_EQUAL(tiles[123456], p->tiles[123456]);
+        if (img.is_lazy())
+        {
+            ASSERT_EQUAL(true, (img.loaded_chunks() < img.chunk_count()));
+        }
+        ASSERT_EQUAL("label 999", p->labels[999]);
+
+#ifdef DUMPABLE_POSIX
+        // system calls do not fault chunks in; prefetch the range first
+        size_t tail = image.size() - 1000;
+        img.prefetch(tail, 1000);
+        int fds[2];
+        ASSERT_EQUAL(0, pipe(fds));
+        ASSERT_EQUAL(1000, write(fds[1], (const char*)img.data() + tail, 1000));
+        char piped[1000];
+        ASSERT_EQUAL(1000, read(fds[0], piped, sizeof(piped)));
+        ASSERT_EQUAL(0, memcmp(piped, image.data() + tail, sizeof(piped)));
+        close(fds[0]);
+        close(fds[1]);
+#endif
+
+        img.prefetch_all();
+        ASSERT_EQUAL(img.chunk_count(), img.loaded_chunks());
+        ASSERT_EQUAL(0, memcmp(img.data(), image.data(), image.size()));
+    }
+
+    // a flipped literal byte would go unnoticed without a checksum: break the first chunk's stored size
+    string corrupted = compressed;
+    corrupted[sizeof(dumpable::detail::chunked_header) + sizeof(uint64_t) + 5] ^= 0x5a;
+    bool thrown = false;
+    try
+    {
+        compressed_image img(corrupted.data(), corrupted.size(), compressed_image::load_eager);
+    }
+    catch(std::runtime_error&)
+    {
+        thrown = true;
+    }
+    ASSERT_EQUAL(true, thrown);
+
+    thrown = false;
+    try
+    {
+        ostringstream zero;
+        dumpable::compress_image(image.data(), image.size(), zero, 0);
+    }
+    catch(std::invalid_argument&)
+    {
+        thrown = true;
+    }
+    ASSERT_EQUAL(true, thrown);
+}
+
+TEST(record_log)
+{
+    struct event
+    {
+        int id;
+        dstring name;
+        dvector<int> values;
+    };
+
+    string path = "test_record_log.bin";
+    std::remove(path.c_str());
+    std::remove((path + ".idx").c_str());
+
+    {
+        dumpable::record_writer<event> writer(path);
+        for(int i = 0; i < 100; i ++)
+        {
+            event e;
+            e.id = i;
+            e.name = "event";
+            e.values = vector<int>(i % 5, i);
+            ASSERT_EQUAL((size_t)i, writer.append(e));
+        }
+        writer.flush();
+
+        dumpable::record_reader<event> reader(path);
+        ASSERT_EQUAL(100, reader.size());
+        ASSERT_EQUAL(42, reader[42]->id);
+        ASSERT_EQUAL("event", reader[42]->name);
+        ASSERT_EQUAL(2, reader[42]->values.size());
+        ASSERT_EQUAL(42, reader[42]->values[1]);
+        ASSERT_EQUAL(0, reader.record_size(7) % 8);
+
+        // appended but not flushed records stay invisible
+        event e;
+        e.id = 100;
+        writer.append(e);
+        ASSERT_EQUAL(100, reader.refresh());
+        writer.flush();
+        ASSERT_EQUAL(101, reader.refresh());
+        ASSERT_EQUAL(100, reader[100]->id);
+
+        int sum = 0;
+        for(auto it = reader.begin(); it != reader.end(); ++it)
+            sum += it->id;
+        ASSERT_EQUAL(5050, sum);
+
+        // ids are ascending, so records can be binary searched
+        auto found = std::lower_bound(reader.begin(), reader.end(), 64,
+                [](const event& r, int id){ return r.id < id; });
+        ASSERT_EQUAL(64, found - reader.begin());
+        ASSERT_EQUAL(63, (found - 1)->id);
+        ASSERT_EQUAL(66, found[2].id);
+        ASSERT_EQUAL(101, std::distance(reader.begin(), reader.end()));
+    }
+
+    // reopening appends after the existing records
+    {
+        dumpable::record_writer<event> writer(path);
+        ASSERT_EQUAL(101, writer.size());
+        event e;
+        e.id = 101;
+        e.name = "reopened";
+        ASSERT_EQUAL(101, writer.append(e));
+    }
+    dumpable::record_reader<event> reader(path);
+    ASSERT_EQUAL(102, reader.size());
+    ASSERT_EQUAL("reopened", reader[101]->name);
+    ASSERT_EQUAL(99, reader[99]->id);
+
+    std::remove(path.c_str());
+    std::remove((path + ".idx").c_str());
+}
+
+TEST(write_many)
+{
+    struct packet
+    {
+        int seq;
+        dstring from;
+        dvector<int> body;
+    };
+    struct table
+    {
+        dvector<dstring> names;
+    };
+
+    packet a, b;
+    a.seq = 1;
+    a.from = "server";
+    a.body = vector<int>(10, 7);
+    b.seq = 2;
+    b.from = "server";
+    b.body = vector<int>(10, 7);
+    table t;
+    t.names.push_back(dstring("server"));
+    t.names.push_back(dstring("client"));
+
+    ostringstream os;
+    vector<size_t> offsets = dumpable::write_many(os, a, t, b);
+    string image = os.str();
+    ASSERT_EQUAL(3, offsets.size());
+    ASSERT_EQUAL(0, offsets[0]);
+    const packet* pa = from_dumped_buffer<packet>(image.data());
+    const table* pt = from_dumped_buffer<table>(image.data() + offsets[1]);
+    const packet* pb = from_dumped_buffer<packet>(image.data() + offsets[2]);
+    ASSERT_EQUAL(1, pa->seq);
+    ASSERT_EQUAL("server", pa->from);
+    ASSERT_EQUAL(7, pa->body[9]);
+    ASSERT_EQUAL("client", pt->names[1]);
+    ASSERT_EQUAL(2, pb->seq);
+    ASSERT_EQUAL(10, pb->body.size());
+
+    // a single root has the layout of dumpable::write (padding bytes aside)
+    ostringstream single, many;
+    dumpable::write(a, single);
+    dumpable::write_many(many, a);
+    ASSERT_EQUAL(single.str().size(), many.str().size());
+    ASSERT_EQUAL(true, (0 == memcmp(single.str().data() + sizeof(packet), many.str().data() + sizeof(packet), single.str().size() - sizeof(packet))));
+
+    dumpable::image_builder shared(true);
+    for(int i = 0; i < 10; i ++)
+    {
+        a.seq = i;
+        ASSERT_EQUAL(true, (shared.add(a) + sizeof(packet) <= shared.size()));
+    }
+    shared.add(t);
+    ostringstream sos;
+    shared.write(sos);
+    string sharedImage = sos.str();
+    ASSERT_EQUAL(shared.size(), sharedImage.size());
+    for(int i = 0; i < 10; i ++)
+    {
+        const packet* p = from_dumped_buffer<packet>(sharedImage.data() + shared.offsets()[i]);
+        ASSERT_EQUAL(i, p->seq);
+        ASSERT_EQUAL("server", p->from);
+        ASSERT_EQUAL(7, p->body[3]);
+    }
+    const packet* p0 = from_dumped_buffer<packet>(sharedImage.data());
+    const packet* p9 = from_dumped_buffer<packet>(sharedImage.data() + shared.offsets()[9]);
+    ASSERT_EQUAL(p0->from.c_str(), p9->from.c_str());
+    ASSERT_EQUAL(&p0->body[0], &p9->body[0]);
+    const table* st = from_dumped_buffer<table>(sharedImage.data() + shared.offsets()[10]);
+    ASSERT_EQUAL(p0->from.c_str(), st->names[0].c_str());
+    ASSERT_EQUAL("client", st->names[1]);
+}
+
+struct trivial_packet
+{
+    int type;
+    float pos[3];
+    char name[16];
+};
+
+struct nested_record
+{
+    dstring name;
+    dvector<trivial_packet> packets;
+    not_dump<std::string> cache;
+};
+DUMPABLE_STRUCT(nested_record)
+DUMPABLE_ASSERT_MEMBER(nested_record, name);
+DUMPABLE_ASSERT_MEMBER(nested_record, packets);
+DUMPABLE_ASSERT_MEMBER(nested_record, cache);
+
+TEST(traits)
+{
+    static_assert(dumpable::is_trivially_dumpable<trivial_packet>::value, "");
+    static_assert(!dumpable::is_trivially_dumpable<dstring>::value, "");
+    static_assert(!dumpable::is_trivially_dumpable<nested_record>::value, "");
+    static_assert(dumpable::static_image_size<trivial_packet>::value == sizeof(trivial_packet), "");
+    char buffer[dumpable::static_image_size<trivial_packet>::value];
+    (void)buffer;
+
+    static_assert(dumpable::is_dumpable<int>::value, "");
+    static_assert(!dumpable::is_dumpable<int*>::value, "");
+    static_assert(!dumpable::is_dumpable<std::string>::value, "");
+    static_assert(!dumpable::is_dumpable<dvector<std::string>>::value, "");
+    static_assert(dumpable::is_dumpable<dvector<dvector<dstring>>>::value, "");
+    static_assert(dumpable::is_dumpable<dmap<dstring, nested_record>>::value, "");
+    static_assert(!dumpable::is_dumpable<dmap<int, std::vector<int>>>::value, "");
+    static_assert(dumpable::is_dumpable<dsoa<int, float>>::value, "");
+
+    trivial_packet p;
+    memset(&p, 0, sizeof(p));
+    p.type = 3;
+    p.pos[2] = 1.5f;
+    strcpy(p.name, "ping");
+    ostringstream os;
+    dumpable::write(p, os);
+    string image = os.str();
+    ASSERT_EQUAL(sizeof(trivial_packet), image.size());
+    ASSERT_EQUAL(0, memcmp(image.data(), &p, sizeof(p)));
+    const trivial_packet* q = from_dumped_buffer<trivial_packet>(image.data());
+    ASSERT_EQUAL(3, q->type);
+    ASSERT_EQUAL(1.5f, q->pos[2]);
+
+    nested_record r;
+    r.name = "nested";
+    r.packets.push_back(p);
+    ostringstream nos;
+    dumpable::write(r, nos);
+    string nested = nos.str();
+    const nested_record* pr = from_dumped_buffer<nested_record>(nested.data());
+    ASSERT_EQUAL("nested", pr->name);
+    ASSERT_EQUAL(string("ping"), string(pr->packets[0].name));
+}
+
+TEST(dmap_bulk)
+{
+    vector<pair<int, int>> items;
+    for(int i = 0; i < 100000; i ++)
+        items.push_back(make_pair((i * 7919) % 50000, i));
+
+    dmap<int, int> first(items.begin(), items.end());
+    ASSERT_EQUAL(50000, first.size());
+    dmap<int, int> last(items.begin(), items.end(), dumpable::keep_last, 4);
+    ASSERT_EQUAL(50000, last.size());
+    for(int k = 0; k < 50000; k += 997)
+    {
+        ASSERT_EQUAL(true, (first.find(k) != first.end()));
+        ASSERT_EQUAL(true, (last.find(k)->second > first.find(k)->second));
+        ASSERT_EQUAL(k, (first.find(k)->second * 7919) % 50000);
+    }
+    for(auto it = last.begin(); it + 1 < last.end(); ++it)
+        ASSERT_EQUAL(true, (it->first < (it+1)->first));
+
+    bool thrown = false;
+    try
+    {
+        dmap<int, int> strict(items.begin(), items.end(), dumpable::reject_duplicates);
+    }
+    catch(std::invalid_argument&)
+    {
+        thrown = true;
+    }
+    ASSERT_EQUAL(true, thrown);
+
+    vector<pair<dstring, int>> sorted;
+    sorted.push_back(make_pair(dstring("apple"), 1));
+    sorted.push_back(make_pair(dstring("banana"), 2));
+    sorted.push_back(make_pair(dstring("cherry"), 3));
+    dmap<dstring, int> fruits(dumpable::sorted_unique, sorted.begin(), sorted.end());
+    ASSERT_EQUAL(2, fruits.find(dstring("banana"))->second);
+
+    // not actually sorted: the map still comes out right
+    swap(sorted[0], sorted[2]);
+    dmap<dstring, int> unsorted(dumpable::sorted_unique, sorted.begin(), sorted.end());
+    ASSERT_EQUAL(string("apple"), string(unsorted.begin()->first.c_str()));
+    ASSERT_EQUAL(3, unsorted.find(dstring("cherry"))->second);
+
+    ostringstream os;
+    dumpable::write(last, os);
+    string image = os.str();
+    const dmap<int, int>* p = from_dumped_buffer<dmap<int, int>>(image.data());
+    ASSERT_EQUAL(50000, p->size());
+    ASSERT_EQUAL(last.find(1234)->second, p->find(1234)->second);
+}
+
+TEST(dmap_ranges)
+{
+    vector<pair<dstring, int>> words;
+    const char* list[] = {"car", "card", "care", "cart", "cat", "dog", "ca", "carton", "do"};
+    for(int i = 0; i < 9; i ++)
+        words.push_back(make_pair(dstring(list[i]), i));
+    dmap<dstring, int> m(words.begin(), words.end());
+
+    auto r = m.prefix_range("car");
+    ASSERT_EQUAL(5, r.second - r.first);
+    ASSERT_EQUAL("car", r.first->first);
+    ASSERT_EQUAL("carton", (r.second-1)->first);
+    ASSERT_EQUAL(9, m.prefix_range("").second - m.prefix_range("").first);
+    ASSERT_EQUAL(0, m.prefix_range(string("cb")).second - m.prefix_range(string("cb")).first);
+    ASSERT_EQUAL(2, m.prefix_range(dstring("do")).second - m.prefix_range(dstring("do")).first);
+
+    ASSERT_EQUAL("card", m.upper_bound(dstring("car"))->first);
+    ASSERT_EQUAL("car", m.lower_bound(dstring("car"))->first);
+    ASSERT_EQUAL("cat", m.lower_bound(dstring("cas"))->first);
+    ASSERT_EQUAL(true, (m.lower_bound(dstring("zebra")) == m.end()));
+
+    dmap<int, int> numbers;
+    {
+        map<int, int> src;
+        for(int i = 0; i < 100; i += 10)
+            src[i] = i;
+        numbers = src;
+    }
+    ASSERT_EQUAL(30, numbers.lower_bound(25)->first);
+    ASSERT_EQUAL(30, numbers.upper_bound(20)->first);
+    ASSERT_EQUAL(1, numbers.equal_range(40).second - numbers.equal_range(40).first);
+    ASSERT_EQUAL(0, numbers.equal_range(45).second - numbers.equal_range(45).first);
+
+    vector<pair<int, dstring>> index;
+    index.push_back(make_pair(2, dstring("b1")));
+    index.push_back(make_pair(1, dstring("a1")));
+    index.push_back(make_pair(2, dstring("b2")));
+    index.push_back(make_pair(3, dstring("c1")));
+    index.push_back(make_pair(2, dstring("b3")));
+    dmultimap<int, dstring> multi(index.begin(), index.end());
+    ASSERT_EQUAL(5, multi.size());
+    ASSERT_EQUAL(3, multi.count(2));
+    ASSERT_EQUAL(0, multi.count(4));
+    ASSERT_EQUAL("b1", multi.find(2)->second);
+
+    ostringstream os;
+    dumpable::write(multi, os);
+    string image = os.str();
+    const dmultimap<int, dstring>* p = from_dumped_buffer<dmultimap<int, dstring>>(image.data());
+    auto eq = p->equal_range(2);
+    ASSERT_EQUAL(3, eq.second - eq.first);
+    ASSERT_EQUAL("b2", (eq.first+1)->second);
+    ASSERT_EQUAL("b3", (eq.first+2)->second);
+
+    dmultimap<int, dstring> presorted(dumpable::sorted_equivalent, p->begin(), p->end());
+    ASSERT_EQUAL(3, presorted.count(2));
+}
+
+TEST(trie)
+{
+    vector<string> words;
+    const char* list[] = {"tea", "ten", "to", "inn", "in", "i", "tea", "ted", "a", ""};
+    for(int i = 0; i < 10; i ++)
+        words.push_back(list[i]);
+    for(int i = 0; i < 2000; i ++)
+    {
+        ostringstream name;
+        name << "item/" << i * 37;
+        words.push_back(name.str());
+    }
+
+    dtrie t(words);
+    ASSERT_EQUAL(2009, t.size());
+    for(size_t i = 0; i < words.size(); i ++)
+    {
+        size_t id = t.find(words[i]);
+        ASSERT_EQUAL(true, (id < t.size()));
+        ASSERT_EQUAL(words[i], t.key(id));
+    }
+    ASSERT_EQUAL(dtrie::npos, t.find("te"));
+    ASSERT_EQUAL(dtrie::npos, t.find("tea!"));
+    ASSERT_EQUAL(dtrie::npos, t.find("x"));
+    ASSERT_EQUAL(true, t.contains(""));
+
+    vector<string> found;
+    ASSERT_EQUAL(3, t.enumerate_prefix("te", [&](const string& key, size_t id) {
+            ASSERT_EQUAL(key, t.key(id));
+            found.push_back(key);
+        }));
+    ASSERT_EQUAL("tea", found[0]);
+    ASSERT_EQUAL("ted", found[1]);
+    ASSERT_EQUAL("ten", found[2]);
+    ASSERT_EQUAL(2009, t.enumerate_prefix("", [](const string&, size_t) {}));
+    ASSERT_EQUAL(0, t.enumerate_prefix("zz", [](const string&, size_t) {}));
+
+    ostringstream os;
+    dumpable::write(t, os);
+    string image = os.str();
+    const dtrie* p = from_dumped_buffer<dtrie>(image.data());
+    ASSERT_EQUAL(t.find("item/370"), p->find("item/370"));
+    ASSERT_EQUAL("item/370", p->key(p->find("item/370")));
+    ASSERT_EQUAL(300, p->enumerate_prefix("item/1", [](const string&, size_t) {}));
+    // shared prefixes are stored once
+    ASSERT_EQUAL(true, (image.size() < 2000 * 8));
+
+    bool thrown = false;
+    try
+    {
+        p->key(p->size());
+    }
+    catch(std::out_of_range&)
+    {
+        thrown = true;
+    }
+    ASSERT_EQUAL(true, thrown);
+}
+
+TEST(graph)
+{
+    typedef dgraph<int, float> graph;
+    vector<int> cities;
+    for(int i = 0; i < 6; i ++)
+        cities.push_back(i * 100);
+    vector<graph::edge> roads;
+    graph::edge list[] = {
+        {0, 1, 7.f}, {0, 2, 9.f}, {0, 5, 14.f}, {1, 2, 10.f}, {1, 3, 15.f},
+        {2, 3, 11.f}, {2, 5, 2.f}, {3, 4, 6.f}, {5, 4, 9.f},
+    };
+    for(auto& e : list)
+    {
+        roads.push_back(e);
+        graph::edge back = {e.to, e.from, e.weight};
+        roads.push_back(back);
+    }
+    graph g(cities, roads);
+    ASSERT_EQUAL(6, g.node_count());
+    ASSERT_EQUAL(18, g.edge_count());
+    ASSERT_EQUAL(3, g.degree(0));
+
+    ostringstream os;
+    dumpable::write(g, os);
+    string image = os.str();
+    const graph* p = from_dumped_buffer<graph>(image.data());
+    ASSERT_EQUAL(300, p->node(3));
+    int sum = 0;
+    for(graph::node_id m : p->out_edges(2))
+        sum += m;
+    ASSERT_EQUAL(0+1+3+5, sum);
+
+    vector<graph::node_id> hops = dumpable::bfs(*p, 0);
+    ASSERT_EQUAL(0, hops[0]);
+    ASSERT_EQUAL(1, hops[5]);
+    ASSERT_EQUAL(2, hops[4]);
+
+    vector<graph::node_id> parents;
+    vector<float> dist = dumpable::dijkstra(*p, 0, &parents);
+    ASSERT_EQUAL(20.f, dist[4]);
+    ASSERT_EQUAL(11.f, dist[5]);
+    vector<graph::node_id> path = dumpable::path_to(parents, (graph::node_id)0, (graph::node_id)4);
+    ASSERT_EQUAL(4, path.size());
+    ASSERT_EQUAL(2, path[1]);
+    ASSERT_EQUAL(5, path[2]);
+
+    // unweighted, without node data; node 3 is unreachable
+    vector<dgraph<>::edge> deps;
+    dgraph<>::edge dlist[] = {{0, 1, 0}, {1, 2, 0}, {0, 2, 0}, {3, 0, 0}};
+    deps.assign(dlist, dlist + 4);
+    dgraph<> d(4, deps, false);
+    ASSERT_EQUAL(false, d.weighted());
+    ASSERT_EQUAL(1, dumpable::bfs(d, 0)[2]);
+    ASSERT_EQUAL(dgraph<>::npos, dumpable::bfs(d, 0)[3]);
+    ASSERT_EQUAL(1.f, dumpable::dijkstra(d, 0)[2]);
+}
+
+TEST(arena)
+{
+    struct city
+    {
+        dstring name;
+        dvector<int> roads;
+    };
+    typedef dvector<city> world;
+
+    dumpable::arena a(4096);
+    string image;
+    {
+        world w;
+        {
+            dumpable::arena_scope scope(a);
+            for(int i = 0; i < 1000; i ++)
+            {
+                city c;
+                ostringstream name;
+                name << "city " << i;
+                c.name = name.str();
+                for(int j = 0; j < i % 10; j ++)
+                    c.roads.push_back(j);
+                w.push_back(std::move(c));
+            }
+        }
+        ASSERT_EQUAL(true, (a.used() > 1000 * sizeof(city)));
+        ASSERT_EQUAL(true, (a.chunk_count() > 1));
+
+        // storage made after the scope is ordinary heap storage again
+        size_t used = a.used();
+        dvector<int> heap(vector<int>(100, 1));
+        ASSERT_EQUAL(used, a.used());
+
+        ostringstream os;
+        dumpable::write(w, os);
+        image = os.str();
+        ASSERT_EQUAL(used, a.used());
+
+        // the whole arena goes at once; w is only destroyed afterwards
+        a.release();
+        ASSERT_EQUAL(0, a.used());
+    }
+
+    const world* p = from_dumped_buffer<world>(image.data());
+    ASSERT_EQUAL(1000, p->size());
+    ASSERT_EQUAL("city 999", (*p)[999].name);
+    ASSERT_EQUAL(9, (*p)[999].roads.size());
+    ASSERT_EQUAL(8, (*p)[999].roads[8]);
+
+    dumpable::arena outer, inner;
+    {
+        dumpable::arena_scope s1(outer);
+        dstring x("outer string");
+        {
+            dumpable::arena_scope s2(inner);
+            dstring y("inner string");
+        }
+        dstring z("outer again");
+    }
+    ASSERT_EQUAL(13 + 12, outer.used());
+    ASSERT_EQUAL(13, inner.used());
+}
+
+TEST(numa_image)
+{
+    ASSERT_EQUAL(2, dumpable::detail::parse_node_list("0-1").size());
+    vector<int> sparse = dumpable::detail::parse_node_list("0,2-4");
+    ASSERT_EQUAL(4, sparse.size());
+    ASSERT_EQUAL(0, sparse[0]);
+    ASSERT_EQUAL(2, sparse[1]);
+    ASSERT_EQUAL(4, sparse[3]);
+    ASSERT_EQUAL(1, dumpable::detail::parse_node_list("0").size());
+    ASSERT_EQUAL(0, dumpable::detail::parse_node_list("").size());
+    const vector<int>& nodes = dumpable::detail::numa_nodes();
+    ASSERT_EQUAL(true, (nodes.size() >= 1));
+    ASSERT_EQUAL(true, (std::find(nodes.begin(), nodes.end(), dumpable::detail::numa_current_node()) != nodes.end()));
+
+    dmap<int, dstring> m;
+    {
+        map<int, dstring> src;
+        for(int i = 0; i < 1000; i ++)
+            src[i] = dstring("value");
+        m = src;
+    }
+    ostringstream os;
+    dumpable::write(m, os);
+    string image = os.str();
+
+    for(int p = 0; p < 2; p ++)
+    {
+        numa_image img(image.data(), image.size(), p ? numa_image::numa_interleave : numa_image::numa_replicate);
+        ASSERT_EQUAL(image.size(), img.size());
+        ASSERT_EQUAL(true, (img.replica_count() >= 1));
+        if (p)
+        {
+            ASSERT_EQUAL(1, img.replica_count());
+        }
+        for(size_t r = 0; r < img.replica_count(); r ++)
+        {
+            ASSERT_EQUAL(0, memcmp(img.data(r), image.data(), image.size()));
+        }
+        const dmap<int, dstring>* root = img.root<dmap<int, dstring>>();
+        ASSERT_EQUAL("value", root->find(777)->second);
+    }
+}
+
+TEST(write_file)
+{
+    struct level
+    {
+        dstring name;
+        dvector<int> heights;
+        dvector<dstring> props;
+        dmap<int, dstring> triggers;
+    };
+
+    level l;
+    l.name = "mapped level";
+    vector<int> heights(1 << 20);
+    for(size_t i = 0; i < heights.size(); i ++)
+        heights[i] = (int)(i * 3);
+    l.heights = heights;
+    for(int i = 0; i < 5000; i ++)
+    {
+        ostringstream prop;
+        prop << "prop " << i;
+        l.props.push_back(dstring(prop.str()));
+    }
+    map<int, dstring> triggers;
+    triggers[3] = "door";
+    triggers[9] = "trap";
+    l.triggers = triggers;
+
+    string path = "test_write_file.bin";
+    size_t size = dumpable::write_file(l, path);
+    ostringstream os;
+    dumpable::write(l, os);
+    ASSERT_EQUAL(os.str().size(), size);
+
+    {
+        dumpable::mapped_file f(path);
+        ASSERT_EQUAL(size, f.size());
+        const level* p = f.root<level>();
+        ASSERT_EQUAL("mapped level", p->name);
+        ASSERT_EQUAL(heights.size(), p->heights.size());
+        ASSERT_EQUAL(3 * 777777, p->heights[777777]);
+        ASSERT_EQUAL("prop 4999", p->props[4999]);
+        ASSERT_EQUAL("trap", p->triggers.find(9)->second);
+        // everything but the padding bytes matches dumpable::write
+        ASSERT_EQUAL(0, memcmp((const char*)f.data() + sizeof(level), os.str().data() + sizeof(level), size - sizeof(level)));
+    }
+
+    bool thrown = false;
+    try
+    {
+        dumpable::write_file(l, path, 1 << 20);
+    }
+    catch(std::length_error&)
+    {
+        thrown = true;
+    }
+    ASSERT_EQUAL(true, thrown);
+    ASSERT_EQUAL(false, dumpable::detail::dumpable_is_custom_alloc());
+
+    trivial_packet tp;
+    memset(&tp, 0, sizeof(tp));
+    tp.type = 7;
+    ASSERT_EQUAL(sizeof(tp), dumpable::write_file(tp, path));
+    dumpable::mapped_file f(path);
+    ASSERT_EQUAL(7, f.root<trivial_packet>()->type);
+    std::remove(path.c_str());
+}
+
+TEST(write_async)
+{
+    struct asset
+    {
+        dstring name;
+        dvector<int> data;
+    };
+    struct bundle
+    {
+        dvector<asset> assets;
+        dmap<dstring, int> lookup;
+        dptr<asset> main;
+    };
+
+    bundle b;
+    map<dstring, int> lookup;
+    for(int i = 0; i < 300; i ++)
+    {
+        asset a;
+        ostringstream name;
+        name << "asset " << i;
+        a.name = name.str();
+        a.data = vector<int>(i * 7, i);
+        b.assets.push_back(a);
+        lookup[a.name] = i;
+    }
+    b.lookup = lookup;
+    asset mainAsset;
+    mainAsset.name = "main";
+    b.main = &mainAsset;
+
+    string path = "test_write_async.bin";
+    ostringstream os;
+    dumpable::write(b, os);
+    string expected = os.str();
+    // small blocks and a single pending write, so blocks stream out while the rest is built
+    std::future<size_t> done = dumpable::write_async(b, path, 4096, 1);
+    ASSERT_EQUAL(expected.size(), done.get());
+    ASSERT_EQUAL(false, dumpable::detail::dumpable_is_custom_alloc());
+
+    dumpable::mapped_file f(path);
+    ASSERT_EQUAL(expected.size(), f.size());
+    const bundle* p = f.root<bundle>();
+    ASSERT_EQUAL(300, p->assets.size());
+    ASSERT_EQUAL("asset 299", p->assets[299].name);
+    ASSERT_EQUAL(299, p->assets[299].data[2092]);
+    ASSERT_EQUAL(123, p->lookup.find(dstring("asset 123"))->second);
+    ASSERT_EQUAL("main", p->main->name);
+    ASSERT_EQUAL(0, memcmp((const char*)f.data() + sizeof(bundle), expected.data() + sizeof(bundle), expected.size() - sizeof(bundle)));
+    std::remove(path.c_str());
+}
+
+TEST(segmented_image)
+{
+    struct article
+    {
+        dstring title;
+        dvector<int> words;
+    };
+    struct catalog
+    {
+        dvector<dstring> titles;
+        dvector<dxptr<article>> bodies;
+    };
+
+    dumpable::segmented_writer w;
+    // segment indices follow first use, so the bodies segment is index 0
+    uint32_t bodies = w.segment_index("bodies");
+    catalog c;
+    for(int i = 0; i < 50; i ++)
+    {
+        article a;
+        ostringstream title;
+        title << "article " << i;
+        a.title = title.str();
+        a.words = vector<int>(i * 100, i);
+        c.titles.push_back(a.title);
+        c.bodies.push_back(w.add("bodies", a));
+    }
+    ASSERT_EQUAL(bodies, c.bodies[10].segment);
+    w.add("index", c);
+    w.segment("empty");
+
+    string path = "test_segments.bin";
+    {
+        ofstream os(path.c_str(), ios::binary);
+        w.write(os);
+    }
+
+    dumpable::segmented_image img(path);
+    ASSERT_EQUAL(3, img.segment_count());
+    ASSERT_EQUAL("index", img.segment_name(1));
+    ASSERT_EQUAL(dumpable::segmented_image::npos, img.find_segment("missing"));
+    ASSERT_EQUAL(false, img.is_loaded(0));
+    ASSERT_EQUAL(false, img.is_loaded(1));
+
+    const catalog* idx = img.root<catalog>("index");
+    ASSERT_EQUAL(true, img.is_loaded(1));
+    ASSERT_EQUAL(false, img.is_loaded(0));
+    ASSERT_EQUAL(50, idx->titles.size());
+    ASSERT_EQUAL("article 42", idx->titles[42]);
+
+    // following a cross-segment pointer maps the other segment on demand
+    const article* a = img.resolve(idx->bodies[42]);
+    ASSERT_EQUAL(true, img.is_loaded(0));
+    ASSERT_EQUAL("article 42", a->title);
+    ASSERT_EQUAL(4200, a->words.size());
+    ASSERT_EQUAL(42, a->words[4199]);
+    ASSERT_EQUAL("article 0", img.resolve(idx->bodies[0])->title);
+    ASSERT_EQUAL(0, img.segment_size(2));
+
+    bool thrown = false;
+    try
+    {
+        img.segment("missing");
+    }
+    catch(std::out_of_range&)
+    {
+        thrown = true;
+    }
+    ASSERT_EQUAL(true, thrown);
+
+    thrown = false;
+    try
+    {
+        img.resolve(dumpable::dxptr<article>::make(3, 0));
+    }
+    catch(std::out_of_range&)
+    {
+        thrown = true;
+    }
+    ASSERT_EQUAL(true, thrown);
+
+    // a truncated file is refused up front instead of faulting on first access
+    string file;
+    {
+        ifstream in(path.c_str(), ios::binary);
+        ostringstream ss;
+        ss << in.rdbuf();
+        file = ss.str();
+    }
+    string truncated = path + ".truncated";
+    {
+        ofstream os(truncated.c_str(), ios::binary);
+        os.write(file.data(), file.size() - 100);
+    }
+    thrown = false;
+    try
+    {
+        dumpable::segmented_image broken(truncated);
+    }
+    catch(std::runtime_error&)
+    {
+        thrown = true;
+    }
+    ASSERT_EQUAL(true, thrown);
+    std::remove(truncated.c_str());
+    std::remove(path.c_str());
+}
+
+TEST(checksums)
+{
+    ASSERT_EQUAL(0xe3069283u, dumpable::crc32c("123456789", 9));
+    ASSERT_EQUAL(dumpable::crc32c("123456789", 9), dumpable::crc32c("6789", 4, dumpable::crc32c("12345", 5)));
+    string noise;
+    for(int i = 0; i < 1000; i ++)
+        noise += (char)(i * 7919 >> 3);
+    for(size_t length = 0; length < 40; length ++)
+        ASSERT_EQUAL(~dumpable::detail::crc32c_sw(~0u, (const unsigned char*)noise.data() + 3, length), dumpable::crc32c(noise.data() + 3, length));
+
+    struct table
+    {
+        dstring name;
+        dvector<int> rows;
+    };
+    table t;
+    t.name = "checked";
+    t.rows = vector<int>(100000, 5);
+    for(int i = 0; i < 100000; i += 3)
+        t.rows[i] = i;
+
+    ostringstream os;
+    dumpable::write_with_checksums(t, os, 4096);
+    string file = os.str();
+    ASSERT_EQUAL(true, dumpable::verify_image(file.data(), file.size()));
+    ASSERT_EQUAL(true, dumpable::verify_image(file.data(), file.size(), 1));
+
+    string corrupted = file;
+    corrupted[2 * 4096 + 100] ^= 1;
+    corrupted[40 * 4096 + 5] ^= 0x80;
+    vector<size_t> bad = dumpable::find_corrupted_chunks(corrupted.data(), corrupted.size(), 4);
+    ASSERT_EQUAL(2, bad.size());
+    ASSERT_EQUAL(2, bad[0]);
+    ASSERT_EQUAL(40, bad[1]);
+
+    bool thrown = false;
+    try
+    {
+        dumpable::verify_image(file.data(), file.size() - 1);
+    }
+    catch(std::runtime_error&)
+    {
+        thrown = true;
+    }
+    ASSERT_EQUAL(true, thrown);
+
+    string path = "test_checksums.bin";
+    {
+        ofstream out(path.c_str(), ios::binary);
+        out.write(file.data(), file.size());
+    }
+    {
+        dumpable::verified_file f(path);
+        if (f.is_lazy())
+            ASSERT_EQUAL(0, f.verified_chunks());
+        const table* p = f.root<table>();
+        ASSERT_EQUAL("checked", p->name);
+        ASSERT_EQUAL(99999, p->rows[99999]);
+        ASSERT_EQUAL(5, p->rows[99998]);
+        if (f.is_lazy())
+            ASSERT_EQUAL(true, (f.verified_chunks() > 0 && f.verified_chunks() < f.chunk_count()));
+
+#ifdef DUMPABLE_POSIX
+        // the kernel reads an untouched range only after prefetch
+        size_t before = f.verified_chunks();
+        f.prefetch(50 * 4096 + 10, 4096);
+        if (f.is_lazy())
+            ASSERT_EQUAL(before + 2, f.verified_chunks());
+        int fds[2];
+        ASSERT_EQUAL(0, pipe(fds));
+        ASSERT_EQUAL(4096, write(fds[1], (const char*)f.data() + 50 * 4096 + 10, 4096));
+        char piped[4096];
+        ASSERT_EQUAL(4096, read(fds[0], piped, sizeof(piped)));
+        ASSERT_EQUAL(0, memcmp(piped, file.data() + 50 * 4096 + 10, sizeof(piped)));
+        close(fds[0]);
+        close(fds[1]);
+#endif
+        f.prefetch_all();
+        ASSERT_EQUAL(f.chunk_count(), f.verified_chunks());
+    }
+    {
+        ofstream out(path.c_str(), ios::binary);
+        out.write(corrupted.data(), corrupted.size());
+    }
+    thrown = false;
+    try
+    {
+        dumpable::verified_file f(path, dumpable::verified_file::verify_eager);
+    }
+    catch(std::runtime_error&)
+    {
+        thrown = true;
+    }
+    ASSERT_EQUAL(true, thrown);
+    std::remove(path.c_str());
+
+    thrown = false;
+    try
+    {
+        ostringstream zero;
+        dumpable::write_checksums(corrupted.data(), corrupted.size(), zero, 0);
+    }
+    catch(std::invalid_argument&)
+    {
+        thrown = true;
+    }
+    ASSERT_EQUAL(true, thrown);
+}
+
+TEST(versioned)
+{
+    struct player_v1
+    {
+        int id;
+        dstring name;
+        enum { version = 1 };
+    };
+    // v2 appends fields
+    struct player_v2
+    {
+        int id;
+        dstring name;
+        double score;
+        dstring team;
+        enum { version = 2 };
+    };
+    struct save_v1
+    {
+        dversioned<player_v1> hero;
+        dversioned_vector<player_v1> party;
+    };
+    struct save_v2
+    {
+        dversioned<player_v2> hero;
+        dversioned_vector<player_v2> party;
+    };
+
+    save_v1 old;
+    player_v1 p1 = {7, "alice"};
+    old.hero = p1;
+    for(int i = 0; i < 20; i ++)
+    {
+        player_v1 p = {i, "member"};
+        old.party.push_back(p);
+    }
+    ostringstream os;
+    dumpable::write(old, os);
+    string oldImage = os.str();
+
+    // a newer reader on an old image
+    const save_v2* s = dumpable::from_dumped_buffer<save_v2>(oldImage.data());
+    ASSERT_EQUAL(sizeof(player_v1), s->hero.stored_size());
+    ASSERT_EQUAL(7, s->hero->id);
+    ASSERT_EQUAL("alice", s->hero->name);
+    ASSERT_EQUAL(true, s->hero.has(1, &player_v2::name));
+    ASSERT_EQUAL(false, s->hero.has(2, &player_v2::score));
+    ASSERT_EQUAL(0.0, s->hero.get(2, &player_v2::score));
+    ASSERT_EQUAL(1.5, s->hero.get(2, &player_v2::score, 1.5));
+    ASSERT_EQUAL(true, s->hero.get(2, &player_v2::team).empty());
+    ASSERT_EQUAL(true, (s->hero.find(2, &player_v2::team) == nullptr));
+    ASSERT_EQUAL(20, s->party.size());
+    ASSERT_EQUAL(13, s->party[13].id);
+    ASSERT_EQUAL("member", s->party.get(19, 1, &player_v2::name));
+    ASSERT_EQUAL(-1.0, s->party.get(19, 2, &player_v2::score, -1.0));
+
+    bool thrown = false;
+    try
+    {
+        save_v2 copy;
+        copy.hero = s->hero;
+    }
+    catch(std::invalid_argument&)
+    {
+        thrown = true;
+    }
+    ASSERT_EQUAL(true, thrown);
+
+    // a new image, read by both versions
+    save_v2 current;
+    player_v2 p2 = {8, "bob", 99.5, "red"};
+    current.hero = p2;
+    current.party.push_back(p2);
+    ostringstream os2;
+    dumpable::write(current, os2);
+    string newImage = os2.str();
+    const save_v2* s2 = dumpable::from_dumped_buffer<save_v2>(newImage.data());
+    ASSERT_EQUAL(99.5, s2->hero.get(2, &player_v2::score));
+    ASSERT_EQUAL("red", s2->hero.get(2, &player_v2::team));
+    ASSERT_EQUAL("red", s2->party.get(0, 2, &player_v2::team));
+    const save_v1* s1 = dumpable::from_dumped_buffer<save_v1>(newImage.data());
+    ASSERT_EQUAL("bob", s1->hero->name);
+    ASSERT_EQUAL("bob", s1->party[0].name);
+    ASSERT_EQUAL(sizeof(player_v2), s1->party.stride());
+    ASSERT_EQUAL(2, s1->party.stored_version());
+
+    // c lands in what was tail padding of the first version, so both have the same size
+    struct padded_v1
+    {
+        double a;
+        int b;
+        enum { version = 1 };
+    };
+    struct padded_v2
+    {
+        double a;
+        int b;
+        int c;
+        enum { version = 2 };
+    };
+    ASSERT_EQUAL(sizeof(padded_v1), sizeof(padded_v2));
+    dversioned<padded_v1> small;
+    padded_v1 pv = {0.5, 3};
+    small = pv;
+    dversioned_vector<padded_v1> smalls;
+    smalls.push_back(pv);
+    ostringstream os3, os4;
+    dumpable::write(small, os3);
+    dumpable::write(smalls, os4);
+    string paddedImage = os3.str(), paddedVector = os4.str();
+    const dversioned<padded_v2>* pp = dumpable::from_dumped_buffer<dversioned<padded_v2>>(paddedImage.data());
+    ASSERT_EQUAL(3, pp->get(1, &padded_v2::b));
+    ASSERT_EQUAL(false, pp->has(2, &padded_v2::c));
+    ASSERT_EQUAL(42, pp->get(2, &padded_v2::c, 42));
+    const dversioned_vector<padded_v2>* pvs = dumpable::from_dumped_buffer<dversioned_vector<padded_v2>>(paddedVector.data());
+    ASSERT_EQUAL(false, pvs->has(2, &padded_v2::c));
+    ASSERT_EQUAL(42, pvs->get(0, 2, &padded_v2::c, 42));
+}
+
+#ifdef DUMPABLE_POSIX
+TEST(frame_reader)
+{
+    struct packet
+    {
+        int seq;
+        dstring text;
+        dvector<int> payload;
+    };
+
+    int fds[2];
+    ASSERT_EQUAL(0, socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+    const int count = 500;
+    std::thread sender([&]{
+            for(int i = 0; i < count; i ++)
+            {
+                packet p;
+                p.seq = i;
+                p.text = string(i % 13, 'a' + i % 26);
+                p.payload = vector<int>(i * 37 % 1000, i);
+                dumpable::send_dumped(fds[0], p);
+            }
+            close(fds[0]);
+        });
+
+    // a small ring, so frames wrap around its end
+    dumpable::frame_reader reader(fds[1], 64 * 1024);
+    deque<dumpable::frame_reader::message> held;
+    int received = 0;
+    bool ok = true;
+    while(dumpable::frame_reader::message m = reader.next())
+    {
+        const packet* p = m.root<packet>();
+        int i = received ++;
+        ok = ok && (size_t)m.data() % 8 == 0 && p->seq == i && p->text.size() == (size_t)(i % 13) &&
+            p->payload.size() == (size_t)(i * 37 % 1000) && (p->payload.empty() || p->payload.back() == i);
+        held.push_back(std::move(m));
+        // keep a few messages alive and release them out of order
+        if (held.size() == 4)
+        {
+            held[1].release();
+            held[3].release();
+            held[0].release();
+            held.clear();
+        }
+    }
+    held.clear();
+    sender.join();
+    close(fds[1]);
+    ASSERT_EQUAL(true, ok);
+    ASSERT_EQUAL(count, received);
+    ASSERT_EQUAL(0, reader.used());
+
+    // a frame larger than the ring, and hostile sizes that wrap around when padded
+    const std::uint64_t sizes[] = {1 << 20, ~(std::uint64_t)0, ~(std::uint64_t)0 - 6};
+    for(auto huge : sizes)
+    {
+        ASSERT_EQUAL(0, socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+        ASSERT_EQUAL((ssize_t)sizeof(huge), write(fds[0], &huge, sizeof(huge)));
+        dumpable::frame_reader small(fds[1], 4096);
+        bool thrown = false;
+        try
+        {
+            small.next();
+        }
+        catch(std::length_error&)
+        {
+            thrown = true;
+        }
+        ASSERT_EQUAL(true, thrown);
+        close(fds[0]);
+        close(fds[1]);
+    }
+}
+#endif
+
+TEST(optional_variant)
+{
+    struct move_cmd
+    {
+        float x, y;
+    };
+    struct chat_cmd
+    {
+        dstring text;
+        dvector<int> targets;
+    };
+    typedef dvariant<int, move_cmd, chat_cmd, dstring> command;
+    struct packet
+    {
+        doptional<int> sequence;
+        doptional<dstring> note;
+        doptional<chat_cmd> reply;
+        dvector<command> commands;
+        command last;
+    };
+
+    packet pk;
+    pk.sequence = 42;
+    pk.note = dstring("hello");
+    ASSERT_EQUAL(false, pk.reply.has_value());
+    vector<command> cmds(4);
+    move_cmd mv = {1.5f, -2.0f};
+    cmds[0] = 7;
+    cmds[1] = mv;
+    chat_cmd chat;
+    chat.text = "hi all";
+    chat.targets = vector<int>(3, 9);
+    cmds[2] = chat;
+    cmds[3] = dstring("bye");
+    pk.commands = cmds;
+    pk.last = chat;
+    ASSERT_EQUAL(2, pk.last.index());
+
+    ostringstream os;
+    dumpable::write(pk, os);
+    pk.last = 3;
+    pk.note.reset();
+    cmds.clear();
+    string buffer = os.str();
+    const packet* p = dumpable::from_dumped_buffer<packet>(buffer.data());
+
+    ASSERT_EQUAL(true, p->sequence.has_value());
+    ASSERT_EQUAL(42, *p->sequence);
+    ASSERT_EQUAL("hello", p->note.value());
+    ASSERT_EQUAL(false, (bool)p->reply);
+    chat_cmd fallback;
+    fallback.text = "none";
+    ASSERT_EQUAL("none", p->reply.value_or(fallback).text);
+    bool thrown = false;
+    try
+    {
+        p->reply.value();
+    }
+    catch(std::out_of_range&)
+    {
+        thrown = true;
+    }
+    ASSERT_EQUAL(true, thrown);
+
+    ASSERT_EQUAL(4, p->commands.size());
+    ASSERT_EQUAL(7, p->commands[0].get<int>());
+    ASSERT_EQUAL(-2.0f, p->commands[1].get<move_cmd>().y);
+    ASSERT_EQUAL(true, (p->commands[1].get_if<chat_cmd>() == nullptr));
+    ASSERT_EQUAL("hi all", p->commands[2].get<chat_cmd>().text);
+    ASSERT_EQUAL(9, p->commands[2].get<chat_cmd>().targets[2]);
+    ASSERT_EQUAL(true, p->commands[3].holds<dstring>());
+    ASSERT_EQUAL("hi all", p->last.get<chat_cmd>().text);
+
+    struct describe
+    {
+        string operator()(int v) const { return "int " + std::to_string(v); }
+        string operator()(const move_cmd& m) const { return "move " + std::to_string((int)m.x); }
+        string operator()(const chat_cmd& c) const { return "chat " + string(c.text.c_str()); }
+        string operator()(const dstring& s) const { return "text " + string(s.c_str()); }
+    };
+    string all;
+    for(size_t i = 0; i < p->commands.size(); i ++)
+        all += p->commands[i].visit(describe()) + ";";
+    ASSERT_EQUAL("int 7;move 1;chat hi all;text bye;", all);
+
+    thrown = false;
+    try
+    {
+        p->commands[0].get<dstring>();
+    }
+    catch(std::invalid_argument&)
+    {
+        thrown = true;
+    }
+    ASSERT_EQUAL(true, thrown);
+
+    // a throwing constructor leaves a valid first alternative, not a destroyed one
+    struct refuses
+    {
+        refuses() { throw std::runtime_error("refused"); }
+    };
+    {
+        dvariant<dstring, refuses> v(dstring("kept"));
+        thrown = false;
+        try
+        {
+            v.emplace<refuses>();
+        }
+        catch(std::runtime_error&)
+        {
+            thrown = true;
+        }
+        ASSERT_EQUAL(true, thrown);
+        ASSERT_EQUAL(0, v.index());
+        ASSERT_EQUAL(true, v.get<dstring>().empty());
+    }
+}
+
+TEST(convert_layout)
+{
+    struct conv_item
+    {
+        int id;
+        dstring name;
+        dvector<short> tags;
+        double weight;
+    };
+    struct conv_root
+    {
+        dvector<conv_item> items;
+        dmap<dstring, int> index;
+        dptr<conv_item> main;
+        char flag;
+        long long big;
+        doptional<int> maybe;
+        dvariant<int, dstring> choice;
+        int pos[3];
+        dumpable::size_t count;
+    };
+    dumpable::layout_schema schema(
+        "# the structs above\n"
+        "struct conv_item { i32 id; string name; vector<i16> tags; f64 weight; }\n"
+        "struct conv_root {\n"
+        "    vector<conv_item> items; map<string, i32> index; ptr<conv_item> main;\n"
+        "    char flag; i64 big; optional<i32> maybe; variant<i32, string> choice; i32 pos[3]; size count;\n"
+        "};\n");
+
+    conv_root r;
+    map<dstring, int> index;
+    vector<conv_item> items;
+    for(int i = 0; i < 3; i ++)
+    {
+        conv_item it;
+        it.id = i;
+        it.name = string("item ") + (char)('a' + i);
+        it.tags = vector<short>(i + 1, (short)(i * 10));
+        it.weight = i * 0.25;
+        items.push_back(it);
+        index[it.name] = i;
+    }
+    r.items = items;
+    r.index = index;
+    conv_item mainItem = items[2];
+    r.main = &mainItem;
+    r.flag = 'x';
+    r.big = 1LL << 40;
+    r.maybe = 5;
+    r.choice = dstring("chosen");
+    r.pos[0] = 1; r.pos[1] = 2; r.pos[2] = 3;
+    r.count = 77;
+    ostringstream os;
+    dumpable::write(r, os);
+    string image = os.str();
+
+    dumpable::abi_layout host = dumpable::abi_layout::host();
+    dumpable::abi_layout l32 = dumpable::abi_layout::native32();
+    dumpable::abi_layout compat32 = {8, 4};
+
+    // same layout: the image dumpable::write makes, with zeroed padding
+    ostringstream same;
+    dumpable::convert_layout(image.data(), image.size(), schema, "conv_root", host, host, same);
+    string native = same.str();
+    ASSERT_EQUAL(image.size(), native.size());
+    const conv_root* p = dumpable::from_dumped_buffer<conv_root>(native.data());
+    ASSERT_EQUAL(3, p->items.size());
+    ASSERT_EQUAL("item c", p->items[2].name);
+    ASSERT_EQUAL(20, p->items[2].tags[2]);
+    ASSERT_EQUAL(0.5, p->items[2].weight);
+    ASSERT_EQUAL(1, p->index.find(dstring("item b"))->second);
+    ASSERT_EQUAL("item c", p->main->name);
+    ASSERT_EQUAL('x', p->flag);
+    ASSERT_EQUAL(1LL << 40, p->big);
+    ASSERT_EQUAL(5, *p->maybe);
+    ASSERT_EQUAL("chosen", p->choice.get<dstring>());
+    ASSERT_EQUAL(3, p->pos[2]);
+    ASSERT_EQUAL(77, p->count);
+
+    // to 32-bit: smaller, with 32-bit words (the items vector is the first member)
+    ostringstream to32;
+    dumpable::convert_layout(image.data(), image.size(), schema, "conv_root", host, l32, to32);
+    string image32 = to32.str();
+    ASSERT_EQUAL(true, (image32.size() < image.size()));
+    uint32_t itemCount;
+    memcpy(&itemCount, image32.data() + 4, 4);
+    ASSERT_EQUAL(3, itemCount);
+
+    // and back, through the 32-bit x86 compatible layout too
+    ostringstream back, toCompat, fromCompat;
+    dumpable::convert_layout(image32.data(), image32.size(), schema, "conv_root", l32, host, back);
+    ASSERT_EQUAL(true, (back.str() == native));
+    dumpable::convert_layout(image32.data(), image32.size(), schema, "conv_root", l32, compat32, toCompat);
+    string compat = toCompat.str();
+    dumpable::convert_layout(compat.data(), compat.size(), schema, "conv_root", compat32, host, fromCompat);
+    ASSERT_EQUAL(true, (fromCompat.str() == native));
+
+    int errors = 0;
+    try
+    {
+        ostringstream out;
+        dumpable::convert_layout(image.data(), image.size() / 2, schema, "conv_root", host, l32, out);
+    }
+    catch(std::runtime_error&)
+    {
+        errors ++;
+    }
+    try
+    {
+        dumpable::layout_schema bad("struct a { missing m; }");
+    }
+    catch(std::invalid_argument&)
+    {
+        errors ++;
+    }
+    try
+    {
+        dumpable::layout_schema self("struct a { i32 x; a inner; }");
+        ostringstream out;
+        dumpable::convert_layout(image.data(), image.size(), self, "a", host, l32, out);
+    }
+    catch(std::invalid_argument&)
+    {
+        errors ++;
+    }
+
+    // payloads image_builder shares stay shared instead of being copied per reference
+    struct names
+    {
+        dvector<dstring> list;
+    };
+    names many;
+    many.list = vector<dstring>(500, dstring(string(200, 'n')));
+    dumpable::image_builder sharing(true);
+    ASSERT_EQUAL(0, sharing.add(many));
+    ostringstream sharedOs, sharedOut;
+    sharing.write(sharedOs);
+    string sharedImage = sharedOs.str();
+    ASSERT_EQUAL(true, (sharedImage.size() < 500 * 200));
+    dumpable::layout_schema namesSchema("struct names { vector<string> list; }");
+    dumpable::convert_layout(sharedImage.data(), sharedImage.size(), namesSchema, "names", host, host, sharedOut);
+    ASSERT_EQUAL(sharedImage.size(), sharedOut.str().size());
+    string sharedConverted = sharedOut.str();
+    ASSERT_EQUAL(200, dumpable::from_dumped_buffer<names>(sharedConverted.data())->list[499].size());
+
+    // corrupted images: a string size of 2^64-1, and two pointers leading to each other
+    dumpable::size_t word = sizeof(dumpable::size_t);
+    vector<char> corrupt(word * 4, 0);
+    dumpable::ptrdiff_t diff = word * 3;
+    dumpable::size_t hugeSize = ~(dumpable::size_t)0;
+    memcpy(&corrupt[0], &diff, word);
+    memcpy(&corrupt[word], &hugeSize, word);
+    try
+    {
+        dumpable::layout_schema named("struct named { string name; }");
+        ostringstream out;
+        dumpable::convert_layout(corrupt.data(), corrupt.size(), named, "named", host, host, out);
+    }
+    catch(std::runtime_error&)
+    {
+        errors ++;
+    }
+    vector<char> loop(word * 2, 0);
+    diff = word;
+    memcpy(&loop[0], &diff, word);
+    diff = -(dumpable::ptrdiff_t)word;
+    memcpy(&loop[word], &diff, word);
+    try
+    {
+        dumpable::layout_schema list("struct node { ptr<node> next; }");
+        ostringstream out;
+        dumpable::convert_layout(loop.data(), loop.size(), list, "node", host, host, out);
+    }
+    catch(std::runtime_error&)
+    {
+        errors ++;
+    }
+    // both pointers of every node lead to the next one: 2^40 copies of the last node unless refused
+    vector<char> fanout(word * 2 * 40, 0);
+    for(size_t i = 0; i + 1 < 40; i ++)
+    {
+        dumpable::ptrdiff_t toNext[2] = {(dumpable::ptrdiff_t)word * 2, (dumpable::ptrdiff_t)word};
+        memcpy(&fanout[i * word * 2], toNext, word * 2);
+    }
+    try
+    {
+        dumpable::layout_schema tree("struct fan { ptr<fan> a; ptr<fan> b; }");
+        ostringstream out;
+        dumpable::convert_layout(fanout.data(), fanout.size(), tree, "fan", host, host, out);
+    }
+    catch(std::runtime_error&)
+    {
+        errors ++;
+    }
+    ASSERT_EQUAL(6, errors);
+}
+
+TEST(image_handle)
+{
+    struct config
+    {
+        int version;
+        dstring name;
+        int check;
+    };
+
+    auto dump = [](int version) -> char*
+    {
+        config c;
+        c.version = version;
+        c.name = "config";
+        c.check = -version;
+        ostringstream os;
+        dumpable::write(c, os);
+        string s = os.str();
+        char* buffer = new char[s.size()];
+        copy(s.begin(), s.end(), buffer);
+        return buffer;
+    };
+
+    int released = 0;
+    auto deleter = [&released](void* buffer) { delete[] (char*)buffer; released ++; };
+
+    image_handle<config> handle;
+    handle.publish(dump(1), deleter);
+    {
+        image_handle<config>::reader r(handle);
+        auto g = r.lock();
+        ASSERT_EQUAL(1, g->version);
+        ASSERT_EQUAL("config", g->name);
+
+        handle.publish(dump(2), deleter);
+        // the old image is still visible through g
+        ASSERT_EQUAL(0, released);
+        ASSERT_EQUAL(1, handle.retired_count());
+        ASSERT_EQUAL(1, g->version);
+        ASSERT_EQUAL(2, r.lock()->version);
+    }
+    handle.reclaim();
+    ASSERT_EQUAL(1, released);
+    ASSERT_EQUAL(0, handle.retired_count());
+
+    atomic<bool> stop(false);
+    atomic<int> inconsistent(0);
+    vector<thread> readers;
+    for(int i = 0; i < 4; i ++)
+    {
+        readers.push_back(thread([&]{
+            image_handle<config>::reader r(handle);
+            while(!stop.load())
+            {
+                auto g = r.lock();
+                if (g->version != -g->check || g->name != "config")
+                    inconsistent ++;
+            }
+        }));
+    }
+    for(int i = 3; i < 200; i ++)
+        handle.publish(dump(i), deleter);
+    stop = true;
+    for(auto it = readers.begin(); it != readers.end(); ++it)
+        it->join();
+    handle.reclaim();
+    ASSERT_EQUAL(0, inconsistent.load());
+    ASSERT_EQUAL(198, released);
+}
+
 int testmain()
 {
     bool isAnyTestFailed = false;